@@ -0,0 +1,102 @@
+//请求流量的记录
+#include <time.h>
+#include <unistd.h>
+#include <cstring>
+#include "capture.h"
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t traffic_capture::open_conn(){
+    if(!m_path){
+        return 0;
+    }
+    m_locker.lock();
+    uint32_t conn = 0;
+    if(!m_failed){
+        conn = ++m_next_conn;
+        write_record(conn,REC_OPEN,0,0);
+    }
+    m_locker.unlock();
+    return conn;
+}
+
+void traffic_capture::data(uint32_t conn,const char* buf,int len){
+    if(!conn || len <= 0){
+        return;
+    }
+    m_locker.lock();
+    write_record(conn,REC_DATA,buf,len);
+    m_locker.unlock();
+}
+
+void traffic_capture::close_conn(uint32_t conn){
+    if(!conn){
+        return;
+    }
+    m_locker.lock();
+    write_record(conn,REC_CLOSE,0,0);
+    m_locker.unlock();
+}
+
+void traffic_capture::response(uint32_t conn){
+    if(!conn){
+        return;
+    }
+    m_locker.lock();
+    write_record(conn,REC_RESPONSE,0,0);
+    m_locker.unlock();
+}
+
+void traffic_capture::flush(){
+    m_locker.lock();
+    if(m_file){
+        fflush(m_file);
+    }
+    m_locker.unlock();
+}
+
+//调用者持有m_locker
+void traffic_capture::write_record(uint32_t conn,uint32_t type,const char* buf,uint32_t len){
+    if(m_failed){
+        return;
+    }
+    if(!m_file){
+        char path[4096];
+        snprintf(path,sizeof(path),"%s.%d",m_path,(int)getpid());
+        m_file = fopen(path,"wb");
+        if(!m_file){
+            perror("capture");
+            m_failed = true;
+            return;
+        }
+        //写文件只在stdio的缓冲区满了时发生，不在每次读之后
+        setvbuf(m_file,NULL,_IOFBF,1 << 20);
+        file_header header;
+        memcpy(header.magic,"HTCAPT01",8);
+        header.start_ns = now_ns();
+        fwrite(&header,sizeof(header),1,m_file);
+        m_bytes = sizeof(header);
+    }
+    if(m_bytes + (long long)sizeof(record) + len > MAX_BYTES){
+        printf("capture reached %lld bytes, stopped\n",MAX_BYTES);
+        fflush(m_file);
+        m_failed = true;
+        return;
+    }
+    record rec;
+    rec.ns = now_ns();
+    rec.conn = conn;
+    rec.type = type;
+    rec.len = len;
+    rec.reserved = 0;
+    if(fwrite(&rec,sizeof(rec),1,m_file) != 1 || (len && fwrite(buf,1,len,m_file) != len)){
+        perror("capture");
+        m_failed = true;
+        return;
+    }
+    m_bytes += sizeof(rec) + len;
+}
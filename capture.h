@@ -0,0 +1,67 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <cstdio>
+#include "locker.h"
+
+//把收到的原始请求数据和到达时间记录到文件中，用tools/replay按原来的连接和节奏回放，
+//用真实的请求组成评估性能改动。只记录客户端发来的数据，响应只记录发送完的时间点，
+//回放时据此区分客户端是等到响应之后才发送下一个请求，还是流水线发送。
+//每个进程写自己的文件（path.pid），连接的编号在进程内唯一。
+class traffic_capture{
+public:
+    //文件的格式：文件头之后是一串记录，DATA记录后面紧跟len字节数据。字节序为本机字节序
+    enum RECORD_TYPE{
+        REC_OPEN = 0,       //建立连接
+        REC_DATA,           //一次read()读到的数据
+        REC_CLOSE,          //连接关闭
+        REC_RESPONSE        //一个响应发送完
+    };
+    struct file_header{
+        char magic[8];      //"HTCAPT01"
+        uint64_t start_ns;  //开始记录时的CLOCK_MONOTONIC纳秒
+    };
+    struct record{
+        uint64_t ns;        //CLOCK_MONOTONIC纳秒
+        uint32_t conn;      //连接编号，从1开始
+        uint32_t type;
+        uint32_t len;       //DATA记录的数据长度，其余为0
+        uint32_t reserved;
+    };
+
+    static const long long MAX_BYTES = 1LL << 30;      //文件达到这个大小后停止记录
+
+    static traffic_capture& instance(){
+        static traffic_capture capture;
+        return capture;
+    }
+
+    //设置文件名前缀，启动时调用；文件在进程第一次记录时创建
+    void set_path(const char* path){m_path = path;}
+    bool enabled() const {return m_path != 0;}
+
+    //新连接，返回连接编号，没有开启或者已经停止时返回0
+    uint32_t open_conn();
+    void data(uint32_t conn,const char* buf,int len);
+    void close_conn(uint32_t conn);
+    void response(uint32_t conn);
+    //把缓冲的记录写进文件，退出时调用
+    void flush();
+
+private:
+    traffic_capture():m_path(0),m_file(0),m_failed(false),m_bytes(0),m_next_conn(0),m_locker("capture"){}
+
+    void write_record(uint32_t conn,uint32_t type,const char* buf,uint32_t len);
+
+private:
+    const char* m_path;
+    FILE* m_file;
+    bool m_failed;          //创建文件失败或者达到大小上限
+    long long m_bytes;
+    uint32_t m_next_conn;
+    //数据只在主线程中记录，关闭连接可能发生在工作线程中
+    locker m_locker;
+};
+
+#endif
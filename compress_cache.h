@@ -0,0 +1,161 @@
+#ifndef COMPRESS_CACHE_H
+#define COMPRESS_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <zlib.h>
+#include "locker.h"
+
+//gzip压缩结果缓存
+//以文件的(设备号,inode,大小,修改时间)作为键，文件被修改后键随之变化，旧的结果会被LRU淘汰。
+//压缩由调用get()的工作线程完成，不会在主线程（reactor）上执行；
+//同一个文件同时有多个请求未命中时，只有第一个请求做压缩，其他请求等待它的结果。
+class compress_cache{
+public:
+    typedef std::shared_ptr<const std::string> data_ptr;
+
+    static const size_t DEFAULT_CAPACITY = 64 * 1024 * 1024;   //缓存总大小上限
+    static const size_t MIN_FILE_SIZE = 256;                   //太小的文件压缩不划算
+    static const size_t MAX_FILE_SIZE = 8 * 1024 * 1024;       //太大的文件不放进缓存
+
+    static compress_cache& instance(){
+        static compress_cache cache(DEFAULT_CAPACITY);
+        return cache;
+    }
+
+    explicit compress_cache(size_t capacity):m_capacity(capacity),m_size(0),m_locker("compress_cache"){}
+
+    //返回文件gzip压缩后的内容，不值得压缩或者压缩失败时返回空指针
+    data_ptr get(const char* path,const struct stat& st){
+        if(st.st_size < (off_t)MIN_FILE_SIZE || st.st_size > (off_t)MAX_FILE_SIZE){
+            return data_ptr();
+        }
+        std::string key = make_key(st);
+
+        m_locker.lock();
+        entry_map::iterator it = m_entries.find(key);
+        if(it != m_entries.end()){
+            //其他线程正在压缩同一个文件，等待它完成
+            while(it != m_entries.end() && it->second.pending){
+                m_cond.wait(m_locker);
+                it = m_entries.find(key);
+            }
+            if(it != m_entries.end()){
+                m_lru.splice(m_lru.begin(),m_lru,it->second.lru_pos);
+                data_ptr data = it->second.data;
+                m_locker.unlock();
+                return data;
+            }
+        }
+        //未命中，插入一个正在压缩的占位项
+        m_lru.push_front(key);
+        entry& e = m_entries[key];
+        e.pending = true;
+        e.lru_pos = m_lru.begin();
+        m_locker.unlock();
+
+        data_ptr data = compress_file(path,st.st_size);
+
+        m_locker.lock();
+        it = m_entries.find(key);
+        it->second.pending = false;
+        it->second.data = data;
+        m_size += cost(key,data);
+        evict();
+        m_cond.broadcast(m_locker.get());
+        m_locker.unlock();
+        return data;
+    }
+
+private:
+    struct entry{
+        bool pending;
+        data_ptr data;                              //空指针表示不值得压缩，同样缓存下来避免重复尝试
+        std::list<std::string>::iterator lru_pos;
+    };
+    typedef std::unordered_map<std::string,entry> entry_map;
+
+    static std::string make_key(const struct stat& st){
+        char buf[128];
+        snprintf(buf,sizeof(buf),"%llx:%llx:%llx:%lld.%09ld",
+                 (unsigned long long)st.st_dev,(unsigned long long)st.st_ino,
+                 (unsigned long long)st.st_size,(long long)st.st_mtim.tv_sec,st.st_mtim.tv_nsec);
+        return buf;
+    }
+
+    //一个缓存项占用的大小，不值得压缩的项也要计入，否则它们可以无限增长
+    static size_t cost(const std::string& key,const data_ptr& data){
+        return key.size() + sizeof(entry) + (data ? data->size() : 0);
+    }
+
+    //读取文件并做gzip压缩，压缩后没有变小则返回空指针
+    static data_ptr compress_file(const char* path,off_t size){
+        int fd = open(path,O_RDONLY);
+        if(fd < 0){
+            return data_ptr();
+        }
+        void* src = mmap(0,size,PROT_READ,MAP_PRIVATE,fd,0);
+        close(fd);
+        if(src == MAP_FAILED){
+            return data_ptr();
+        }
+
+        std::string* out = new std::string;
+        z_stream zs;
+        memset(&zs,0,sizeof(zs));
+        //windowBits + 16 表示输出gzip格式
+        if(deflateInit2(&zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15 + 16,8,Z_DEFAULT_STRATEGY) != Z_OK){
+            munmap(src,size);
+            delete out;
+            return data_ptr();
+        }
+        out->resize(deflateBound(&zs,size));
+        zs.next_in = (Bytef*)src;
+        zs.avail_in = size;
+        zs.next_out = (Bytef*)&(*out)[0];
+        zs.avail_out = out->size();
+        int ret = deflate(&zs,Z_FINISH);
+        out->resize(zs.total_out);
+        deflateEnd(&zs);
+        munmap(src,size);
+
+        if(ret != Z_STREAM_END || out->size() >= (size_t)size){
+            delete out;
+            return data_ptr();
+        }
+        return data_ptr(out);
+    }
+
+    //淘汰最久没有使用的已完成项，直到总大小不超过上限
+    void evict(){
+        std::list<std::string>::iterator pos = m_lru.end();
+        while(m_size > m_capacity && pos != m_lru.begin()){
+            --pos;
+            entry_map::iterator it = m_entries.find(*pos);
+            if(it->second.pending){
+                continue;
+            }
+            m_size -= cost(*pos,it->second.data);
+            m_entries.erase(it);
+            pos = m_lru.erase(pos);
+        }
+    }
+
+private:
+    size_t m_capacity;
+    size_t m_size;                          //缓存中所有已完成项的总大小
+    entry_map m_entries;
+    std::list<std::string> m_lru;           //表头是最近使用的
+    locker m_locker;
+    cond m_cond;
+};
+
+#endif
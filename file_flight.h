@@ -0,0 +1,125 @@
+#ifndef FILE_FLIGHT_H
+#define FILE_FLIGHT_H
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+//打开一个文件的结果，由同时请求它的连接共享，最后一个使用者释放时munmap/close
+struct open_file{
+    bool found;             //stat是否成功
+    struct stat st;
+    int fd;                 //大文件保留的文件描述符，按窗口映射，否则为-1
+    char* address;          //小文件整体映射的地址，空文件、目录或者没有读权限时为0
+
+    open_file():found(false),fd(-1),address(0){}
+    ~open_file(){
+        if(address){
+            munmap(address,st.st_size);
+        }
+        if(fd != -1){
+            close(fd);
+        }
+    }
+};
+
+//按路径合并同时到达的打开请求（single-flight）。
+//第一个请求在自己的工作线程中完成stat、open和mmap，同一路径的其他请求在各自的工作线程里等待并共享结果，
+//主线程（reactor）不会被阻塞。结果不缓存，做完就从表中移除，之后的请求会重新打开，文件更新能立即看到。
+class file_flight{
+public:
+    typedef std::shared_ptr<const open_file> file_ptr;
+
+    static file_flight& instance(){
+        static file_flight flight;
+        return flight;
+    }
+
+    file_flight():m_leaders(0),m_followers(0),m_locker("file_flight"){}
+
+    //打开path，大于map_limit的文件不整体映射；open或者mmap失败返回空指针
+    file_ptr open(const char* path,off_t map_limit){
+        std::string key(path);
+        m_locker.lock();
+        flight_map::iterator it = m_flights.find(key);
+        if(it != m_flights.end()){
+            //同一路径正在打开，等待它完成
+            std::shared_ptr<flight> f = it->second;
+            m_followers.fetch_add(1,std::memory_order_relaxed);
+            while(!f->done){
+                m_cond.wait(m_locker);
+            }
+            m_locker.unlock();
+            return f->result;
+        }
+        std::shared_ptr<flight> f(new flight);
+        m_flights[key] = f;
+        m_leaders.fetch_add(1,std::memory_order_relaxed);
+        m_locker.unlock();
+
+        file_ptr result = load(path,map_limit);
+
+        m_locker.lock();
+        f->result = result;
+        f->done = true;
+        m_flights.erase(key);
+        m_cond.broadcast(m_locker.get());
+        m_locker.unlock();
+        return result;
+    }
+
+    //真正执行了打开的次数，以及等待并共享了别人结果的次数
+    unsigned long long leaders() const {return m_leaders.load(std::memory_order_relaxed);}
+    unsigned long long followers() const {return m_followers.load(std::memory_order_relaxed);}
+
+private:
+    struct flight{
+        bool done;
+        file_ptr result;
+        flight():done(false){}
+    };
+    typedef std::unordered_map<std::string,std::shared_ptr<flight> > flight_map;
+
+    static file_ptr load(const char* path,off_t map_limit){
+        open_file* f = new open_file;
+        file_ptr result(f);
+        if(stat(path,&f->st) < 0){
+            return result;
+        }
+        f->found = true;
+        //不能发送的文件只需要状态，由调用者返回相应的错误
+        if(!S_ISREG(f->st.st_mode) || !(f->st.st_mode & S_IROTH) || f->st.st_size == 0){
+            return result;
+        }
+        int fd = ::open(path,O_RDONLY);
+        if(fd < 0){
+            return file_ptr();
+        }
+        if(f->st.st_size > map_limit){
+            f->fd = fd;
+            return result;
+        }
+        void* addr = mmap(0,f->st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        close(fd);
+        if(addr == MAP_FAILED){
+            return file_ptr();
+        }
+        f->address = (char*)addr;
+        return result;
+    }
+
+private:
+    flight_map m_flights;                   //正在打开的路径
+    std::atomic<unsigned long long> m_leaders;
+    std::atomic<unsigned long long> m_followers;
+    locker m_locker;
+    cond m_cond;
+};
+
+#endif
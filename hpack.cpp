@@ -0,0 +1,339 @@
+//HPACK头部压缩的实现
+#include <cstring>
+#include "hpack.h"
+
+//静态表，RFC 7541 附录A，索引从1开始
+static const char* const static_table[][2] = {
+    {":authority",""},
+    {":method","GET"},
+    {":method","POST"},
+    {":path","/"},
+    {":path","/index.html"},
+    {":scheme","http"},
+    {":scheme","https"},
+    {":status","200"},
+    {":status","204"},
+    {":status","206"},
+    {":status","304"},
+    {":status","400"},
+    {":status","404"},
+    {":status","500"},
+    {"accept-charset",""},
+    {"accept-encoding","gzip, deflate"},
+    {"accept-language",""},
+    {"accept-ranges",""},
+    {"accept",""},
+    {"access-control-allow-origin",""},
+    {"age",""},
+    {"allow",""},
+    {"authorization",""},
+    {"cache-control",""},
+    {"content-disposition",""},
+    {"content-encoding",""},
+    {"content-language",""},
+    {"content-length",""},
+    {"content-location",""},
+    {"content-range",""},
+    {"content-type",""},
+    {"cookie",""},
+    {"date",""},
+    {"etag",""},
+    {"expect",""},
+    {"expires",""},
+    {"from",""},
+    {"host",""},
+    {"if-match",""},
+    {"if-modified-since",""},
+    {"if-none-match",""},
+    {"if-range",""},
+    {"if-unmodified-since",""},
+    {"last-modified",""},
+    {"link",""},
+    {"location",""},
+    {"max-forwards",""},
+    {"proxy-authenticate",""},
+    {"proxy-authorization",""},
+    {"range",""},
+    {"referer",""},
+    {"refresh",""},
+    {"retry-after",""},
+    {"server",""},
+    {"set-cookie",""},
+    {"strict-transport-security",""},
+    {"transfer-encoding",""},
+    {"user-agent",""},
+    {"vary",""},
+    {"via",""},
+    {"www-authenticate",""},
+};
+static const size_t STATIC_TABLE_SIZE = sizeof(static_table) / sizeof(static_table[0]);
+
+//Huffman编码表，RFC 7541 附录B，下标是字节值
+static const unsigned int huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+static const unsigned char huffman_code_len[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+//Huffman解码树，第一次使用时根据编码表构造
+struct huffman_tree{
+    struct node{
+        short child[2];     //子节点下标，-1表示没有
+        short sym;          //叶子节点对应的字节，非叶子为-1
+    };
+    node nodes[512];
+    int count;
+
+    huffman_tree():count(1){
+        nodes[0].child[0] = nodes[0].child[1] = -1;
+        nodes[0].sym = -1;
+        for(int sym = 0;sym < 256;++sym){
+            int cur = 0;
+            for(int i = huffman_code_len[sym] - 1;i >= 0;--i){
+                int bit = (huffman_codes[sym] >> i) & 1;
+                if(nodes[cur].child[bit] < 0){
+                    nodes[count].child[0] = nodes[count].child[1] = -1;
+                    nodes[count].sym = -1;
+                    nodes[cur].child[bit] = count++;
+                }
+                cur = nodes[cur].child[bit];
+            }
+            nodes[cur].sym = sym;
+        }
+    }
+};
+
+static bool huffman_decode(const unsigned char* data,size_t len,std::string& out){
+    static const huffman_tree tree;
+    int cur = 0;
+    int pending_bits = 0;   //上一个完整符号之后读入的位数
+    bool all_ones = true;   //这些位是否全为1，结尾的填充必须是EOS的前缀
+    for(size_t i = 0;i < len;++i){
+        for(int b = 7;b >= 0;--b){
+            int bit = (data[i] >> b) & 1;
+            cur = tree.nodes[cur].child[bit];
+            if(cur < 0){
+                return false;   //EOS或者非法编码
+            }
+            ++pending_bits;
+            all_ones = all_ones && bit;
+            if(tree.nodes[cur].sym >= 0){
+                out.push_back((char)tree.nodes[cur].sym);
+                cur = 0;
+                pending_bits = 0;
+                all_ones = true;
+            }
+        }
+    }
+    return pending_bits <= 7 && all_ones;
+}
+
+//解码前缀为prefix位的整数，RFC 7541 5.1
+static bool decode_integer(const unsigned char*& p,const unsigned char* end,int prefix,size_t& value){
+    if(p >= end){
+        return false;
+    }
+    size_t max_prefix = (1u << prefix) - 1;
+    value = *p++ & max_prefix;
+    if(value < max_prefix){
+        return true;
+    }
+    int shift = 0;
+    while(p < end){
+        unsigned char c = *p++;
+        if(shift > 28){
+            return false;
+        }
+        value += (size_t)(c & 0x7f) << shift;
+        shift += 7;
+        if(!(c & 0x80)){
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool decode_string(const unsigned char*& p,const unsigned char* end,std::string& out){
+    if(p >= end){
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    size_t len;
+    if(!decode_integer(p,end,7,len) || len > (size_t)(end - p)){
+        return false;
+    }
+    out.clear();
+    if(huffman){
+        if(!huffman_decode(p,len,out)){
+            return false;
+        }
+    }else{
+        out.assign((const char*)p,len);
+    }
+    p += len;
+    return true;
+}
+
+static void encode_integer(std::string& out,unsigned char first,int prefix,size_t value){
+    size_t max_prefix = (1u << prefix) - 1;
+    if(value < max_prefix){
+        out.push_back((char)(first | value));
+        return;
+    }
+    out.push_back((char)(first | max_prefix));
+    value -= max_prefix;
+    while(value >= 128){
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+hpack_decoder::hpack_decoder(size_t max_table_size,size_t max_list_size):
+    m_max_table_size(max_table_size),m_table_limit(max_table_size),m_table_size(0),m_max_list_size(max_list_size){
+}
+
+bool hpack_decoder::lookup(size_t index,hpack_header& header) const{
+    if(index == 0){
+        return false;
+    }
+    if(index <= STATIC_TABLE_SIZE){
+        header.first = static_table[index - 1][0];
+        header.second = static_table[index - 1][1];
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if(index >= m_table.size()){
+        return false;
+    }
+    header = m_table[index];
+    return true;
+}
+
+void hpack_decoder::evict(size_t max_size){
+    while(m_table_size > max_size && !m_table.empty()){
+        m_table_size -= m_table.back().first.size() + m_table.back().second.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::add(const hpack_header& header){
+    size_t size = header.first.size() + header.second.size() + 32;
+    //比整个表还大的条目会清空动态表，本身也不加入
+    evict(size > m_table_limit ? 0 : m_table_limit - size);
+    if(size <= m_table_limit){
+        m_table.push_front(header);
+        m_table_size += size;
+    }
+}
+
+hpack_decoder::DECODE_RESULT hpack_decoder::decode(const unsigned char* data,size_t len,std::vector<hpack_header>& headers){
+    const unsigned char* p = data;
+    const unsigned char* end = data + len;
+    size_t list_size = 0;
+    while(p < end){
+        unsigned char c = *p;
+        size_t index;
+        hpack_header header;
+        if(c & 0x80){
+            //完全索引的头部 1xxxxxxx
+            if(!decode_integer(p,end,7,index) || !lookup(index,header)){
+                return DECODE_ERROR;
+            }
+        }else if((c & 0xe0) == 0x20){
+            //动态表大小更新 001xxxxx
+            if(!decode_integer(p,end,5,index) || index > m_max_table_size){
+                return DECODE_ERROR;
+            }
+            m_table_limit = index;
+            evict(m_table_limit);
+            continue;
+        }else{
+            //字面量：01xxxxxx加入索引，0000xxxx不加入索引，0001xxxx永不索引
+            bool indexing = (c & 0xc0) == 0x40;
+            if(!decode_integer(p,end,indexing ? 6 : 4,index)){
+                return DECODE_ERROR;
+            }
+            if(index){
+                if(!lookup(index,header)){
+                    return DECODE_ERROR;
+                }
+            }else if(!decode_string(p,end,header.first)){
+                return DECODE_ERROR;
+            }
+            if(!decode_string(p,end,header.second)){
+                return DECODE_ERROR;
+            }
+            if(indexing){
+                add(header);
+            }
+        }
+        list_size += header.first.size() + header.second.size() + 32;
+        if(list_size > m_max_list_size){
+            return DECODE_TOO_LARGE;
+        }
+        headers.push_back(header);
+    }
+    return DECODE_OK;
+}
+
+void hpack_encoder::add_indexed(std::string& out,int index){
+    encode_integer(out,0x80,7,index);
+}
+
+void hpack_encoder::add_literal(std::string& out,int name_index,const char* value,size_t len){
+    encode_integer(out,0x00,4,name_index);
+    encode_integer(out,0x00,7,len);
+    out.append(value,len);
+}
+
+void hpack_encoder::add_literal(std::string& out,int name_index,const char* value){
+    add_literal(out,name_index,value,strlen(value));
+}
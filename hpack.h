@@ -0,0 +1,66 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+
+//HPACK（RFC 7541）头部压缩，HTTP/2使用
+
+typedef std::pair<std::string,std::string> hpack_header;
+
+//解码器：维护静态表和动态表，每个HTTP/2连接一个
+class hpack_decoder{
+public:
+    enum DECODE_RESULT{DECODE_OK = 0,DECODE_ERROR,DECODE_TOO_LARGE};
+
+    //max_list_size是解码后头部列表的上限（SETTINGS_MAX_HEADER_LIST_SIZE），每项按name + value + 32计算
+    explicit hpack_decoder(size_t max_table_size = 4096,size_t max_list_size = 16384);
+
+    //解码一个完整的头部块，头部按出现顺序追加到headers。格式错误返回DECODE_ERROR（连接错误COMPRESSION_ERROR）；
+    //解码出的头部超过max_list_size时立即停止并返回DECODE_TOO_LARGE，很小的头部块反复引用动态表中的大条目
+    //可以展开成几百倍的数据。两种情况下动态表都可能已经和对端不一致，连接不能再继续使用
+    DECODE_RESULT decode(const unsigned char* data,size_t len,std::vector<hpack_header>& headers);
+
+private:
+    bool lookup(size_t index,hpack_header& header) const;  //按索引查找静态表和动态表
+    void add(const hpack_header& header);                   //插入动态表表头
+    void evict(size_t max_size);                            //淘汰表尾直到大小不超过max_size
+
+    size_t m_max_table_size;    //SETTINGS_HEADER_TABLE_SIZE，动态表大小更新不能超过它
+    size_t m_table_limit;       //对端通过动态表大小更新设置的当前上限
+    size_t m_table_size;        //动态表当前大小，每项为name + value + 32
+    size_t m_max_list_size;     //解码后头部列表的上限
+    std::deque<hpack_header> m_table;
+};
+
+//编码器：响应头都用不加入索引的字面量编码，不需要维护动态表
+class hpack_encoder{
+public:
+    //静态表中完整匹配的条目，例如 :status 200
+    static void add_indexed(std::string& out,int index);
+    //名字使用静态表索引，值用字面量
+    static void add_literal(std::string& out,int name_index,const char* value,size_t len);
+    static void add_literal(std::string& out,int name_index,const char* value);
+};
+
+//静态表中用到的索引
+enum HPACK_STATIC_INDEX{
+    HPACK_STATUS = 8,           // :status 200
+    HPACK_STATUS_200 = 8,
+    HPACK_STATUS_204 = 9,
+    HPACK_STATUS_206 = 10,
+    HPACK_STATUS_304 = 11,
+    HPACK_STATUS_400 = 12,
+    HPACK_STATUS_404 = 13,
+    HPACK_STATUS_500 = 14,
+    HPACK_CONTENT_ENCODING = 26,
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_TYPE = 31,
+    HPACK_RETRY_AFTER = 53,
+    HPACK_VARY = 59
+};
+
+#endif
@@ -0,0 +1,590 @@
+//HTTP/2明文（h2c）会话
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include "http2.h"
+#include "http_conn.h"
+
+//帧类型
+enum FRAME_TYPE{FRAME_DATA = 0,FRAME_HEADERS,FRAME_PRIORITY,FRAME_RST_STREAM,FRAME_SETTINGS,
+                FRAME_PUSH_PROMISE,FRAME_PING,FRAME_GOAWAY,FRAME_WINDOW_UPDATE,FRAME_CONTINUATION};
+
+//帧标志
+const uint8_t FLAG_END_STREAM = 0x1;
+const uint8_t FLAG_ACK = 0x1;
+const uint8_t FLAG_END_HEADERS = 0x4;
+const uint8_t FLAG_PADDED = 0x8;
+const uint8_t FLAG_PRIORITY = 0x20;
+
+//SETTINGS参数
+enum SETTINGS_ID{SETTINGS_HEADER_TABLE_SIZE = 1,SETTINGS_ENABLE_PUSH,SETTINGS_MAX_CONCURRENT_STREAMS,
+                 SETTINGS_INITIAL_WINDOW_SIZE,SETTINGS_MAX_FRAME_SIZE,SETTINGS_MAX_HEADER_LIST_SIZE};
+
+const long long MAX_WINDOW_SIZE = 0x7fffffff;
+
+static uint32_t read_u32(const unsigned char* p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(char* p,uint32_t v){
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+//帧头：长度(24) 类型(8) 标志(8) 保留位(1) 流ID(31)
+static void put_frame_header(char* p,uint32_t len,uint8_t type,uint8_t flags,uint32_t stream_id){
+    p[0] = (char)(len >> 16);
+    p[1] = (char)(len >> 8);
+    p[2] = (char)len;
+    p[3] = (char)type;
+    p[4] = (char)flags;
+    put_u32(p + 5,stream_id & 0x7fffffff);
+}
+
+static void append_u32(std::string& out,uint32_t v){
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+//HTTP2-Settings头部使用base64url编码，不带填充
+static bool base64url_decode(const char* in,std::string& out){
+    unsigned int acc = 0;
+    int bits = 0;
+    for(const char* p = in;*p && *p != '=';++p){
+        int v;
+        char c = *p;
+        if(c >= 'A' && c <= 'Z') v = c - 'A';
+        else if(c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if(c >= '0' && c <= '9') v = c - '0' + 52;
+        else if(c == '-' || c == '+') v = 62;
+        else if(c == '_' || c == '/') v = 63;
+        else if(c == ' ' || c == '\t') continue;
+        else return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if(bits >= 8){
+            bits -= 8;
+            out.push_back((char)((acc >> bits) & 0xff));
+        }
+    }
+    return true;
+}
+
+const char* http2_session::preface(){
+    return "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+}
+
+http2_session::http2_session(http_conn* conn):
+    m_conn(conn),m_out_off(0),m_preface_received(false),m_goaway_sent(false),m_goaway_received(false),
+    m_decoder(4096,MAX_HEADER_LIST_SIZE),m_header_stream(0),m_header_end_stream(false),m_last_stream_id(0),
+    m_peer_max_frame(16384),m_peer_initial_window(65535),m_send_window(65535),m_rr_cursor(0){
+}
+
+http2_session::~http2_session(){
+    for(stream_map::iterator it = m_streams.begin();it != m_streams.end();++it){
+        delete it->second.producer;
+    }
+}
+
+void http2_session::start(){
+    send_settings();
+}
+
+bool http2_session::start_upgrade(const char* settings,bool head,h2_response& res){
+    std::string payload;
+    if(!base64url_decode(settings,payload) || payload.size() % 6 != 0){
+        return false;
+    }
+    m_out.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    send_settings();
+    //101响应就是对这些参数的确认，不需要再发送SETTINGS ACK
+    if(!apply_settings((const unsigned char*)payload.data(),payload.size())){
+        return false;
+    }
+    //原请求成为流1，客户端一侧已经关闭
+    m_last_stream_id = 1;
+    start_response(1,head,res);
+    return true;
+}
+
+void http2_session::consume(size_t n){
+    m_out_off += n;
+    if(m_out_off == m_out.size()){
+        m_out.clear();
+        m_out_off = 0;
+    }
+}
+
+bool http2_session::done() const{
+    if(out_len() > 0){
+        return false;
+    }
+    return m_goaway_sent || (m_goaway_received && m_streams.empty());
+}
+
+void http2_session::write_frame_header(uint32_t len,uint8_t type,uint8_t flags,uint32_t stream_id){
+    char header[9];
+    put_frame_header(header,len,type,flags,stream_id);
+    m_out.append(header,9);
+}
+
+void http2_session::send_settings(){
+    write_frame_header(12,FRAME_SETTINGS,0,0);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_MAX_CONCURRENT_STREAMS);
+    append_u32(m_out,MAX_CONCURRENT_STREAMS);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_MAX_HEADER_LIST_SIZE);
+    append_u32(m_out,MAX_HEADER_LIST_SIZE);
+}
+
+void http2_session::send_window_update(uint32_t stream_id,uint32_t increment){
+    write_frame_header(4,FRAME_WINDOW_UPDATE,0,stream_id);
+    append_u32(m_out,increment);
+}
+
+void http2_session::send_rst_stream(uint32_t stream_id,ERROR_CODE code){
+    write_frame_header(4,FRAME_RST_STREAM,0,stream_id);
+    append_u32(m_out,code);
+}
+
+void http2_session::goaway(ERROR_CODE code){
+    if(m_goaway_sent){
+        return;
+    }
+    write_frame_header(8,FRAME_GOAWAY,0,0);
+    append_u32(m_out,m_last_stream_id);
+    append_u32(m_out,code);
+    m_goaway_sent = true;
+    m_in.clear();
+}
+
+void http2_session::on_data(const char* data,size_t len){
+    if(m_goaway_sent){
+        return;
+    }
+    m_in.append(data,len);
+    size_t pos = 0;
+    if(!m_preface_received){
+        size_t n = m_in.size() < PREFACE_LEN ? m_in.size() : PREFACE_LEN;
+        if(memcmp(m_in.data(),preface(),n) != 0){
+            goaway(PROTOCOL_ERROR);
+            return;
+        }
+        if(n < PREFACE_LEN){
+            return;
+        }
+        m_preface_received = true;
+        pos = PREFACE_LEN;
+    }
+    //帧头：长度(24) 类型(8) 标志(8) 保留位(1) 流ID(31)
+    while(!m_goaway_sent && m_in.size() - pos >= 9){
+        const unsigned char* p = (const unsigned char*)m_in.data() + pos;
+        uint32_t length = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        if(length > MAX_FRAME_SIZE){
+            goaway(FRAME_SIZE_ERROR);
+            return;
+        }
+        if(m_in.size() - pos - 9 < length){
+            break;
+        }
+        handle_frame(p[3],p[4],read_u32(p + 5) & 0x7fffffff,p + 9,length);
+        pos += 9 + length;
+    }
+    if(!m_goaway_sent){
+        m_in.erase(0,pos);
+    }
+}
+
+void http2_session::handle_frame(uint8_t type,uint8_t flags,uint32_t stream_id,const unsigned char* payload,uint32_t len){
+    //头部块必须连续，中间不能插入其他帧
+    if(m_header_stream && (type != FRAME_CONTINUATION || stream_id != m_header_stream)){
+        goaway(PROTOCOL_ERROR);
+        return;
+    }
+    switch(type){
+        case FRAME_DATA:{
+            if(stream_id == 0){
+                goaway(PROTOCOL_ERROR);
+                return;
+            }
+            //请求体直接丢弃，立即归还流量控制窗口
+            if(len > 0){
+                send_window_update(0,len);
+                if(m_streams.count(stream_id) && !(flags & FLAG_END_STREAM)){
+                    send_window_update(stream_id,len);
+                }
+            }
+            break;
+        }
+        case FRAME_HEADERS:{
+            if(stream_id == 0 || stream_id % 2 == 0){
+                goaway(PROTOCOL_ERROR);
+                return;
+            }
+            uint32_t pad = 0;
+            if(flags & FLAG_PADDED){
+                if(len < 1){
+                    goaway(PROTOCOL_ERROR);
+                    return;
+                }
+                pad = payload[0];
+                ++payload;
+                --len;
+            }
+            if(flags & FLAG_PRIORITY){
+                if(len < 5){
+                    goaway(PROTOCOL_ERROR);
+                    return;
+                }
+                payload += 5;
+                len -= 5;
+            }
+            if(pad > len){
+                goaway(PROTOCOL_ERROR);
+                return;
+            }
+            m_header_block.assign((const char*)payload,len - pad);
+            m_header_end_stream = flags & FLAG_END_STREAM;
+            m_header_stream = stream_id;
+            if(flags & FLAG_END_HEADERS){
+                handle_headers(stream_id);
+            }
+            break;
+        }
+        case FRAME_CONTINUATION:{
+            if(!m_header_stream){
+                goaway(PROTOCOL_ERROR);
+                return;
+            }
+            m_header_block.append((const char*)payload,len);
+            if(m_header_block.size() > 64 * 1024){
+                goaway(PROTOCOL_ERROR);
+                return;
+            }
+            if(flags & FLAG_END_HEADERS){
+                handle_headers(stream_id);
+            }
+            break;
+        }
+        case FRAME_PRIORITY:
+            //不支持优先级，按轮转顺序发送
+            if(len != 5){
+                goaway(FRAME_SIZE_ERROR);
+            }
+            break;
+        case FRAME_RST_STREAM:{
+            if(len != 4 || stream_id == 0){
+                goaway(len != 4 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+                return;
+            }
+            stream_map::iterator it = m_streams.find(stream_id);
+            if(it != m_streams.end()){
+                close_stream(it);
+            }
+            break;
+        }
+        case FRAME_SETTINGS:{
+            if(stream_id != 0){
+                goaway(PROTOCOL_ERROR);
+                return;
+            }
+            if(flags & FLAG_ACK){
+                break;
+            }
+            if(len % 6 != 0){
+                goaway(FRAME_SIZE_ERROR);
+                return;
+            }
+            if(!apply_settings(payload,len)){
+                return;
+            }
+            write_frame_header(0,FRAME_SETTINGS,FLAG_ACK,0);
+            break;
+        }
+        case FRAME_PUSH_PROMISE:
+            //客户端不能推送
+            goaway(PROTOCOL_ERROR);
+            break;
+        case FRAME_PING:{
+            if(stream_id != 0 || len != 8){
+                goaway(len != 8 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+                return;
+            }
+            if(!(flags & FLAG_ACK)){
+                write_frame_header(8,FRAME_PING,FLAG_ACK,0);
+                m_out.append((const char*)payload,8);
+            }
+            break;
+        }
+        case FRAME_GOAWAY:
+            //不再接受新的流，发完已有的响应就关闭
+            m_goaway_received = true;
+            break;
+        case FRAME_WINDOW_UPDATE:{
+            if(len != 4){
+                goaway(FRAME_SIZE_ERROR);
+                return;
+            }
+            uint32_t increment = read_u32(payload) & 0x7fffffff;
+            if(stream_id == 0){
+                if(increment == 0 || m_send_window + increment > MAX_WINDOW_SIZE){
+                    goaway(increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+                    return;
+                }
+                m_send_window += increment;
+                break;
+            }
+            stream_map::iterator it = m_streams.find(stream_id);
+            if(it == m_streams.end()){
+                break;
+            }
+            if(increment == 0 || it->second.send_window + increment > MAX_WINDOW_SIZE){
+                send_rst_stream(stream_id,increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+                close_stream(it);
+                break;
+            }
+            it->second.send_window += increment;
+            break;
+        }
+        default:
+            //未知类型的帧必须忽略
+            break;
+    }
+}
+
+bool http2_session::apply_settings(const unsigned char* payload,uint32_t len){
+    for(uint32_t i = 0;i + 6 <= len;i += 6){
+        uint16_t id = ((uint16_t)payload[i] << 8) | payload[i + 1];
+        uint32_t value = read_u32(payload + i + 2);
+        switch(id){
+            case SETTINGS_INITIAL_WINDOW_SIZE:{
+                if(value > MAX_WINDOW_SIZE){
+                    goaway(FLOW_CONTROL_ERROR);
+                    return false;
+                }
+                //调整所有流的发送窗口
+                long long delta = (long long)value - m_peer_initial_window;
+                for(stream_map::iterator it = m_streams.begin();it != m_streams.end();++it){
+                    it->second.send_window += delta;
+                }
+                m_peer_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if(value < 16384 || value > 16777215){
+                    goaway(PROTOCOL_ERROR);
+                    return false;
+                }
+                m_peer_max_frame = value;
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if(value > 1){
+                    goaway(PROTOCOL_ERROR);
+                    return false;
+                }
+                break;
+            default:
+                //HEADER_TABLE_SIZE只影响编码器，我们的编码器不使用动态表
+                break;
+        }
+    }
+    return true;
+}
+
+void http2_session::handle_headers(uint32_t stream_id){
+    m_header_stream = 0;
+    std::vector<hpack_header> headers;
+    //即使不处理这个头部块也要解码，保持动态表与客户端一致
+    hpack_decoder::DECODE_RESULT result = m_decoder.decode((const unsigned char*)m_header_block.data(),m_header_block.size(),headers);
+    if(result != hpack_decoder::DECODE_OK){
+        //超过通告的头部列表上限时解码中途停止，动态表已经不同步，只能关闭整个连接
+        goaway(result == hpack_decoder::DECODE_TOO_LARGE ? ENHANCE_YOUR_CALM : COMPRESSION_ERROR);
+        return;
+    }
+    m_header_block.clear();
+    if(stream_id <= m_last_stream_id){
+        //已有流上的trailer，忽略
+        return;
+    }
+    m_last_stream_id = stream_id;
+    if(m_goaway_received || m_streams.size() >= (size_t)MAX_CONCURRENT_STREAMS){
+        send_rst_stream(stream_id,REFUSED_STREAM);
+        return;
+    }
+
+    std::string method,path;
+    const char* accept_encoding = 0;
+    for(size_t i = 0;i < headers.size();++i){
+        if(headers[i].first == ":method"){
+            method = headers[i].second;
+        }else if(headers[i].first == ":path"){
+            path = headers[i].second;
+        }else if(headers[i].first == "accept-encoding"){
+            accept_encoding = headers[i].second.c_str();
+        }
+    }
+    if(method.empty() || path.empty()){
+        send_rst_stream(stream_id,PROTOCOL_ERROR);
+        return;
+    }
+    //和HTTP/1.1请求一样经过限流、路由、路径过滤、file_flight和压缩缓存
+    h2_response res;
+    m_conn->serve_h2(method.c_str(),path.c_str(),accept_encoding,res);
+    start_response(stream_id,method == "HEAD",res);
+}
+
+//生成响应头，响应体由fill_output按流量控制窗口分帧发送
+void http2_session::start_response(uint32_t stream_id,bool head,h2_response& res){
+    stream s;
+    s.file = res.file;
+    s.body = res.body;
+    s.mem = res.mem;
+    s.producer = res.producer;
+    res.producer = 0;
+    s.offset = 0;
+    s.send_window = m_peer_initial_window;
+    if(s.mem){
+        s.remaining = strlen(s.mem);
+    }else if(s.body){
+        s.remaining = s.body->size();
+    }else if(s.file){
+        s.remaining = s.file->st.st_size;
+    }else{
+        s.remaining = s.producer ? -1 : 0;
+    }
+
+    std::string block;
+    switch(res.status){
+        case 200: hpack_encoder::add_indexed(block,HPACK_STATUS_200); break;
+        case 204: hpack_encoder::add_indexed(block,HPACK_STATUS_204); break;
+        case 400: hpack_encoder::add_indexed(block,HPACK_STATUS_400); break;
+        case 404: hpack_encoder::add_indexed(block,HPACK_STATUS_404); break;
+        case 500: hpack_encoder::add_indexed(block,HPACK_STATUS_500); break;
+        default:{
+            char status[16];
+            snprintf(status,sizeof(status),"%d",res.status);
+            hpack_encoder::add_literal(block,HPACK_STATUS,status);
+            break;
+        }
+    }
+    hpack_encoder::add_literal(block,HPACK_CONTENT_TYPE,res.content_type);
+    if(res.content_encoding){
+        hpack_encoder::add_literal(block,HPACK_CONTENT_ENCODING,res.content_encoding);
+    }
+    if(res.vary){
+        hpack_encoder::add_literal(block,HPACK_VARY,"accept-encoding");
+    }
+    if(res.status == 429){
+        hpack_encoder::add_literal(block,HPACK_RETRY_AFTER,"1");
+    }
+    //流式响应没有Content-Length，用END_STREAM标志结束
+    if(s.remaining >= 0){
+        char len[32];
+        snprintf(len,sizeof(len),"%lld",(long long)s.remaining);
+        hpack_encoder::add_literal(block,HPACK_CONTENT_LENGTH,len);
+    }
+    if(head){
+        s.remaining = 0;
+    }
+
+    write_frame_header(block.size(),FRAME_HEADERS,FLAG_END_HEADERS | (s.remaining == 0 ? FLAG_END_STREAM : 0),stream_id);
+    m_out.append(block);
+    if(s.remaining == 0){
+        delete s.producer;
+        return;
+    }
+    m_streams[stream_id] = s;
+}
+
+void http2_session::close_stream(stream_map::iterator it){
+    delete it->second.producer;
+    m_streams.erase(it);
+}
+
+bool http2_session::can_fill() const{
+    if(!m_preface_received || m_send_window <= 0){
+        return false;
+    }
+    for(stream_map::const_iterator it = m_streams.begin();it != m_streams.end();++it){
+        if(it->second.send_window > 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+//从上一次服务的流之后开始，每个流轮流发送一帧，直到待发送数据足够多或者所有流都被窗口挡住
+//升级的连接收到客户端连接前言之后才发送DATA帧，这时客户端已经处理完101，
+//有的客户端（例如curl）不能在101之后的同一次读取中收下太多数据
+bool http2_session::fill_output(){
+    size_t before = out_len();
+    while(m_preface_received && out_len() < OUTPUT_HIGH_WATER && m_send_window > 0 && !m_streams.empty()){
+        bool progress = false;
+        stream_map::iterator it = m_streams.upper_bound(m_rr_cursor);
+        for(size_t n = m_streams.size();n > 0 && m_send_window > 0 && !m_streams.empty();--n){
+            if(it == m_streams.end()){
+                it = m_streams.begin();
+            }
+            uint32_t id = it->first;
+            stream& s = it->second;
+            m_rr_cursor = id;
+            long long len = s.producer ? (long long)MAX_FRAME_SIZE : s.remaining;
+            if(len > m_peer_max_frame) len = m_peer_max_frame;
+            if(len > s.send_window) len = s.send_window;
+            if(len > m_send_window) len = m_send_window;
+            if(len <= 0){
+                ++it;
+                continue;
+            }
+
+            //先把数据放到帧头之后，知道实际长度再填写帧头
+            size_t header_pos = m_out.size();
+            m_out.resize(header_pos + 9 + len);
+            char* data = &m_out[header_pos + 9];
+            long long got = len;
+            if(s.producer){
+                got = s.producer->produce(data,len);
+            }else if(s.mem || s.body || s.file->address){
+                const char* src = s.mem ? s.mem : s.body ? s.body->data() : s.file->address;
+                memcpy(data,src + s.offset,len);
+            }else if(pread(s.file->fd,data,len,s.offset) != len){
+                got = -1;
+            }
+            if(got < 0){
+                //流式响应出错、文件被截断或者读取失败，重置这个流
+                m_out.resize(header_pos);
+                send_rst_stream(id,INTERNAL_ERROR);
+                close_stream(it++);
+                progress = true;
+                continue;
+            }
+            m_out.resize(header_pos + 9 + got);
+            //流式响应产生0字节表示结束，发送一个空的带END_STREAM的DATA帧
+            bool end = s.producer ? got == 0 : got == s.remaining;
+            put_frame_header(&m_out[header_pos],got,FRAME_DATA,end ? FLAG_END_STREAM : 0,id);
+            s.offset += got;
+            if(!s.producer){
+                s.remaining -= got;
+            }
+            s.send_window -= got;
+            m_send_window -= got;
+            progress = true;
+            if(end){
+                close_stream(it++);
+            }else{
+                ++it;
+            }
+        }
+        if(!progress){
+            break;
+        }
+    }
+    return out_len() > before;
+}
@@ -0,0 +1,122 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <memory>
+#include "hpack.h"
+#include "file_flight.h"
+
+class http_conn;
+class stream_producer;
+
+//一个流的响应，由http_conn按HTTP/1.1请求的处理流程填写，响应体最多来自下面的一种
+struct h2_response{
+    int status;
+    const char* content_type;
+    const char* content_encoding;               //不压缩时为0
+    bool vary;                                  //按Accept-Encoding协商过，需要Vary头部
+    const char* mem;                            //错误页面
+    std::shared_ptr<const std::string> body;    //压缩缓存或者动态处理函数生成的响应体
+    file_flight::file_ptr file;                 //打开的文件，和其他连接共享
+    stream_producer* producer;                  //长度未知的流式响应，会话接管后负责delete
+
+    h2_response():status(200),content_type("text/html"),content_encoding(0),vary(false),mem(0),producer(0){}
+};
+
+//HTTP/2明文（h2c）会话，一个连接一个，由http_conn持有。
+//工作线程在process()中调用on_data解析帧、查找每个流的响应，并调用fill_output生成DATA帧
+//（读文件和流式响应的数据都在工作线程中）；主线程在write()中只发送已经生成的数据，
+//发完之后如果还有流可以继续发送，把连接交回线程池。EPOLLONESHOT保证两者不会同时访问同一个会话。
+//多个流的响应体按轮转顺序切成DATA帧，受连接和流两级流量控制窗口限制。
+class http2_session{
+public:
+    static const int MAX_CONCURRENT_STREAMS = 100;      //允许客户端同时打开的流数
+    static const uint32_t MAX_FRAME_SIZE = 16384;       //我们接受的最大帧，等于协议默认值
+    static const size_t OUTPUT_HIGH_WATER = 64 * 1024;  //待发送数据超过这个值就不再生成DATA帧
+    static const size_t MAX_HEADER_LIST_SIZE = 16384;   //解码后的头部列表上限，通过SETTINGS_MAX_HEADER_LIST_SIZE通告
+
+    //HTTP/2错误码
+    enum ERROR_CODE{NO_ERROR = 0,PROTOCOL_ERROR,INTERNAL_ERROR,FLOW_CONTROL_ERROR,SETTINGS_TIMEOUT,
+                    STREAM_CLOSED,FRAME_SIZE_ERROR,REFUSED_STREAM,CANCEL,COMPRESSION_ERROR,
+                    CONNECT_ERROR,ENHANCE_YOUR_CALM};
+
+    //conn是持有会话的连接，新的流交给它按HTTP/1.1请求的流程处理
+    explicit http2_session(http_conn* conn);
+    ~http2_session();
+
+    //客户端直接发送连接前言（prior knowledge）
+    void start();
+    //通过HTTP/1.1的Upgrade: h2c切换，settings是HTTP2-Settings头部的值，res是原请求已经处理好的响应，
+    //在流1上发送；成功时会话接管res.producer
+    bool start_upgrade(const char* settings,bool head,h2_response& res);
+
+    //处理从socket读到的数据，可能不是完整的帧
+    void on_data(const char* data,size_t len);
+
+    //待发送的数据
+    const char* out_data() const {return m_out.data() + m_out_off;}
+    size_t out_len() const {return m_out.size() - m_out_off;}
+    void consume(size_t n);
+    //待发送数据发完之后从各个流生成更多DATA帧，没有生成任何数据返回false。在工作线程中调用
+    bool fill_output();
+    //是否有流还有数据而且没有被流量控制窗口挡住，fill_output能够生成DATA帧
+    bool can_fill() const;
+    //连接是否应该在待发送数据发完后关闭
+    bool done() const;
+
+    //客户端连接前言
+    static const char* preface();
+    static const size_t PREFACE_LEN = 24;
+
+private:
+    //一个流的响应状态
+    struct stream{
+        file_flight::file_ptr file;                 //响应体来自文件，整体映射的直接复制，否则用pread读取
+        std::shared_ptr<const std::string> body;    //响应体来自内存（压缩缓存、动态响应）
+        const char* mem;                            //响应体来自错误页面
+        stream_producer* producer;                  //流式响应，没有则为0
+        off_t offset;           //下一次读取的偏移
+        off_t remaining;        //还没有发送的响应体字节数，流式响应为-1
+        long long send_window;  //流的发送窗口
+    };
+    typedef std::map<uint32_t,stream> stream_map;
+
+    void handle_frame(uint8_t type,uint8_t flags,uint32_t stream_id,const unsigned char* payload,uint32_t len);
+    void handle_headers(uint32_t stream_id);
+    bool apply_settings(const unsigned char* payload,uint32_t len);
+    void start_response(uint32_t stream_id,bool head,h2_response& res);
+    void close_stream(stream_map::iterator it);
+
+    void write_frame_header(uint32_t len,uint8_t type,uint8_t flags,uint32_t stream_id);
+    void send_settings();
+    void send_window_update(uint32_t stream_id,uint32_t increment);
+    void send_rst_stream(uint32_t stream_id,ERROR_CODE code);
+    void goaway(ERROR_CODE code);       //连接错误：发送GOAWAY，之后丢弃所有输入
+
+private:
+    http_conn* m_conn;              //持有会话的连接
+    std::string m_in;               //还不是完整帧的输入
+    std::string m_out;              //待发送的数据
+    size_t m_out_off;               //m_out中已经发送的字节数
+    bool m_preface_received;        //是否已经收到客户端连接前言
+    bool m_goaway_sent;
+    bool m_goaway_received;
+
+    hpack_decoder m_decoder;
+    uint32_t m_header_stream;       //正在接收CONTINUATION的流，0表示没有
+    bool m_header_end_stream;
+    std::string m_header_block;     //HEADERS + CONTINUATION拼接起来的头部块
+
+    uint32_t m_last_stream_id;      //客户端打开过的最大流ID
+    uint32_t m_peer_max_frame;      //对端的SETTINGS_MAX_FRAME_SIZE
+    long long m_peer_initial_window;//对端的SETTINGS_INITIAL_WINDOW_SIZE
+    long long m_send_window;        //连接级发送窗口
+
+    stream_map m_streams;           //还有响应体要发送的流
+    uint32_t m_rr_cursor;           //轮转发送时上一次服务的流
+};
+
+#endif
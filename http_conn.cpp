@@ -1,9 +1,20 @@
 //code by zsl
 #include "http_conn.h"
+#include "compress_cache.h"
+#include "http2.h"
+#include "proxy.h"
+#include "router.h"
+#include "path_filter.h"
+#include "upgrade.h"
+#include "rate_limit.h"
+#include "capture.h"
+#include <linux/errqueue.h>
+#include <linux/tcp.h>
 //git test
 // 定义HTTP响应的一些状态信息
 
 const char* ok_200_title = "OK";
+const char* ok_206_title = "Partial Content";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
@@ -12,6 +23,87 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_416_title = "Range Not Satisfiable";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unavailable.\n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "Too many requests from your address, please retry later.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "Too many requests are being forwarded, please retry later.\n";
+
+//multipart/byteranges响应的分隔符
+const char* byteranges_boundary = "HTTPSERVER_BYTERANGES_7d3f2a1c";
+
+//根据文件扩展名确定Content-Type，compressible表示是否值得压缩
+struct mime_type{
+    const char* ext;
+    const char* type;
+    bool compressible;
+};
+static const mime_type mime_types[] = {
+    {".html","text/html",true},
+    {".htm","text/html",true},
+    {".css","text/css",true},
+    {".js","application/javascript",true},
+    {".json","application/json",true},
+    {".txt","text/plain",true},
+    {".xml","application/xml",true},
+    {".svg","image/svg+xml",true},
+    {".png","image/png",false},
+    {".jpg","image/jpeg",false},
+    {".jpeg","image/jpeg",false},
+    {".gif","image/gif",false},
+    {".ico","image/x-icon",false},
+    {".pdf","application/pdf",false},
+    {".mp4","video/mp4",false},
+    {".wasm","application/wasm",true},
+};
+static const mime_type default_mime_type = {"","application/octet-stream",false};
+
+static const mime_type& lookup_mime_type(const char* path){
+    const char* ext = strrchr(path,'.');
+    if(ext && !strchr(ext,'/')){
+        for(size_t i = 0;i < sizeof(mime_types)/sizeof(mime_types[0]);++i){
+            if(strcasecmp(ext,mime_types[i].ext) == 0){
+                return mime_types[i];
+            }
+        }
+    }
+    return default_mime_type;
+}
+
+//判断Accept-Encoding中是否接受coding编码，例如 "gzip, deflate, br;q=0.8"
+static bool accepts_encoding(const char* header,const char* coding){
+    size_t len = strlen(coding);
+    const char* p = header;
+    while(*p){
+        p += strspn(p," \t,");
+        const char* token = p;
+        p += strcspn(p," \t,;");
+        bool match = (size_t)(p - token) == len && strncasecmp(token,coding,len) == 0;
+        //q=0表示明确不接受
+        const char* params = p;
+        p += strcspn(p,",");
+        if(match){
+            const char* q = strstr(params,"q=");
+            return !(q && q < p && atof(q + 2) <= 0);
+        }
+    }
+    return false;
+}
+
+//与METHOD枚举的顺序一致
+static const char* const method_names[] = {"GET","POST","HEAD","PUT","DELETE","TRACE","OPTIONS","CONNECT"};
+
+//请求方法在METHOD枚举中的下标，忽略大小写，不支持的方法返回-1
+static int method_index(const char* method){
+    for(int i = 0;i < (int)(sizeof(method_names) / sizeof(method_names[0]));++i){
+        if(strcasecmp(method,method_names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
 
 //网站的根目录
 const char* doc_root = "/home/zsl/CLionProjects/HttpServer/resources";
@@ -50,6 +142,12 @@ extern void modfd(int epollfd,int fd,int ev){
     epoll_ctl(epollfd,EPOLL_CTL_MOD,fd,&event);
 }
 
+//清除m_in_worker要在注册事件之前：注册之后主线程可能马上又把连接交给另一个工作线程
+void http_conn::rearm(int ev){
+    m_in_worker.store(false,std::memory_order_release);
+    modfd(m_epollfd,m_sockfd,ev);
+}
+
 //初始化新接收的连接
 void http_conn::init(int sockfd,const sockaddr_in &addr){
     m_sockfd = sockfd;
@@ -58,34 +156,230 @@ void http_conn::init(int sockfd,const sockaddr_in &addr){
     //设置端口复用
     int reuse = 1;
     setsockopt(m_sockfd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse));
+    //响应已经按iovec组织好再写，Nagle不会再合并出什么，只会让多段响应（multipart/byteranges每段一次writev）
+    //和大响应末尾不满一个MSS的数据等待客户端的延迟确认，每个请求多出40ms
+    if(m_address.sin_family == AF_INET){
+        setsockopt(m_sockfd,IPPROTO_TCP,TCP_NODELAY,&reuse,sizeof(reuse));
+    }
 
     //添加到epoll对象中
     addfd(m_epollfd,m_sockfd,true);
     m_user_count++; //总用户数加一
 
+    m_h2_fill = false;
+    m_zc_seq = 0;
+    m_zc_enabled = false;
+    m_zc_disabled = false;
+
+    m_window_start = time(NULL);
+    m_window_bytes = 0;
+    m_window_acked = ULLONG_MAX;
+    m_evicted = false;
+    m_in_worker.store(false,std::memory_order_relaxed);
+    m_accept_ns = tracer::enabled() ? tracer::now_ns() : 0;
+    m_capture_id = traffic_capture::instance().open_conn();
+
+    //对象来自对象池，不能带着上一个连接的数据
+    m_read_idx = 0;
+    m_request_end = 0;
     init();
 }
 
 void http_conn::init(){
+    //流水线：客户端不等响应就发出的后续请求已经读进缓冲区，移到开头留给下一个请求，
+    //请求不完整或者出错时（m_request_end为0）丢弃全部数据
+    int left = 0;
+    if(m_request_end > 0 && m_request_end < m_read_idx){
+        m_read_buf[m_request_end] = m_request_end_byte;
+        left = m_read_idx - m_request_end;
+        memmove(m_read_buf,m_read_buf + m_request_end,left);
+    }
     m_check_state = CHECK_STATE_REQUEST_LINE;   //初始化状态为解析请求首行
     m_checked_index = 0;
     m_start_line = 0;
-    m_read_idx = 0;
+    m_read_idx = left;
+    m_request_end = 0;
     m_method = GET;
     m_url = 0;
     m_version = 0;
+    m_host = 0;
+    m_content_length = 0;
+    m_range = 0;
+    m_range_count = 0;
+    m_accept_encoding = 0;
+    m_content_type = "text/html";
+    m_content_encoding = 0;
+    m_mem_body.reset();
+    m_upgrade = 0;
+    m_http2_settings = 0;
+    m_content = 0;
+    m_status = 200;
+    m_status_title = ok_200_title;
+    m_body_len = 0;
+    delete m_producer;
+    m_producer = 0;
 
-    bzero(m_read_buf,READ_BUFFER_SIZE);
+    m_write_idx = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    m_write_yielded = false;
+    m_trace_id = 0;
+    m_file_address = 0;
+    m_file_fd = -1;
+    m_window = 0;
+    m_window_off = 0;
+    m_window_len = 0;
+
+    bzero(m_read_buf + left,READ_BUFFER_SIZE - left);
 
     m_linger = false;
+    //已经收到下一个请求的一部分，按读请求头计算速率
+    m_phase.store(left ? PHASE_HEADER : PHASE_IDLE,std::memory_order_relaxed);
 }
+//连接关闭后收不到完成通知，内核可能还在发送（包括重传）这些响应体，延迟一段时间再释放
+static const int ZEROCOPY_RELEASE_DELAY = 120;
+static std::deque< std::pair<time_t,std::shared_ptr<const std::string> > > zerocopy_graveyard;
+static locker zerocopy_graveyard_locker("zerocopy.graveyard");
+
+void http_conn::bury_zerocopy(std::deque<zc_ref>& refs){
+    time_t now = time(NULL);
+    zerocopy_graveyard_locker.lock();
+    while(!zerocopy_graveyard.empty() && zerocopy_graveyard.front().first + ZEROCOPY_RELEASE_DELAY <= now){
+        zerocopy_graveyard.pop_front();
+    }
+    for(size_t i = 0;i < refs.size();++i){
+        zerocopy_graveyard.push_back(std::make_pair(now,refs[i].body));
+    }
+    zerocopy_graveyard_locker.unlock();
+    refs.clear();
+}
+
 //关闭连接
 void http_conn::close_conn(){
     if(m_sockfd!=-1){
         removefd(m_epollfd,m_sockfd);
         m_sockfd = -1;
         m_user_count--; //关闭一个连接客户总数量减一
+        unmap();
+        //代数加一让队列中指向这个对象的旧句柄失效，然后把对象还给对象池
+        m_generation.fetch_add(1,std::memory_order_release);
+        delete m_h2;
+        m_h2 = 0;
+        delete m_producer;
+        m_producer = 0;
+        bury_zerocopy(m_zc_refs);
+        traffic_capture::instance().close_conn(m_capture_id);
+        m_capture_id = 0;
+        m_slab->free(this);
+    }
+}
+
+//对方已经确认收到的字节数，不是TCP连接时返回false
+static bool bytes_acked(int sockfd,unsigned long long& acked){
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info,0,sizeof(info));
+    if(getsockopt(sockfd,IPPROTO_TCP,TCP_INFO,&info,&len) < 0 || len < offsetof(struct tcp_info,tcpi_bytes_acked) + sizeof(info.tcpi_bytes_acked)){
+        return false;
+    }
+    acked = info.tcpi_bytes_acked;
+    return true;
+}
+
+void http_conn::check_progress(time_t now){
+    int phase = m_phase.load(std::memory_order_relaxed);
+    if(phase == PHASE_IDLE || phase == PHASE_H2 || m_evicted){
+        //两个请求之间不算慢，窗口从下一个请求开始
+        m_window_start = now;
+        m_window_bytes = 0;
+        m_window_acked = ULLONG_MAX;
+        return;
+    }
+    unsigned long long acked = 0;
+    bool has_acked = bytes_acked(m_sockfd,acked);
+    if(m_window_acked == ULLONG_MAX){
+        //请求开始后第一次检查，从这里开始计算窗口，空闲的连接不用每次都查询TCP_INFO
+        m_window_start = now;
+        m_window_bytes = 0;
+        m_window_acked = acked;
+        return;
+    }
+    if(now - m_window_start < m_rate_window){
+        return;
+    }
+    //发送响应时以对方确认的字节数为准，写进socket缓冲区的数据不代表对方在读。
+    //反向代理在工作线程中转发，不在这里检查，由上游读写超时（upstream::IO_TIMEOUT）限制
+    long long progress = m_window_bytes;
+    if(phase == PHASE_WRITE && has_acked){
+        progress = acked - m_window_acked;
+    }
+    if(progress < (long long)m_min_rate * (now - m_window_start)){
+        //对象可能正在工作线程中，这里不直接关闭；shutdown之后epoll报告挂断，由主线程按正常流程关闭。
+        //关闭时发送RST，丢弃发送队列中对方不读的数据，不留下FIN_WAIT状态的连接
+        m_evicted = true;
+        m_slow_evictions[phase].fetch_add(1,std::memory_order_relaxed);
+        struct linger reset = {1,0};
+        setsockopt(m_sockfd,SOL_SOCKET,SO_LINGER,&reset,sizeof(reset));
+        shutdown(m_sockfd,SHUT_RDWR);
+        return;
     }
+    m_window_start = now;
+    m_window_bytes = 0;
+    m_window_acked = acked;
+}
+
+//每个路径上次响应的文件大小是否超过SMALL_FILE_LIMIT，用于估计请求的开销。
+//按哈希直接映射，每项的高位是哈希的标签，最低位是大文件标记，读写都不加锁
+static const int SIZE_HINT_SLOTS = 4096;
+static std::atomic<uint64_t> size_hints[SIZE_HINT_SLOTS];
+
+static uint64_t url_hash(const char* url,size_t len){
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0;i < len;++i){
+        h ^= (unsigned char)url[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void record_size_hint(const char* url,off_t size){
+    uint64_t h = url_hash(url,strlen(url));
+    size_hints[h % SIZE_HINT_SLOTS].store((h & ~1ULL) | (size > http_conn::SMALL_FILE_LIMIT ? 1 : 0),std::memory_order_relaxed);
+}
+
+int http_conn::schedule_class() const {
+    //请求行已经解析过（请求不完整，之前已经处理过一次），或者是HTTP/2连接
+    if(m_check_state != CHECK_STATE_REQUEST_LINE || m_h2){
+        return SCHED_CONTROL;
+    }
+    //请求行：方法 空格 路径 空格，只复制路径
+    const char* sp = (const char*)memchr(m_read_buf,' ',m_read_idx);
+    if(!sp){
+        return SCHED_SMALL;
+    }
+    const char* url = sp + 1;
+    const char* end = (const char*)memchr(url,' ',m_read_buf + m_read_idx - url);
+    if(!end || end - url >= FILENAME_LEN || url[0] != '/'){
+        return SCHED_SMALL;
+    }
+    char path[FILENAME_LEN];
+    memcpy(path,url,end - url);
+    path[end - url] = '\0';
+    METHOD method = (sp - m_read_buf == 4 && strncasecmp(m_read_buf,"POST",4) == 0) ? POST : GET;
+    if(router::match(method,path)){
+        return SCHED_CONTROL;
+    }
+    if(proxy::match(path)){
+        return SCHED_PROXY;
+    }
+    uint64_t h = url_hash(path,end - url);
+    uint64_t hint = size_hints[h % SIZE_HINT_SLOTS].load(std::memory_order_relaxed);
+    if((hint & ~1ULL) == (h & ~1ULL) && (hint & 1)){
+        return SCHED_LARGE;
+    }
+    return SCHED_SMALL;
 }
 
 //循环读取客户数据,直到没有数据或者对方关闭链接
@@ -95,7 +389,8 @@ bool http_conn::read(){
     }
     //读到的字节
     int bytes_read = 0;
-    while(true){
+    //读缓冲区满了就先停下，剩下的数据留在socket中，处理完之后再读
+    while(m_read_idx < READ_BUFFER_SIZE){
         bytes_read = recv(m_sockfd,m_read_buf+m_read_idx,READ_BUFFER_SIZE-m_read_idx,0);
         if(bytes_read == -1){
             if(errno == EAGAIN||errno == EWOULDBLOCK){
@@ -107,7 +402,25 @@ bool http_conn::read(){
             //对方关闭链接
             return false;
         }
+        //记录流量时把每次收到的数据原样写进文件，回放时按同样的分段和间隔发送
+        if(m_capture_id){
+            traffic_capture::instance().data(m_capture_id,m_read_buf + m_read_idx,bytes_read);
+        }
         m_read_idx+=bytes_read;
+        m_window_bytes += bytes_read;
+    }
+    //收到新请求的第一部分，开始按读请求头计算速率
+    if(m_read_idx > 0 && m_phase.load(std::memory_order_relaxed) == PHASE_IDLE){
+        m_phase.store(PHASE_HEADER,std::memory_order_relaxed);
+        //在这里决定是否采样这个请求，建立连接的时间记在连接的第一个请求上
+        if(tracer::enabled()){
+            m_trace_id = tracer::sample();
+            if(m_trace_id && m_accept_ns){
+                tracer::record_event(m_trace_id,tracer::EV_ACCEPT,m_accept_ns);
+            }
+            m_accept_ns = 0;
+            trace(tracer::EV_FIRST_READ);
+        }
     }
     printf("读取到数据：%s",m_read_buf);
     return true;
@@ -115,28 +428,243 @@ bool http_conn::read(){
 
 //由线程池中的工作线程地哦阿用，处理HTTP请求的入口函数
 void http_conn::process(){
+    trace(tracer::EV_DEQUEUE);
+
+    //HTTP/2连接，或者客户端直接发送了HTTP/2连接前言
+    if(m_h2 || is_h2_preface()){
+        //HTTP/2的流不跟踪
+        m_trace_id = 0;
+        process_h2();
+        return;
+    }
 
     //解析HTTP请求
     HTTP_CODE read_ret = process_read();
     if(read_ret == NO_REQUEST){
         //请求不完整
-        modfd(m_epollfd,m_sockfd,EPOLLIN);
+        m_phase.store(m_check_state == CHECK_STATE_CONTENT ? PHASE_BODY : PHASE_HEADER,std::memory_order_relaxed);
+        rearm(EPOLLIN);
         return;//回到main函数再去读
     }
 
+    trace(tracer::EV_LOOKUP);
     printf("parse request ,create response\n");
+    //请求完整了，之后（包括反向代理转发期间）按发送响应计算速率
+    m_phase.store(PHASE_WRITE,std::memory_order_relaxed);
+
+    //正在退出的进程处理完这个请求就关闭连接，客户端重新连接时由新进程处理
+    if(m_draining.load(std::memory_order_relaxed)){
+        m_linger = false;
+    }
+
+    //反向代理，转发完成后连接已经重新注册或者关闭
+    if(read_ret == PROXY_REQUEST){
+        read_ret = do_proxy();
+        if(read_ret == PROXY_REQUEST){
+            return;
+        }
+    }
+
+    //Upgrade: h2c，原请求在HTTP/2的流1上响应。只有正常处理的请求才切换，
+    //错误（包括被限流）的响应仍然用HTTP/1.1发送
+    if(m_upgrade && m_http2_settings && (read_ret == FILE_REQUEST || read_ret == DYNAMIC_REQUEST)
+       && strcasecmp(m_upgrade,"h2c") == 0){
+        if(upgrade_h2(read_ret)){
+            return;
+        }
+        read_ret = BAD_REQUEST;
+    }
 
     //生成响应
 
     bool write_ret = process_write(read_ret);
     if(!write_ret){
         close_conn();
+        return;
     }
-    modfd(m_epollfd,m_sockfd,EPOLLOUT);
+    rearm(EPOLLOUT);
 }
 
 
 
+bool http_conn::is_h2_preface() const{
+    if(m_check_state != CHECK_STATE_REQUEST_LINE || m_start_line != 0 || m_read_idx == 0){
+        return false;
+    }
+    size_t n = (size_t)m_read_idx < http2_session::PREFACE_LEN ? m_read_idx : http2_session::PREFACE_LEN;
+    return memcmp(m_read_buf,http2_session::preface(),n) == 0;
+}
+
+void http_conn::process_h2(){
+    if(!m_h2){
+        if((size_t)m_read_idx < http2_session::PREFACE_LEN){
+            //连接前言还没读完
+            rearm(EPOLLIN);
+            return;
+        }
+        m_h2 = new http2_session(this);
+        m_h2->start();
+        m_phase.store(PHASE_H2,std::memory_order_relaxed);
+    }
+    //write_h2交回来生成更多DATA帧时没有新读到的数据
+    if(m_read_idx > 0){
+        m_h2->on_data(m_read_buf,m_read_idx);
+        m_read_idx = 0;
+    }
+    m_h2_fill = false;
+    m_h2->fill_output();
+    rearm(EPOLLOUT);
+}
+
+bool http_conn::upgrade_h2(HTTP_CODE ret){
+    //原请求已经处理完（包括限流），它的响应在流1上发送
+    h2_response res;
+    take_h2_response(ret,res);
+    http2_session* session = new http2_session(this);
+    if(!session->start_upgrade(m_http2_settings,m_method == HEAD,res)){
+        delete res.producer;
+        delete session;
+        return false;
+    }
+    m_h2 = session;
+    m_phase.store(PHASE_H2,std::memory_order_relaxed);
+    //请求之后已经读到的数据（通常是客户端的连接前言）交给会话
+    m_h2->on_data(m_read_buf + m_checked_index,m_read_idx - m_checked_index);
+    m_read_idx = 0;
+    m_h2->fill_output();
+    rearm(EPOLLOUT);
+    return true;
+}
+
+//HTTP/2连接上不再有HTTP/1.1请求，借用解析请求和生成响应的字段；url和Accept-Encoding复制到
+//写缓冲区中（HTTP/2不使用它），处理函数生成的响应体在m_range_buf中，和url不重叠
+void http_conn::serve_h2(const char* method,const char* path,const char* accept_encoding,h2_response& res){
+    size_t path_len = strlen(path);
+    size_t ae_len = accept_encoding ? strlen(accept_encoding) : 0;
+    int i = method_index(method);
+    HTTP_CODE ret = BAD_REQUEST;
+    if(i >= 0 && path[0] == '/' && path_len + ae_len + 2 <= (size_t)WRITE_BUFFER_SIZE){
+        //HEAD按GET处理，会话只发送响应头
+        m_method = i == HEAD ? GET : (METHOD)i;
+        m_url = m_write_buf;
+        memcpy(m_url,path,path_len + 1);
+        m_accept_encoding = 0;
+        if(accept_encoding){
+            m_accept_encoding = m_write_buf + path_len + 1;
+            memcpy(m_accept_encoding,accept_encoding,ae_len + 1);
+        }
+        m_range = 0;
+        m_content = 0;
+        m_content_length = 0;
+        m_content_type = "text/html";
+        m_content_encoding = 0;
+        m_status = 200;
+        m_status_title = ok_200_title;
+        m_body_len = 0;
+        ret = do_request();
+        //HTTP/2的流不转发给上游
+        if(ret == PROXY_REQUEST){
+            ret = BAD_GATEWAY;
+        }
+    }
+    take_h2_response(ret,res);
+}
+
+void http_conn::take_h2_response(HTTP_CODE ret,h2_response& res){
+    switch(ret){
+        case FILE_REQUEST:
+            res.content_type = m_content_type;
+            res.content_encoding = m_content_encoding;
+            res.vary = lookup_mime_type(m_url).compressible;
+            if(m_mem_body){
+                res.body = m_mem_body;
+            }else{
+                res.file = m_file;
+            }
+            break;
+        case DYNAMIC_REQUEST:
+            res.status = m_status;
+            res.content_type = m_content_type;
+            res.body = std::make_shared<const std::string>(m_range_buf,m_body_len);
+            break;
+        case STREAM_REQUEST:
+            res.status = m_status;
+            res.content_type = m_content_type;
+            res.producer = m_producer;
+            m_producer = 0;
+            break;
+        case NO_RESOURCE:
+            res.status = 404;
+            res.mem = error_404_form;
+            break;
+        case FORBIDDEN_REQUEST:
+            res.status = 403;
+            res.mem = error_403_form;
+            break;
+        case TOO_MANY_REQUESTS:
+            res.status = 429;
+            res.mem = error_429_form;
+            break;
+        case BAD_GATEWAY:
+            res.status = 502;
+            res.mem = error_502_form;
+            break;
+        case INTERNAL_ERROR:
+            res.status = 500;
+            res.mem = error_500_form;
+            break;
+        default:
+            res.status = 400;
+            res.mem = error_400_form;
+            break;
+    }
+    //文件和压缩后的响应体已经由res持有
+    unmap();
+    m_url = 0;
+    m_accept_encoding = 0;
+    m_content_encoding = 0;
+}
+
+//发送HTTP/2会话的数据，和HTTP/1.1一样受每轮配额限制。DATA帧由工作线程生成，
+//发完之后还有流可以发送时设置m_h2_fill，由主循环交给线程池；
+//没有数据可发（全部发完或者被流量控制窗口挡住）时等待客户端的帧
+bool http_conn::write_h2(){
+    long long quantum = m_write_quantum > 0 ? m_write_quantum : LLONG_MAX;
+    m_write_yielded = false;
+    while(1){
+        if(m_h2->out_len() == 0){
+            if(m_h2->can_fill()){
+                m_h2_fill = true;
+                return true;
+            }
+            if(m_h2->done()){
+                return false;
+            }
+            modfd(m_epollfd,m_sockfd,EPOLLIN);
+            return true;
+        }
+        if(quantum <= 0){
+            m_write_yielded = true;
+            return true;
+        }
+        size_t len = m_h2->out_len();
+        if((long long)len > quantum){
+            len = quantum;
+        }
+        int temp = send(m_sockfd,m_h2->out_data(),len,0);
+        if(temp <= -1){
+            if(errno == EAGAIN){
+                //发送缓冲区满的时候也要继续读，客户端可能在等我们读它的WINDOW_UPDATE
+                modfd(m_epollfd,m_sockfd,EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        m_h2->consume(temp);
+        quantum -= temp;
+    }
+}
+
 //解析HTTP请求首行,获得请求方法，目标URL，HTTP版本
 http_conn::HTTP_CODE http_conn::parse_request_line(char * text){
     // GET /index.html HTTP/1.1
@@ -146,12 +674,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text){
     }
     // GET\0/index.html HTTP/1.1
     *m_url++ = '\0';    // 置位空字符，字符串结束符
-    char* method = text;
-    if ( strcasecmp(method, "GET") == 0 ) { // 忽略大小写比较
-        m_method = GET;
-    } else {
+    int i = method_index(text);
+    if(i < 0){
         return BAD_REQUEST;
     }
+    m_method = (METHOD)i;
     // /index.html HTTP/1.1
     // 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标。
     m_version = strpbrk( m_url, " \t" );
@@ -173,6 +700,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text){
     if ( !m_url || m_url[0] != '/' ) {
         return BAD_REQUEST;
     }
+    m_header_idx = m_checked_index;
     m_check_state = CHECK_STATE_HEADER; // 检查状态变成检查头
     return NO_REQUEST;
 }
@@ -195,14 +723,36 @@ http_conn::HTTP_CODE http_conn::parse_request_header(char * text){
             m_linger = true;
         }
     }else if(strncasecmp(text,"Content-Length:",15)==0){
-        // 处理Content-Length头部字段
+        //处理Content-Length头部字段，请求体必须能放进读缓冲区
         text += 15;
         text += strspn(text," \t");
+        long len = atol(text);
+        if(len < 0 || len >= READ_BUFFER_SIZE){
+            return BAD_REQUEST;
+        }
+        m_content_length = len;
     } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
         // 处理Host头部字段
         text += 5;
         text += strspn( text, " \t" );
         m_host = text;
+    }else if(strncasecmp(text,"Range:",6) == 0){
+        //处理Range头部字段，等拿到文件大小之后在do_request中解析
+        text += 6;
+        text += strspn(text," \t");
+        m_range = text;
+    }else if(strncasecmp(text,"Accept-Encoding:",16) == 0){
+        text += 16;
+        text += strspn(text," \t");
+        m_accept_encoding = text;
+    }else if(strncasecmp(text,"Upgrade:",8) == 0){
+        text += 8;
+        text += strspn(text," \t");
+        m_upgrade = text;
+    }else if(strncasecmp(text,"HTTP2-Settings:",15) == 0){
+        text += 15;
+        text += strspn(text," \t");
+        m_http2_settings = text;
     } else {
         printf( "oop! unknow header %s\n", text );
     }
@@ -212,8 +762,15 @@ http_conn::HTTP_CODE http_conn::parse_request_header(char * text){
 
 //解析HTTP请求体,只判断了它是否被完整读入了
 http_conn::HTTP_CODE http_conn::parse_request_content(char * text){
+    //请求体之后还要放一个'\0'
+    if(m_checked_index + m_content_length >= READ_BUFFER_SIZE){
+        return BAD_REQUEST;
+    }
     if(m_read_idx>=(m_content_length + m_checked_index)){
+        m_request_end = m_checked_index + m_content_length;
+        m_request_end_byte = text[m_content_length];
         text[m_content_length] = '\0';
+        m_content = text;
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -247,43 +804,352 @@ http_conn::LINE_STATUS http_conn::parse_line() {
 //具体处理
 // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
 // 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
+//映射到内存地址m_file_address处，并告诉调用者获取文件成功。
+//stat、open和mmap通过file_flight完成，同一文件的并发请求只做一次，共享映射
+
 http_conn::HTTP_CODE http_conn::do_request(){
-    strcpy(m_real_file,doc_root);
-    strcpy( m_real_file, doc_root );
-    int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
+    trace(tracer::EV_PARSED);
+    //超过速率限制的客户端在做任何事之前就拒绝
+    if(!rate_limiter::instance().allow_request(m_address)){
+        return TOO_MANY_REQUESTS;
+    }
+    route_handler handler = router::match(m_method,m_url);
+    if(handler){
+        return handler(*this);
+    }
+    //反向代理转发所有方法，请求体一起转发
+    if(proxy::match(m_url)){
+        return PROXY_REQUEST;
+    }
+    if(m_method != GET){
+        return BAD_REQUEST;
+    }
+    //一定不存在的路径不拼接路径也不访问文件系统
+    if(!path_filter::instance().may_exist(m_url)){
         return NO_RESOURCE;
     }
+    map_path(m_url,m_real_file);
+    HTTP_CODE ret = open_file_shared();
+    if(ret == NO_RESOURCE){
+        path_filter::instance().add_negative(m_url);
+    }
+    if(ret != FILE_REQUEST){
+        return ret;
+    }
+
+    const mime_type& mime = lookup_mime_type(m_real_file);
+    m_content_type = mime.type;
+    //可压缩的文本类型按Accept-Encoding协商，Range请求始终针对原始内容
+    if(mime.compressible && m_accept_encoding && !m_range){
+        negotiate_encoding();
+        if(m_mem_body){
+            m_file.reset();
+            return FILE_REQUEST;
+        }
+        //改为发送预压缩文件
+        if(m_content_encoding){
+            ret = open_file_shared();
+            if(ret != FILE_REQUEST){
+                return ret;
+            }
+        }
+    }
 
-    // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
+    //记入热点，升级时交给新进程预热
+    upgrade::record(m_real_file);
+    record_size_hint(m_url,m_file_stat.st_size);
+
+    //大文件不整体映射，保留文件描述符，发送时按窗口映射，每个连接占用的地址空间有上限
+    m_file_address = m_file->address;
+    m_file_fd = m_file->fd;
+
+    //有Range请求头则只发送其中的部分区间
+    if(m_range){
+        return parse_range();
+    }
+    return FILE_REQUEST;
+
+}
+
+//通过file_flight打开m_real_file，并检查是否可以发送
+http_conn::HTTP_CODE http_conn::open_file_shared(){
+    m_file = file_flight::instance().open(m_real_file,MMAP_WINDOW_SIZE);
+    if(!m_file){
+        return INTERNAL_ERROR;
+    }
+    if(!m_file->found){
+        return NO_RESOURCE;
+    }
+    m_file_stat = m_file->st;
+    return check_file(m_file_stat);
+}
+
+//重新组装请求转发给上游：请求行 + 去掉逐跳头部的原始请求头 + X-Forwarded-For + 请求体，
+//上游连接总是保持长连接，和客户端的连接是否保持由m_linger决定。
+//请求体已经完整读进了读缓冲区（不超过READ_BUFFER_SIZE），和请求头一起发送；
+//不支持chunked编码的请求体，这样的请求无法确定边界，回复400
+http_conn::HTTP_CODE http_conn::do_proxy(){
+    upstream* up = proxy::match(m_url);
+    std::string request;
+    request.append(method_names[m_method]).append(" ").append(m_url).append(" HTTP/1.1\r\n");
+    //解析过的每一行后面都是两个'\0'（原来的\r\n），空行表示头部结束
+    for(char* line = m_read_buf + m_header_idx;line < m_read_buf + m_checked_index && *line;line += strlen(line) + 2){
+        if(strncasecmp(line,"Transfer-Encoding:",18) == 0){
+            m_linger = false;
+            return BAD_REQUEST;
+        }
+        if(!proxy::hop_by_hop(line)){
+            request.append(line).append("\r\n");
+        }
+    }
+    //Unix socket上的连接没有客户端IP
+    if(m_address.sin_family == AF_INET){
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET,&m_address.sin_addr,ip,sizeof(ip));
+        request.append("X-Forwarded-For: ").append(ip).append("\r\n");
+    }
+    request.append("Connection: keep-alive\r\n\r\n");
+    if(m_content){
+        request.append(m_content,m_content_length);
+    }
+
+    //工作线程同步等待上游，同时转发的请求数有上限，其余线程继续处理别的请求
+    if(!proxy::enter()){
+        return SERVICE_UNAVAILABLE;
+    }
+    bool keep_alive = m_linger;
+    proxy::RESULT ret = proxy::relay(up,m_sockfd,request,m_method == HEAD,keep_alive);
+    proxy::leave();
+    if(ret == proxy::PROXY_UPSTREAM_ERROR){
+        return BAD_GATEWAY;
+    }
+    if(ret == proxy::PROXY_ABORTED || !keep_alive){
+        close_conn();
+        return PROXY_REQUEST;
+    }
+    //记录响应的边界，回放时后面的请求按同样的先后关系发送
+    traffic_capture::instance().response(m_capture_id);
+    init();
+    //流水线中还有请求时注册EPOLLOUT（马上就绪），由主线程把连接交回线程池
+    rearm(pipelined() ? EPOLLOUT : EPOLLIN);
+    return PROXY_REQUEST;
+}
+
+void http_conn::map_path(const char* url,char* real_file){
+    strcpy(real_file,doc_root);
+    int len = strlen(doc_root);
+    strncpy(real_file + len,url,FILENAME_LEN - len - 1);
+    real_file[FILENAME_LEN - 1] = '\0';
+}
+
+http_conn::HTTP_CODE http_conn::check_file(const struct stat& st){
+    //判断访问权限
+    if(!(st.st_mode & S_IROTH)){
         return FORBIDDEN_REQUEST;
     }
 
-    // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
+    //判断是否是目录
+    if(S_ISDIR(st.st_mode)){
         return BAD_REQUEST;
     }
-
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
-    // 创建内存映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+    //设备文件、管道等不发送
+    if(!S_ISREG(st.st_mode)){
+        return FORBIDDEN_REQUEST;
+    }
     return FILE_REQUEST;
+}
 
+//优先发送预先压缩好的.br/.gz同名文件，否则交给压缩缓存（在当前工作线程中压缩，并发未命中只压缩一次）
+void http_conn::negotiate_encoding(){
+    if(accepts_encoding(m_accept_encoding,"br") && try_precompressed(".br","br")){
+        return;
+    }
+    if(!accepts_encoding(m_accept_encoding,"gzip")){
+        return;
+    }
+    if(try_precompressed(".gz","gzip")){
+        return;
+    }
+    m_mem_body = compress_cache::instance().get(m_real_file,m_file_stat);
+    if(m_mem_body){
+        m_content_encoding = "gzip";
+    }
+}
+
+//存在比原文件新的预压缩文件时，改为发送它
+bool http_conn::try_precompressed(const char* suffix,const char* encoding){
+    int len = strlen(m_real_file);
+    if(len + (int)strlen(suffix) >= FILENAME_LEN){
+        return false;
+    }
+    char path[FILENAME_LEN];
+    memcpy(path,m_real_file,len);
+    strcpy(path + len,suffix);
+    struct stat st;
+    if(stat(path,&st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH)
+       || st.st_mtime < m_file_stat.st_mtime){
+        return false;
+    }
+    strcpy(m_real_file,path);
+    m_file_stat = st;
+    m_content_encoding = encoding;
+    return true;
+}
+
+//解析Range请求头，例如 bytes=0-499,1000-,-500
+//语法错误、区间过多或区间重叠时忽略Range，直接发送整个文件；所有区间都不可满足时返回RANGE_NOT_SATISFIABLE
+http_conn::HTTP_CODE http_conn::parse_range(){
+    m_range_count = 0;
+    if(strncasecmp(m_range,"bytes=",6) != 0){
+        return FILE_REQUEST;
+    }
+    off_t size = m_file_stat.st_size;
+    int specs = 0;  //请求中的区间总数（包括不可满足的）
+    char* p = m_range + 6;
+    while(*p){
+        p += strspn(p," \t");
+        char* end = 0;
+        off_t first,last;
+        if(*p == '-'){
+            //后缀区间 -N：最后N个字节
+            if(!isdigit(p[1])){
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            off_t n = strtoll(p + 1,&end,10);
+            first = n >= size ? 0 : size - n;
+            last = n == 0 ? -1 : size - 1;
+        }else{
+            if(!isdigit(*p)){
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            first = strtoll(p,&end,10);
+            if(*end != '-'){
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            p = end + 1;
+            if(isdigit(*p)){
+                last = strtoll(p,&end,10);
+                if(last < first){
+                    m_range_count = 0;
+                    return FILE_REQUEST;
+                }
+            }else{
+                //first- ：从first到文件末尾
+                last = size - 1;
+                end = p;
+            }
+            if(last >= size){
+                last = size - 1;
+            }
+        }
+        ++specs;
+        //first超出文件大小的区间不可满足，跳过
+        if(first < size && first <= last){
+            if(m_range_count == MAX_RANGES){
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            m_ranges[m_range_count].first = first;
+            m_ranges[m_range_count].last = last;
+            ++m_range_count;
+        }
+        p = end + strspn(end," \t");
+        if(*p == ','){
+            ++p;
+        }else if(*p != '\0'){
+            m_range_count = 0;
+            return FILE_REQUEST;
+        }
+    }
+    if(specs > 0 && m_range_count == 0){
+        return RANGE_NOT_SATISFIABLE;
+    }
+    //重叠的区间会让响应比整个文件还大，直接发送整个文件
+    for(int i = 0;i < m_range_count;++i){
+        for(int j = i + 1;j < m_range_count;++j){
+            if(m_ranges[i].first <= m_ranges[j].last && m_ranges[j].first <= m_ranges[i].last){
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+        }
+    }
+    return FILE_REQUEST;
 }
 
 //对内存映射操作区进行munmap操作
 void http_conn::unmap(){
-    if(m_file_address){
-        munmap(m_file_address,m_file_stat.st_size);
-        m_file_address = 0;
+    m_mem_body.reset();
+    if(m_window){
+        munmap(m_window,m_window_len);
+        m_window = 0;
+    }
+    //整体映射和文件描述符由m_file持有，最后一个使用它的连接释放时才munmap/close
+    m_file_address = 0;
+    m_file_fd = -1;
+    m_file.reset();
+}
+
+//映射包含offset的窗口，窗口按MMAP_WINDOW_SIZE对齐
+bool http_conn::map_window(off_t offset){
+    if(m_window && offset >= m_window_off && offset < m_window_off + (off_t)m_window_len){
+        return true;
+    }
+    if(m_window){
+        //已经发送完的窗口不会再用到，提示内核可以回收
+        madvise(m_window,m_window_len,MADV_DONTNEED);
+        munmap(m_window,m_window_len);
+        m_window = 0;
+    }
+    m_window_off = offset - offset % MMAP_WINDOW_SIZE;
+    m_window_len = m_file_stat.st_size - m_window_off < MMAP_WINDOW_SIZE
+                   ? m_file_stat.st_size - m_window_off : MMAP_WINDOW_SIZE;
+    void* addr = mmap(0,m_window_len,PROT_READ,MAP_PRIVATE,m_file_fd,m_window_off);
+    if(addr == MAP_FAILED){
+        return false;
+    }
+    m_window = (char*)addr;
+    madvise(m_window,m_window_len,MADV_SEQUENTIAL);
+    return true;
+}
+
+void http_conn::set_file_iov(int idx,off_t offset,off_t len){
+    m_iv[idx].iov_len = len;
+    if(m_file_fd != -1){
+        m_iv[idx].iov_base = 0;
+        m_iv_file_off[idx] = offset;
+    }else{
+        m_iv[idx].iov_base = m_file_address + offset;
     }
 }
+
+//把从m_iv_idx开始还没发送的内存块放进iv，文件数据只取当前窗口内的部分，窗口之外的等下一轮
+int http_conn::prepare_iov(struct iovec* iv,long long limit){
+    int n = 0;
+    for(int i = m_iv_idx;i < m_iv_count && limit > 0;++i){
+        if(m_iv_file_off[i] < 0){
+            iv[n] = m_iv[i];
+        }else{
+            if(!map_window(m_iv_file_off[i])){
+                return -1;
+            }
+            off_t avail = m_window_off + m_window_len - m_iv_file_off[i];
+            iv[n].iov_base = m_window + (m_iv_file_off[i] - m_window_off);
+            iv[n].iov_len = (off_t)m_iv[i].iov_len < avail ? m_iv[i].iov_len : avail;
+        }
+        if((long long)iv[n].iov_len > limit){
+            iv[n].iov_len = limit;
+        }
+        limit -= iv[n].iov_len;
+        ++n;
+        if(m_iv_file_off[i] >= 0){
+            break;
+        }
+    }
+    return n;
+}
 //主状态机，解析HTTP请求
 http_conn::HTTP_CODE http_conn::process_read(){
     //初始状态
@@ -310,13 +1176,19 @@ http_conn::HTTP_CODE http_conn::process_read(){
                 if (ret == BAD_REQUEST) {
                     return BAD_REQUEST;
                 } else if (ret == GET_REQUEST) {
+                    //没有请求体，请求在空行处结束
+                    m_request_end = m_checked_index;
+                    m_request_end_byte = m_read_buf[m_checked_index];
                     //解析具体请求信息
                     return do_request();
                 }
+                break;
             }
             case CHECK_STATE_CONTENT:{
                 ret = parse_request_content(text);
-                if(ret == GET_REQUEST){
+                if(ret == BAD_REQUEST){
+                    return BAD_REQUEST;
+                }else if(ret == GET_REQUEST){
                     return do_request();
                 }
                 //行数据尚不完整
@@ -335,20 +1207,47 @@ http_conn::HTTP_CODE http_conn::process_read(){
 
 //写HTTP响应 m_write_buf + m_file_address
 bool http_conn::write(){
+    if(m_h2){
+        return write_h2();
+    }
     int temp = 0;
-    int bytes_have_send = 0;    // 已经发送的字节
-    int bytes_to_send = m_write_idx;// 将要发送的字节 （m_write_idx）写缓冲区中待发送的字节数
 
-    if ( bytes_to_send == 0 ) {
+    if(!m_zc_refs.empty()){
+        drain_zerocopy();
+    }
+    if(m_bytes_to_send == 0 && m_producer && !pull_chunk()){
+        return false;
+    }
+    if(m_bytes_to_send == 0){
+        //反向代理的响应已经在工作线程中直接转发完，只是把流水线中的下一个请求交回主线程
+        if(pipelined()){
+            return true;
+        }
         // 将要发送的字节为0，这一次响应结束。
+        trace(tracer::EV_LAST_WRITE);
+        traffic_capture::instance().response(m_capture_id);
         modfd( m_epollfd, m_sockfd, EPOLLIN );
         init();
         return true;
     }
 
+    //每次最多发送一个配额，避免一个大文件下载长时间占住主线程，其他连接的小请求排在后面
+    long long quantum = m_write_quantum > 0 ? m_write_quantum : LLONG_MAX;
+    m_write_yielded = false;
     while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if(quantum <= 0){
+            //配额用完，由主线程按轮转顺序稍后再调用write
+            m_write_yielded = true;
+            return true;
+        }
+        //分散写，从第一个还没有发送完的内存块开始
+        struct iovec iv[MAX_IOV];
+        int iv_count = prepare_iov(iv,quantum);
+        if(iv_count < 0){
+            unmap();
+            return false;
+        }
+        temp = send_iov(iv,iv_count);
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
@@ -359,14 +1258,48 @@ bool http_conn::write(){
             unmap();
             return false;
         }
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send ) {
+        if(m_bytes_have_send == 0 && temp > 0){
+            trace(tracer::EV_FIRST_WRITE);
+        }
+        m_bytes_to_send -= temp;
+        m_bytes_have_send += temp;
+        m_window_bytes += temp;
+        quantum -= temp;
+
+        //跳过已经发送完的内存块，并调整只发送了一部分的内存块
+        while(temp > 0 && m_iv_idx < m_iv_count){
+            if((size_t)temp >= m_iv[m_iv_idx].iov_len){
+                temp -= m_iv[m_iv_idx].iov_len;
+                ++m_iv_idx;
+            }else{
+                if(m_iv_file_off[m_iv_idx] >= 0){
+                    m_iv_file_off[m_iv_idx] += temp;
+                }else{
+                    m_iv[m_iv_idx].iov_base = (char*)m_iv[m_iv_idx].iov_base + temp;
+                }
+                m_iv[m_iv_idx].iov_len -= temp;
+                temp = 0;
+            }
+        }
+
+        if(m_bytes_to_send <= 0 && m_producer){
+            //上一块已经全部写进socket，再拉取下一块
+            if(!pull_chunk()){
+                return false;
+            }
+            continue;
+        }
+        if(m_bytes_to_send <= 0){
             // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
+            trace(tracer::EV_LAST_WRITE);
+            traffic_capture::instance().response(m_capture_id);
             unmap();
             if(m_linger) {
                 init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
+                //流水线中已经有下一个请求时由主线程交给线程池，不重新注册事件
+                if(!pipelined()){
+                    modfd( m_epollfd, m_sockfd, EPOLLIN );
+                }
                 return true;
             } else {
                 modfd( m_epollfd, m_sockfd, EPOLLIN );
@@ -377,6 +1310,129 @@ bool http_conn::write(){
     return true;
 }
 
+ssize_t http_conn::send_iov(struct iovec* iv,int iv_count){
+    if(m_zerocopy_threshold > 0 && m_mem_body && !m_zc_disabled){
+        const char* begin = m_mem_body->data();
+        const char* end = begin + m_mem_body->size();
+        const char* base = (const char*)iv[0].iov_base;
+        if(base >= begin && base < end && iv[0].iov_len >= (size_t)m_zerocopy_threshold){
+            if(!m_zc_enabled){
+                int one = 1;
+                m_zc_enabled = setsockopt(m_sockfd,SOL_SOCKET,SO_ZEROCOPY,&one,sizeof(one)) == 0;
+                m_zc_disabled = !m_zc_enabled;
+            }
+            if(m_zc_enabled){
+                struct msghdr msg;
+                memset(&msg,0,sizeof(msg));
+                msg.msg_iov = iv;
+                msg.msg_iovlen = 1;
+                ssize_t n = sendmsg(m_sockfd,&msg,MSG_ZEROCOPY);
+                if(n > 0){
+                    //每次成功的发送占用一个序号，完成通知按序号区间报告
+                    zc_ref ref;
+                    ref.seq = m_zc_seq++;
+                    ref.body = m_mem_body;
+                    m_zc_refs.push_back(ref);
+                    m_zerocopy_sends.fetch_add(1,std::memory_order_relaxed);
+                    return n;
+                }
+                //锁定的内存超过了optmem限制，这一次退回到复制
+                if(n < 0 && errno != ENOBUFS){
+                    return n;
+                }
+            }
+            return writev(m_sockfd,iv,1);
+        }
+        //响应头后面跟着足够大的响应体时，先单独发送响应头，响应体在下一次循环中零拷贝发送
+        if(iv_count > 1 && (const char*)iv[1].iov_base >= begin && (const char*)iv[1].iov_base < end
+           && iv[1].iov_len >= (size_t)m_zerocopy_threshold){
+            iv_count = 1;
+        }
+    }
+    return writev(m_sockfd,iv,iv_count);
+}
+
+void http_conn::drain_zerocopy(){
+    char control[128];
+    while(!m_zc_refs.empty()){
+        struct msghdr msg;
+        memset(&msg,0,sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(m_sockfd,&msg,MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+            return;
+        }
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);cm;cm = CMSG_NXTHDR(&msg,cm)){
+            if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)){
+                continue;
+            }
+            struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY){
+                continue;
+            }
+            //[ee_info,ee_data]区间内的发送已经完成
+            uint32_t lo = err->ee_info;
+            uint32_t hi = err->ee_data;
+            for(std::deque<zc_ref>::iterator it = m_zc_refs.begin();it != m_zc_refs.end();){
+                if(it->seq - lo <= hi - lo){
+                    it = m_zc_refs.erase(it);
+                }else{
+                    ++it;
+                }
+            }
+            if(err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+                //内核还是做了复制（例如回环或者网卡不支持），零拷贝只剩额外开销，这个连接不再使用
+                m_zc_disabled = true;
+                m_zerocopy_copied.fetch_add(1,std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+bool http_conn::reap_zerocopy(){
+    drain_zerocopy();
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if(getsockopt(m_sockfd,SOL_SOCKET,SO_ERROR,&error,&len) < 0 || error != 0){
+        return false;
+    }
+    //EPOLLONESHOT已经触发，按连接当前的状态重新注册
+    modfd(m_epollfd,m_sockfd,(m_bytes_to_send > 0 || m_producer) ? EPOLLOUT : EPOLLIN);
+    return true;
+}
+
+//数据放在m_write_buf + CHUNK_HEAD_SIZE处，长度行写在它前面，整个chunk在写缓冲区中是连续的
+bool http_conn::pull_chunk(){
+    char* data = m_write_buf + CHUNK_HEAD_SIZE;
+    int len = m_producer->produce(data,WRITE_BUFFER_SIZE - CHUNK_HEAD_SIZE - 2);
+    if(len < 0){
+        return false;
+    }
+    char* begin;
+    if(len == 0){
+        //最后一块
+        delete m_producer;
+        m_producer = 0;
+        begin = m_write_buf;
+        memcpy(begin,"0\r\n\r\n",5);
+        len = 5;
+    }else{
+        char head[CHUNK_HEAD_SIZE + 1];
+        int n = snprintf(head,sizeof(head),"%x\r\n",len);
+        begin = data - n;
+        memcpy(begin,head,n);
+        memcpy(data + len,"\r\n",2);
+        len += n + 2;
+    }
+    m_iv[0].iov_base = begin;
+    m_iv[0].iov_len = len;
+    m_iv_file_off[0] = -1;
+    m_iv_count = 1;
+    m_iv_idx = 0;
+    m_bytes_to_send = len;
+    return true;
+}
+
 //往写缓冲区写入待发送的数据
 bool http_conn::add_response(const char* format,...){
     //这里做的就是把参数列表的数据写入m_write_buf当中
@@ -394,24 +1450,49 @@ bool http_conn::add_response(const char* format,...){
     return true;
 }
 
+http_conn::HTTP_CODE http_conn::reply(int status,const char* title,const char* content_type,const char* format,...){
+    va_list arg_list;
+    va_start(arg_list,format);
+    int len = vsnprintf(m_range_buf,BODY_BUFFER_SIZE,format,arg_list);
+    va_end(arg_list);
+    if(len < 0 || len >= BODY_BUFFER_SIZE){
+        return INTERNAL_ERROR;
+    }
+    m_status = status;
+    m_status_title = title;
+    m_content_type = content_type;
+    m_body_len = len;
+    return DYNAMIC_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::stream(int status,const char* title,const char* content_type,stream_producer* producer){
+    if(!producer){
+        return INTERNAL_ERROR;
+    }
+    delete m_producer;
+    m_producer = producer;
+    m_status = status;
+    m_status_title = title;
+    m_content_type = content_type;
+    return STREAM_REQUEST;
+}
+
 //增加请求行
 bool http_conn::add_status_line(int status, const char *titile) {
-    return add_response("%s %d %s\n","HTTP/1.1",status,titile);
+    return add_response("%s %d %s\r\n","HTTP/1.1",status,titile);
 }
 
 //增加请求头部字段
-bool http_conn::add_headers(int content_length) {
-    add_content_length(content_length);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+bool http_conn::add_headers(long long content_length){
+    return add_content_length(content_length) && add_content_type()
+        && add_linger() && add_blank_line();
 }
 
-bool http_conn::add_content_length(int content_length) {
-    return add_response("Content-Length: %d\r\n",content_length);
+bool http_conn::add_content_length(long long content_length){
+    return add_response("Content-Length: %lld\r\n",content_length);
 }
 bool http_conn::add_content_type() {
-    return add_response("Content-Type:%S\r\n","text/html");
+    return add_response("Content-Type: %s\r\n",m_content_type);
 }
 bool http_conn::add_linger() {
     return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
@@ -423,7 +1504,106 @@ bool http_conn::add_content( const char* content )
 {
     return add_response( "%s", content );
 }
+bool http_conn::add_content_encoding(){
+    if(!m_content_encoding){
+        return true;
+    }
+    return add_response("Content-Encoding: %s\r\n",m_content_encoding);
+}
+bool http_conn::add_content_range(off_t first,off_t last){
+    return add_response("Content-Range: bytes %lld-%lld/%lld\r\n",
+                        (long long)first,(long long)last,(long long)m_file_stat.st_size);
+}
+
+//组织206响应：单个区间直接指向映射区中的偏移，多个区间按multipart/byteranges
+//把预先生成的分段头部和映射区中的各个分段交替放进iovec，都不需要拷贝文件数据
+bool http_conn::add_ranges(){
+    if(m_range_count == 1){
+        const byte_range& r = m_ranges[0];
+        off_t len = r.last - r.first + 1;
+        if(!add_status_line(206,ok_206_title) || !add_content_range(r.first,r.last)
+           || !add_headers(len)){
+            return false;
+        }
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        set_file_iov(1,r.first,len);
+        m_iv_count = 2;
+        m_bytes_to_send = m_write_idx + len;
+        return true;
+    }
+
+    int used = 0;
+    long long content_length = 0;
+    m_iv_count = 1;
+    for(int i = 0;i < m_range_count;++i){
+        const byte_range& r = m_ranges[i];
+        int n = snprintf(m_range_buf + used,RANGE_BUFFER_SIZE - used,
+                         "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                         byteranges_boundary,m_content_type,(long long)r.first,(long long)r.last,
+                         (long long)m_file_stat.st_size);
+        if(n < 0 || n >= RANGE_BUFFER_SIZE - used){
+            return false;
+        }
+        m_iv[m_iv_count].iov_base = m_range_buf + used;
+        m_iv[m_iv_count].iov_len = n;
+        set_file_iov(m_iv_count + 1,r.first,r.last - r.first + 1);
+        content_length += n + r.last - r.first + 1;
+        m_iv_count += 2;
+        used += n;
+    }
+    int n = snprintf(m_range_buf + used,RANGE_BUFFER_SIZE - used,"\r\n--%s--\r\n",byteranges_boundary);
+    if(n < 0 || n >= RANGE_BUFFER_SIZE - used){
+        return false;
+    }
+    m_iv[m_iv_count].iov_base = m_range_buf + used;
+    m_iv[m_iv_count].iov_len = n;
+    ++m_iv_count;
+    content_length += n;
+
+    if(!add_status_line(206,ok_206_title) || !add_content_length(content_length)
+       || !add_response("Content-Type: multipart/byteranges; boundary=%s\r\n",byteranges_boundary)
+       || !add_linger() || !add_blank_line()){
+        return false;
+    }
+    m_iv[0].iov_base = m_write_buf;
+    m_iv[0].iov_len = m_write_idx;
+    m_bytes_to_send = m_write_idx + content_length;
+    return true;
+}
+
+//预先生成的完整404响应，和add_status_line、add_headers、add_content生成的内容相同
+//预先生成的完整错误响应，keep-alive和close各一份
+struct canned_response{
+    std::string keep_alive;
+    std::string close;
+    canned_response(int status,const char* title,const char* form,const char* extra_headers){
+        char buf[512];
+        const char* format = "HTTP/1.1 %d %s\r\nContent-Length: %d\r\nContent-Type: text/html\r\n%sConnection: %s\r\n\r\n%s";
+        snprintf(buf,sizeof(buf),format,status,title,(int)strlen(form),extra_headers,"keep-alive",form);
+        keep_alive = buf;
+        snprintf(buf,sizeof(buf),format,status,title,(int)strlen(form),extra_headers,"close",form);
+        close = buf;
+    }
+    const std::string& get(bool linger) const {
+        return linger ? keep_alive : close;
+    }
+};
+
+static const std::string& not_found_response(bool linger){
+    static const canned_response r(404,error_404_title,error_404_form,"");
+    return r.get(linger);
+}
+
+static const std::string& too_many_response(bool linger){
+    static const canned_response r(429,error_429_title,error_429_form,"Retry-After: 1\r\n");
+    return r.get(linger);
+}
+
 bool http_conn::process_write(HTTP_CODE ret) {
+    for(int i = 0;i < MAX_IOV;++i){
+        m_iv_file_off[i] = -1;
+    }
     switch (ret){
         case INTERNAL_ERROR:
             add_status_line(500,error_500_title);
@@ -431,33 +1611,99 @@ bool http_conn::process_write(HTTP_CODE ret) {
             if(!add_content(error_500_form)){
                 return false;
             }
+            break;
         case BAD_REQUEST:
             add_status_line(400,error_400_title);
             add_headers(strlen(error_400_form));
             if(!add_content(error_400_form)){
                 return false;
             }
-        case NO_REQUEST:
-            add_status_line(404,error_404_title);
-            add_headers(strlen(error_404_form));
-            if(!add_content(error_404_form)){
-                return false;
-            }
+            break;
+        case NO_RESOURCE:
+        case TOO_MANY_REQUESTS:
+        {
+            //404和429响应是固定的，直接发送预先生成的内容，不再逐项格式化
+            const std::string& response = ret == NO_RESOURCE ? not_found_response(m_linger) : too_many_response(m_linger);
+            m_iv[0].iov_base = (void*)response.data();
+            m_iv[0].iov_len = response.size();
+            m_iv_count = 1;
+            m_bytes_to_send = response.size();
+            return true;
+        }
         case FORBIDDEN_REQUEST:
             add_status_line(403,error_403_title);
             add_headers(strlen(error_403_form));
             if(!add_content(error_403_form)){
                 return false;
             }
+            break;
+        case BAD_GATEWAY:
+            add_status_line(502,error_502_title);
+            add_headers(strlen(error_502_form));
+            if(!add_content(error_502_form)){
+                return false;
+            }
+            break;
+        case SERVICE_UNAVAILABLE:
+            add_status_line(503,error_503_title);
+            add_response("Retry-After: 1\r\n");
+            add_headers(strlen(error_503_form));
+            if(!add_content(error_503_form)){
+                return false;
+            }
+            break;
+        case DYNAMIC_REQUEST:
+            //响应体已经在m_range_buf中，和响应头一起用writev发送
+            if(!add_status_line(m_status,m_status_title) || !add_headers(m_body_len)){
+                return false;
+            }
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv[1].iov_base = m_range_buf;
+            m_iv[1].iov_len = m_body_len;
+            m_iv_count = 2;
+            m_bytes_to_send = m_write_idx + m_body_len;
+            return true;
+        case STREAM_REQUEST:
+            //先只发送响应头，响应体在write()中按块拉取
+            if(!add_status_line(m_status,m_status_title) || !add_response("Transfer-Encoding: chunked\r\n")
+               || !add_content_type() || !add_linger() || !add_blank_line()){
+                return false;
+            }
+            break;
+        case RANGE_NOT_SATISFIABLE:
+            //不发送文件内容，告诉客户端文件的实际大小
+            add_status_line(416,error_416_title);
+            add_response("Content-Range: bytes */%lld\r\n",(long long)m_file_stat.st_size);
+            add_headers(0);
+            unmap();
+            break;
         case FILE_REQUEST:
+            if(m_range_count > 0){
+                return add_ranges();
+            }
+        {
+            //响应体来自压缩缓存或者文件
+            off_t body_len = m_mem_body ? (off_t)m_mem_body->size() : m_file_stat.st_size;
             add_status_line(200,ok_200_title);
-            add_headers(m_file_stat.st_size);
+            add_response("Accept-Ranges: bytes\r\n");
+            if(lookup_mime_type(m_url).compressible){
+                add_response("Vary: Accept-Encoding\r\n");
+            }
+            add_content_encoding();
+            add_headers(body_len);
             m_iv[0].iov_base = m_write_buf;
             m_iv[0].iov_len = m_write_idx;
-            m_iv[1].iov_base = m_file_address;
-            m_iv[1].iov_len = m_file_stat.st_size;
+            if(m_mem_body){
+                m_iv[1].iov_base = (void*)m_mem_body->data();
+                m_iv[1].iov_len = body_len;
+            }else{
+                set_file_iov(1,0,body_len);
+            }
             m_iv_count = 2;
+            m_bytes_to_send = m_write_idx + body_len;
             return true;
+        }
         default:
             return false;
     }
@@ -465,5 +1711,6 @@ bool http_conn::process_write(HTTP_CODE ret) {
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_idx;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_idx;
     return true;
 }
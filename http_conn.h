@@ -16,7 +16,29 @@
 #include <cerrno>
 #include <sys/uio.h>
 #include <cstring>
+#include <ctype.h>
+#include <climits>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <string>
 #include "locker.h"
+#include "slab.h"
+#include "file_flight.h"
+#include "trace.h"
+
+class http2_session;
+struct h2_response;
+
+//流式响应的数据来源。主线程只在上一块数据全部写进socket之后才拉取下一块，
+//socket写不进去（EAGAIN）时不会再拉取，每个连接占用的内存不超过写缓冲区
+class stream_producer{
+public:
+    virtual ~stream_producer(){}
+    //向buf写入最多len字节，返回写入的字节数；返回0表示数据已经全部产生，-1表示出错（关闭连接）
+    //HTTP/1.1在主线程中调用，HTTP/2在工作线程中调用，不能阻塞
+    virtual int produce(char* buf,int len) = 0;
+};
 
 
 class http_conn{
@@ -24,12 +46,26 @@ public:
 
     static int m_epollfd; //所有的socket上的事件都被注册到同一个epoll对象上.
     static int m_user_count; //统计用户的数量
+    static int m_write_quantum; //每个连接每轮最多发送的字节数，0表示不限制，一次发送到EAGAIN为止
+    static int m_zerocopy_threshold; //内存中的响应体一次发送不少于这么多字节时用MSG_ZEROCOPY，0表示关闭
+    static std::atomic<unsigned long long> m_zerocopy_sends;    //MSG_ZEROCOPY发送次数
+    static std::atomic<unsigned long long> m_zerocopy_copied;   //内核报告实际做了复制的完成通知次数
+    static std::atomic<bool> m_draining;    //进程正在退出（升级或者平滑停止），响应之后不再保持连接
+    static int m_min_rate;                  //请求和响应进行中每秒至少传输的字节数，0表示不检查
+    static int m_rate_window;               //按多少秒的窗口计算传输速率
+    static std::atomic<unsigned long long> m_slow_evictions[4];    //按阶段统计因为太慢被断开的连接数，下标为PROGRESS_PHASE
 
     static const int READ_BUFFER_SIZE = 4048;
     static const int WRITE_BUFFER_SIZE = 4048;
     static const int FILENAME_LEN = 200;
+    static const int MAX_RANGES = 16;                       //multipart/byteranges最多支持的区间数
+    static const int RANGE_BUFFER_SIZE = MAX_RANGES * 192;  //存放各个分段头部的缓冲区，分段头部最长约160字节，另有结束分隔符
+    static const int BODY_BUFFER_SIZE = RANGE_BUFFER_SIZE;  //动态响应体和分段头部共用同一个缓冲区
+    static const int MAX_IOV = 2 * MAX_RANGES + 2;          //响应头 + (分段头 + 分段数据) * n + 结束分隔符
+    static const int CHUNK_HEAD_SIZE = 8;                   //写缓冲区开头为chunk的长度行预留的字节数
+    static const off_t MMAP_WINDOW_SIZE = 4 * 1024 * 1024;  //超过这个大小的文件按窗口分段映射，必须是页大小的整数倍
 
-    //HTTP请求方法，但我们只支持GET
+    //HTTP请求方法，静态文件只支持GET，其他方法由动态路由处理或者转发给上游
     enum METHOD {GET = 0,POST,HEAD,PUT,DELETE,TRACE,OPTIONS,CONNECT};
 
     /* 解析客户端请求时主状态机状态
@@ -57,12 +93,32 @@ public:
      * FILE_REQUEST         文件请求，获取文件成功
      * INTERNAL_ERROR       表示服务器内部数据
      * CLOSED_CONNECTION    表示客户端已经断开连接了
+     * RANGE_NOT_SATISFIABLE 表示请求的Range区间都不在文件范围内
+     * PROXY_REQUEST        表示请求匹配反向代理路由，需要转发给上游
+     * BAD_GATEWAY          表示上游服务器不可用
+     * DYNAMIC_REQUEST      表示动态处理函数已经生成了响应
+     * STREAM_REQUEST       表示动态处理函数返回了流式响应，响应体用chunked编码边产生边发送
+     * SERVICE_UNAVAILABLE  表示同时转发给上游的请求太多，稍后重试
      */
-    enum HTTP_CODE{NO_REQUEST = 0,GET_REQUEST,BAD_REQUEST,NO_RESOURCE,FORBIDDEN_REQUEST,FILE_REQUEST,INTERNAL_ERROR,CLOSED_CONNECTION};
+    enum HTTP_CODE{NO_REQUEST = 0,GET_REQUEST,BAD_REQUEST,NO_RESOURCE,FORBIDDEN_REQUEST,FILE_REQUEST,INTERNAL_ERROR,CLOSED_CONNECTION,RANGE_NOT_SATISFIABLE,PROXY_REQUEST,BAD_GATEWAY,DYNAMIC_REQUEST,STREAM_REQUEST,TOO_MANY_REQUESTS,SERVICE_UNAVAILABLE};
+
+    //线程池中的优先级类，按处理请求的预计开销从小到大：路由表中的处理函数和未完成的请求、
+    //小文件和没见过的路径、大文件（首次请求可能要压缩）、反向代理（工作线程阻塞在上游）
+    enum SCHED_CLASS{SCHED_CONTROL = 0,SCHED_SMALL,SCHED_LARGE,SCHED_PROXY};
+    static const off_t SMALL_FILE_LIMIT = 64 * 1024;    //不超过这个大小的文件算小文件
 
+    //连接在等待对方的哪一步：空闲（两个请求之间）、读请求头、读请求体、发送响应；HTTP/2连接不检查
+    enum PROGRESS_PHASE{PHASE_IDLE = 0,PHASE_HEADER,PHASE_BODY,PHASE_WRITE,PHASE_H2};
 
+    //Range请求中的一个闭区间[first,last]
+    struct byte_range{
+        off_t first;
+        off_t last;
+    };
 
-    http_conn(){};
+
+
+    http_conn():m_sockfd(-1),m_generation(0),m_h2(0),m_producer(0){};
     ~http_conn(){};
 
     void process(); //处理客户端的请求
@@ -70,57 +126,173 @@ public:
     void close_conn(); //关闭连接
     bool read(); //非阻塞的读
     bool write(); //非阻塞的写
+    bool write_yielded() const {return m_write_yielded;} //上一次write是否因为配额用完而让出
+    bool needs_fill() const {return m_h2_fill;} //HTTP/2连接发完了已经生成的数据，需要交给线程池生成更多
+    //响应发完之后缓冲区中已经有下一个请求（流水线），还没有解析过，不等EPOLLIN直接交给线程池
+    bool pipelined() const {return m_read_idx > 0 && m_checked_index == 0 && m_bytes_to_send == 0;}
+    unsigned generation() const {return m_generation.load(std::memory_order_acquire);}
+    bool zerocopy_pending() const {return !m_zc_refs.empty();} //是否还有MSG_ZEROCOPY发送没有完成
+    //处理socket错误队列中的MSG_ZEROCOPY完成通知并重新注册事件，socket真的出错时返回false
+    bool reap_zerocopy();
+    int sockfd() const {return m_sockfd;}
+    //主线程读完数据之后调用：只看请求行，估计这次处理的开销，返回SCHED_CLASS
+    int schedule_class() const;
+    //主线程把连接交给线程池之前调用，直到工作线程重新注册事件或者关闭连接，in_worker()都返回true
+    void hand_off(){m_in_worker.store(true,std::memory_order_relaxed);}
+    bool in_worker() const {return m_in_worker.load(std::memory_order_acquire);}
+    //主线程定期调用：请求或响应进行中，一个窗口内传输太慢的连接被shutdown，之后由正常的挂断事件关闭。
+    //只能对不在线程池中的连接调用，工作线程可能正在关闭它，文件描述符随时会被别的连接或文件重用
+    void check_progress(time_t now);
+
+    static slab<http_conn>* m_slab; //连接对象从这里分配，关闭连接时归还
+
+    //把请求的url映射为doc_root下的路径
+    static void map_path(const char* url,char* real_file);
+    //根据文件状态检查是否可以发送，可以则返回FILE_REQUEST
+    static HTTP_CODE check_file(const struct stat& st);
+
+    //HTTP/2会话在工作线程中调用：一个流的请求按HTTP/1.1请求的流程（do_request）处理，结果放进res
+    void serve_h2(const char* method,const char* path,const char* accept_encoding,h2_response& res);
+
+    //给动态处理函数使用的请求信息
+    METHOD method() const {return m_method;}
+    const char* url() const {return m_url;}
+    const char* content() const {return m_content;}     //请求体，没有则为0
+    int content_length() const {return m_content_length;}
+    //动态处理函数生成响应：响应体按format格式化，直接写进连接的缓冲区，不超过BODY_BUFFER_SIZE
+    //content_type和title必须在响应发送完之前一直有效（通常是字符串常量）
+    HTTP_CODE reply(int status,const char* title,const char* content_type,const char* format,...);
+    //动态处理函数生成长度未知的流式响应，连接接管producer，发送完或者连接关闭时delete
+    HTTP_CODE stream(int status,const char* title,const char* content_type,stream_producer* producer);
+
+    //请求被采样时记录一个时间点
+    void trace(int event){
+        if(m_trace_id){
+            tracer::record_event(m_trace_id,event);
+        }
+    }
 
 
 
 private:
+    //热数据：每次读写、解析和调度都会访问的状态字段放在一起，只占对象开头的少数几个缓存行
     int m_sockfd;                                   //该HTTP连接的socket
-    sockaddr_in m_address;                          //通信的socket地址
-
-    char m_read_buf[READ_BUFFER_SIZE];              //读缓冲区
+    std::atomic<unsigned> m_generation;             //对象每被回收一次加一，用来识别过期的句柄
+    CHECK_STATE m_check_state;                      //主状态机当前所处的状态
     int m_read_idx;                                 //标识读缓冲区中以及读入的客户端数据的最后一个字节的下一个位置
     int m_checked_index;                            //当前正在分析的字符在读缓冲区的位置
     int m_start_line;                               //当前正在解析行的起始位置
-
-    char m_write_buf[WRITE_BUFFER_SIZE];            //写缓冲区
+    int m_request_end;                              //完整请求（含请求体）的结束位置，之后是流水线中的下一个请求，0表示没有完整请求
+    char m_request_end_byte;                        //请求体之后补'\0'时覆盖掉的下一个请求的第一个字节
+    int m_header_idx;                               //第一个请求头在读缓冲区中的位置，转发请求时使用
     int m_write_idx;                                //写缓冲区中待发送的字节数
-    struct stat m_file_stat;    //目标文件的状态，可以用来看文件是否存在，是否可读，是否有访问权限，是否为目录，以及文件大小等相关信息
-    char* m_file_address;   //客户请求的目标文件被mmap到内存中的起始位置
-    struct iovec m_iv[2];                           // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
     int m_iv_count;                                 //被写的内存块的数量，m_write_buf + m_file_address
+    int m_iv_idx;                                   //下一次writev从第几个内存块开始（前面的已经发送完）
+    long long m_bytes_to_send;                      //还要发送的字节数
+    long long m_bytes_have_send;                    //已经发送的字节数
+    bool m_write_yielded;                           //本轮配额用完，还有数据没发送
+    bool m_h2_fill;                                 //HTTP/2的待发送数据发完了，等工作线程生成更多DATA帧
+    uint32_t m_trace_id;                            //被采样的请求的编号，不采样为0
 
-    char * m_url;   //请求目标文件名
-    char * m_version;    //协议版本只支持HTTP1.1
-    METHOD m_method;    //请求方法
-    char * m_host;      //主机名
+    //传输速率检查。阶段由主线程和工作线程设置，其余只在主线程中访问
+    std::atomic<int> m_phase;
+    time_t m_window_start;                          //当前窗口的开始时间
+    long long m_window_bytes;                       //当前窗口内读写的字节数
+    unsigned long long m_window_acked;              //当前窗口开始时对方确认的字节数（TCP_INFO），ULLONG_MAX表示窗口还没开始
+    bool m_evicted;
+    std::atomic<bool> m_in_worker;                  //在线程池中处理，由主线程设置，工作线程重新注册事件时清除
+    uint64_t m_accept_ns;                           //开启跟踪时建立连接的时间，第一个请求开始后清零
+    uint32_t m_capture_id;                          //记录流量时的连接编号，不记录为0
     bool m_linger;      //HTTP请求是否要保持连接
+    METHOD m_method;    //请求方法
     int m_content_length;   //HTTP请求的消息总长度
-    char m_real_file[FILENAME_LEN]; //客户请求目标文件的完整路径 doc_root + m_url
+    int m_range_count;                              //区间个数，0表示发送整个文件
+    int m_file_fd;          //流式发送大文件时保持打开的文件描述符，否则为-1
+    char* m_file_address;   //客户请求的目标文件被mmap到内存中的起始位置
+    char* m_window;         //流式发送时当前映射的窗口
+    off_t m_window_off;     //窗口在文件中的偏移
+    size_t m_window_len;    //窗口长度
 
+    char * m_url;   //请求目标文件名
+    char * m_version;    //协议版本只支持HTTP1.1
+    char * m_host;      //主机名
+    char * m_range;                                 //Range请求头的值，没有则为0
+    char * m_accept_encoding;                       //Accept-Encoding请求头的值，没有则为0
+    const char * m_content_type;                    //响应的Content-Type
+    const char * m_content_encoding;                //响应的Content-Encoding，不压缩时为0
+    char * m_upgrade;                               //Upgrade请求头的值，没有则为0
+    char * m_http2_settings;                        //HTTP2-Settings请求头的值，没有则为0
+    char * m_content;                               //请求体，没有则为0
+    int m_status;                                   //动态响应的状态码
+    const char * m_status_title;                    //动态响应的状态描述
+    int m_body_len;                                 //动态响应体的长度
+    http2_session * m_h2;                           //切换到HTTP/2之后的会话，HTTP/1.1连接为0
+    stream_producer * m_producer;                   //流式响应的数据来源，没有则为0
 
-    CHECK_STATE m_check_state;                      //主状态机当前所处的状态
+    //冷数据：只在建立连接、生成响应时用到的字段和大块缓冲区放在后面
+    sockaddr_in m_address;                          //通信的socket地址，Unix socket上的连接只有sin_family为AF_UNIX
+    struct stat m_file_stat;    //目标文件的状态，可以用来看文件是否存在，是否可读，是否有访问权限，是否为目录，以及文件大小等相关信息
+    std::shared_ptr<const std::string> m_mem_body;  //来自压缩缓存的响应体，不为空时代替m_file_address发送
+    file_flight::file_ptr m_file;                   //打开的文件，m_file_address和m_file_fd属于它，和其他连接共享
+    //MSG_ZEROCOPY发送的序号和它引用的响应体，收到完成通知之前不能释放
+    struct zc_ref{
+        uint32_t seq;
+        std::shared_ptr<const std::string> body;
+    };
+    std::deque<zc_ref> m_zc_refs;
+    uint32_t m_zc_seq;                              //下一次MSG_ZEROCOPY发送的序号，和内核的计数一致
+    bool m_zc_enabled;                              //socket上是否已经打开SO_ZEROCOPY
+    bool m_zc_disabled;                             //这个连接不再使用MSG_ZEROCOPY（不支持或者内核总是复制）
+    struct iovec m_iv[MAX_IOV];                     // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
+    off_t m_iv_file_off[MAX_IOV];                   //流式发送时该内存块对应的文件偏移，不是文件数据则为-1
+    byte_range m_ranges[MAX_RANGES];                //解析出的可满足的区间
+    char m_real_file[FILENAME_LEN]; //客户请求目标文件的完整路径 doc_root + m_url
+    char m_read_buf[READ_BUFFER_SIZE];              //读缓冲区
+    char m_write_buf[WRITE_BUFFER_SIZE];            //写缓冲区
+    char m_range_buf[RANGE_BUFFER_SIZE];            //multipart/byteranges各分段的头部以及结束分隔符，或者动态响应体
 
     void init();                                    //初始化连接其余的数据
+    void rearm(int ev);                             //重新注册EPOLLONESHOT事件，连接交回主线程
     HTTP_CODE process_read();                       //解析HTTP请求
     HTTP_CODE parse_request_line(char * text);      //解析HTTP请求首行
     HTTP_CODE parse_request_header(char * text);    //解析HTTP请求头
     HTTP_CODE parse_request_content(char * text);   //解析HTTP请求体
 
     LINE_STATUS parse_line();                        //解析行
+    HTTP_CODE parse_range();                         //解析Range请求头，得到m_ranges
+    void negotiate_encoding();                       //根据Accept-Encoding选择预压缩文件或者压缩缓存
+    bool try_precompressed(const char* suffix,const char* encoding);
 
     char * get_line(){return m_read_buf+m_start_line;}
     HTTP_CODE do_request();     //具体处理
+    HTTP_CODE open_file_shared();   //打开m_real_file，同一文件的并发请求共享结果
+    HTTP_CODE do_proxy();       //转发给上游，完成后返回PROXY_REQUEST（连接已经重新注册或者关闭），否则返回要回复的错误
+    bool is_h2_preface() const; //读缓冲区中是否是HTTP/2连接前言（或者它的前缀）
+    void process_h2();          //把读到的数据交给HTTP/2会话处理
+    bool upgrade_h2(HTTP_CODE ret); //处理Upgrade: h2c请求，切换到HTTP/2，ret是原请求的处理结果
+    void take_h2_response(HTTP_CODE ret,h2_response& res);  //把do_request的结果转成HTTP/2流的响应，清空连接上的响应状态
+    bool write_h2();            //发送HTTP/2会话的待发送数据
     void unmap();   //对内存映射区进行munmap操作
+    bool map_window(off_t offset);  //流式发送时映射包含offset的窗口
+    int prepare_iov(struct iovec* iv,long long limit);  //生成本轮writev要发送的内存块，总长度不超过limit
+    bool pull_chunk();          //从m_producer拉取下一块数据，编码成chunk放进写缓冲区
+    ssize_t send_iov(struct iovec* iv,int iv_count);    //发送，足够大的内存响应体用MSG_ZEROCOPY
+    void drain_zerocopy();      //读取已经到达的完成通知，释放内核用完的响应体
+    static void bury_zerocopy(std::deque<zc_ref>& refs);   //连接关闭时还没完成的响应体延迟释放
+    void set_file_iov(int idx,off_t offset,off_t len);  //让第idx个内存块指向文件中的[offset,offset+len)
 
     bool process_write(HTTP_CODE ret);
     bool add_response(const char* format,...);  //往写缓冲区中写入待发送的数据
     bool add_content(const char* content);
     bool add_content_type();
     bool add_status_line(int status,const char* titile);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    bool add_headers(long long content_length);
+    bool add_content_length(long long content_length);
     bool add_linger();
     bool add_blank_line();
+    bool add_content_range(off_t first,off_t last);
+    bool add_content_encoding();
+    bool add_ranges();                              //按m_ranges组织206响应的iovec
 
 
 };
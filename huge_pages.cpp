@@ -0,0 +1,55 @@
+//大页内存的分配
+#include <sys/mman.h>
+#include <stdint.h>
+#include <new>
+#include "huge_pages.h"
+
+huge_pages::MODE huge_pages::m_mode = huge_pages::HUGE_OFF;
+std::atomic<unsigned long long> huge_pages::m_hugetlb_bytes(0);
+std::atomic<unsigned long long> huge_pages::m_thp_bytes(0);
+std::atomic<unsigned long long> huge_pages::m_fallback_bytes(0);
+
+void* huge_pages::alloc(size_t size,size_t& actual){
+    if(m_mode == HUGE_OFF){
+        actual = size;
+        return ::operator new(size);
+    }
+    actual = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if(m_mode == HUGE_TLB){
+        void* p = mmap(NULL,actual,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,-1,0);
+        if(p != MAP_FAILED){
+            m_hugetlb_bytes.fetch_add(actual,std::memory_order_relaxed);
+            return p;
+        }
+    }
+    //透明大页要求地址按大页对齐：多映射一个大页，再把两头多出来的部分还回去
+    size_t len = actual + HUGE_PAGE_SIZE;
+    char* raw = (char*)mmap(NULL,len,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if(raw == MAP_FAILED){
+        throw std::bad_alloc();
+    }
+    char* p = (char*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if(p > raw){
+        munmap(raw,p - raw);
+    }
+    if(raw + len > p + actual){
+        munmap(p + actual,raw + len - (p + actual));
+    }
+    if(madvise(p,actual,MADV_HUGEPAGE) == 0){
+        m_thp_bytes.fetch_add(actual,std::memory_order_relaxed);
+    }else{
+        m_fallback_bytes.fetch_add(actual,std::memory_order_relaxed);
+    }
+    return p;
+}
+
+void huge_pages::free(void* p,size_t actual){
+    if(!p){
+        return;
+    }
+    if(m_mode == HUGE_OFF){
+        ::operator delete(p);
+        return;
+    }
+    munmap(p,actual);
+}
@@ -0,0 +1,41 @@
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+
+#include <stddef.h>
+#include <atomic>
+
+//大块、长期存在、被随机访问的内存（连接对象池和连接表）用大页，减少TLB缺失。
+//HUGE_TLB先用MAP_HUGETLB申请预留的大页（需要vm.nr_hugepages），不够时退到透明大页；
+//HUGE_THP用madvise(MADV_HUGEPAGE)请求透明大页，内核不支持或者没有连续内存时仍然是普通页。
+//默认关闭，和原来一样用operator new分配。
+class huge_pages{
+public:
+    enum MODE{
+        HUGE_OFF = 0,
+        HUGE_THP,
+        HUGE_TLB
+    };
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    //启动时在分配任何内存之前设置
+    static void set_mode(MODE mode){m_mode = mode;}
+    static MODE mode(){return m_mode;}
+
+    //分配至少size字节，开启大页时长度向上取整到大页的整数倍，实际长度通过actual返回。
+    //失败时抛出std::bad_alloc
+    static void* alloc(size_t size,size_t& actual);
+    static void free(void* p,size_t actual);
+
+    //开启大页之后用MAP_HUGETLB、透明大页（madvise成功）和普通页分配出去的字节数
+    static unsigned long long hugetlb_bytes(){return m_hugetlb_bytes.load(std::memory_order_relaxed);}
+    static unsigned long long thp_bytes(){return m_thp_bytes.load(std::memory_order_relaxed);}
+    static unsigned long long fallback_bytes(){return m_fallback_bytes.load(std::memory_order_relaxed);}
+
+private:
+    static MODE m_mode;
+    static std::atomic<unsigned long long> m_hugetlb_bytes;
+    static std::atomic<unsigned long long> m_thp_bytes;
+    static std::atomic<unsigned long long> m_fallback_bytes;
+};
+
+#endif
@@ -0,0 +1,98 @@
+//锁的竞争统计
+#include "lock_stats.h"
+
+#ifdef LOCK_STATS
+
+#include <pthread.h>
+#include <cstdio>
+#include <cstring>
+
+//登记和链表用裸的pthread互斥锁，不经过被统计的locker
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char* site_names[lock_stats::MAX_SITES];
+static int site_count = 0;
+std::atomic<lock_stats::thread_stats*> lock_stats::s_threads(0);
+
+int lock_stats::site(const char* name){
+    pthread_mutex_lock(&registry_mutex);
+    int i = 0;
+    while(i < site_count && strcmp(site_names[i],name) != 0){
+        ++i;
+    }
+    if(i == site_count){
+        if(site_count < MAX_SITES){
+            site_names[site_count++] = name;
+        }else{
+            i = MAX_SITES - 1;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return i;
+}
+
+lock_stats::thread_stats* lock_stats::create(){
+    thread_stats* t = new thread_stats();
+    for(int s = 0;s < MAX_SITES;++s){
+        t->acquired[s] = 0;
+        t->contended[s] = 0;
+        t->wait_ns[s] = 0;
+        t->hold_ns[s] = 0;
+        for(int b = 0;b < BUCKETS;++b){
+            t->wait_hist[s][b] = 0;
+            t->hold_hist[s][b] = 0;
+        }
+    }
+    t->next = s_threads.load();
+    while(!s_threads.compare_exchange_weak(t->next,t)){
+    }
+    return t;
+}
+
+static void append_hist(std::string& out,const uint64_t* hist,int n){
+    //去掉末尾的0
+    while(n > 1 && hist[n - 1] == 0){
+        --n;
+    }
+    char buf[32];
+    out.append("[");
+    for(int b = 0;b < n;++b){
+        snprintf(buf,sizeof(buf),b ? ",%llu" : "%llu",(unsigned long long)hist[b]);
+        out.append(buf);
+    }
+    out.append("]");
+}
+
+std::string lock_stats::dump(){
+    pthread_mutex_lock(&registry_mutex);
+    int sites = site_count;
+    pthread_mutex_unlock(&registry_mutex);
+
+    std::string out = "{\"sites\":[";
+    for(int s = 0;s < sites;++s){
+        uint64_t acquired = 0,contended = 0,wait_ns = 0,hold_ns = 0;
+        uint64_t wait_hist[BUCKETS] = {0},hold_hist[BUCKETS] = {0};
+        for(thread_stats* t = s_threads.load();t;t = t->next){
+            acquired += t->acquired[s].load(std::memory_order_relaxed);
+            contended += t->contended[s].load(std::memory_order_relaxed);
+            wait_ns += t->wait_ns[s].load(std::memory_order_relaxed);
+            hold_ns += t->hold_ns[s].load(std::memory_order_relaxed);
+            for(int b = 0;b < BUCKETS;++b){
+                wait_hist[b] += t->wait_hist[s][b].load(std::memory_order_relaxed);
+                hold_hist[b] += t->hold_hist[s][b].load(std::memory_order_relaxed);
+            }
+        }
+        char buf[256];
+        snprintf(buf,sizeof(buf),"%s{\"name\":\"%s\",\"acquired\":%llu,\"contended\":%llu,\"wait_ns\":%llu,\"hold_ns\":%llu,\"wait_hist\":",
+                 s ? "," : "",site_names[s],(unsigned long long)acquired,(unsigned long long)contended,
+                 (unsigned long long)wait_ns,(unsigned long long)hold_ns);
+        out.append(buf);
+        append_hist(out,wait_hist,BUCKETS);
+        out.append(",\"hold_hist\":");
+        append_hist(out,hold_hist,BUCKETS);
+        out.append("}");
+    }
+    out.append("],\"hist_unit\":\"bucket i counts durations in [2^i,2^(i+1)) ns\"}\n");
+    return out;
+}
+
+#endif
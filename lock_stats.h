@@ -0,0 +1,85 @@
+#ifndef LOCK_STATS_H
+#define LOCK_STATS_H
+
+//锁的竞争统计，只在定义了LOCK_STATS时编译（cmake -DLOCK_STATS=ON），默认构建中locker和sem没有任何额外开销。
+//每个命名的加锁位置（同名的锁共用一个位置）统计获取次数、发生竞争的次数、等待时间和持有时间的直方图。
+//计数放在每个线程自己的存储中，只有本线程写，导出时把所有线程的加起来。
+#ifdef LOCK_STATS
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+class lock_stats{
+public:
+    static const int MAX_SITES = 32;        //最多的加锁位置数，超过的归到最后一个
+    static const int BUCKETS = 32;          //直方图第i格是[2^i,2^(i+1))纳秒，0纳秒计入第0格
+
+    //按名字登记加锁位置，返回编号；构造锁的时候调用
+    static int site(const char* name);
+
+    //记录一次获取：wait_ns为等待时间，contended表示第一次尝试没有拿到
+    static void acquired(int site,uint64_t wait_ns,bool contended){
+        thread_stats* t = local();
+        bump(t->acquired[site]);
+        if(contended){
+            bump(t->contended[site]);
+        }
+        add(t->wait_ns[site],wait_ns);
+        bump(t->wait_hist[site][bucket(wait_ns)]);
+    }
+    //记录一次释放，hold_ns为持有时间
+    static void released(int site,uint64_t hold_ns){
+        thread_stats* t = local();
+        add(t->hold_ns[site],hold_ns);
+        bump(t->hold_hist[site][bucket(hold_ns)]);
+    }
+
+    static uint64_t now_ns(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    //所有线程合计，JSON格式
+    static std::string dump();
+
+private:
+    struct thread_stats{
+        std::atomic<uint64_t> acquired[MAX_SITES];
+        std::atomic<uint64_t> contended[MAX_SITES];
+        std::atomic<uint64_t> wait_ns[MAX_SITES];
+        std::atomic<uint64_t> hold_ns[MAX_SITES];
+        std::atomic<uint64_t> wait_hist[MAX_SITES][BUCKETS];
+        std::atomic<uint64_t> hold_hist[MAX_SITES][BUCKETS];
+        thread_stats* next;
+    };
+
+    //只有本线程写，读取时其他线程可能看到稍旧的值，不需要原子的读-改-写
+    static void bump(std::atomic<uint64_t>& v){
+        v.store(v.load(std::memory_order_relaxed) + 1,std::memory_order_relaxed);
+    }
+    static void add(std::atomic<uint64_t>& v,uint64_t n){
+        v.store(v.load(std::memory_order_relaxed) + n,std::memory_order_relaxed);
+    }
+    static int bucket(uint64_t ns){
+        int b = ns ? 63 - __builtin_clzll(ns) : 0;
+        return b < BUCKETS ? b : BUCKETS - 1;
+    }
+    static thread_stats* local(){
+        static __thread thread_stats* t = 0;
+        if(!t){
+            t = create();
+        }
+        return t;
+    }
+    //分配本线程的计数并挂到全局链表上，线程退出后不释放
+    static thread_stats* create();
+
+    static std::atomic<thread_stats*> s_threads;    //所有线程的计数，导出时遍历
+};
+
+#endif
+
+#endif
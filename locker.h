@@ -4,32 +4,80 @@
 #include <pthread.h>
 #include <exception>
 #include <semaphore.h>
+#include <time.h>
+#include "lock_stats.h"
+
+//单调时钟的微秒数，用于自旋的时间预算
+inline long long monotonic_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//自旋循环中让出流水线，超线程的另一个线程可以继续执行
+inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
 
 //线程同步机制封装类
 
+//name是加锁位置的名字，定义了LOCK_STATS时按名字统计竞争，否则忽略
 //互斥锁类.
 class locker{
 public:
-    locker(){
+    explicit locker(const char* name = "unnamed"){
         if(pthread_mutex_init(&m_mutex,NULL)!=0){
             throw std::exception();
         }
+#ifdef LOCK_STATS
+        m_site = lock_stats::site(name);
+        m_since = 0;
+#else
+        (void)name;
+#endif
     }
     ~locker(){
         pthread_mutex_destroy(&m_mutex);
     }
+#ifdef LOCK_STATS
+    //先试一次，拿不到才算竞争并计时
+    bool lock(){
+        uint64_t start = lock_stats::now_ns();
+        bool contended = pthread_mutex_trylock(&m_mutex)!=0;
+        if(contended && pthread_mutex_lock(&m_mutex)!=0){
+            return false;
+        }
+        m_since = lock_stats::now_ns();
+        lock_stats::acquired(m_site,contended ? m_since - start : 0,contended);
+        return true;
+    }
+    bool unlock(){
+        lock_stats::released(m_site,lock_stats::now_ns() - m_since);
+        return pthread_mutex_unlock(&m_mutex)==0;
+    }
+#else
     bool lock(){
         return pthread_mutex_lock(&m_mutex)==0;
     }
     bool unlock(){
         return pthread_mutex_unlock(&m_mutex)==0;
     }
+#endif
     pthread_mutex_t * get(){
         return &m_mutex;
     }
 
 private:
+    friend class cond;
     pthread_mutex_t m_mutex;
+#ifdef LOCK_STATS
+    int m_site;
+    uint64_t m_since;       //持有者拿到锁的时间，只有持有者读写
+#endif
 };
 
 
@@ -47,6 +95,17 @@ public:
     bool wait(pthread_mutex_t * mutex){
         return pthread_cond_wait(&m_cond,mutex)==0;
     }
+    //等待期间锁是放开的，不计入持有时间
+    bool wait(locker& l){
+#ifdef LOCK_STATS
+        lock_stats::released(l.m_site,lock_stats::now_ns() - l.m_since);
+        bool ok = pthread_cond_wait(&m_cond,&l.m_mutex)==0;
+        l.m_since = lock_stats::now_ns();
+        return ok;
+#else
+        return pthread_cond_wait(&m_cond,&l.m_mutex)==0;
+#endif
+    }
     bool timedwait(pthread_mutex_t * mutex,struct timespec t){
         return pthread_cond_timedwait(&m_cond,mutex,&t)==0;
     }
@@ -64,29 +123,77 @@ private:
 //信号量类
 class sem{
 public:
-    sem(){
+    explicit sem(const char* name = "unnamed"){
         if(sem_init(&m_sem,0,0)!=0){
             throw std::exception();
         }
+        init_site(name);
     }
-    sem(int num){
+    sem(int num,const char* name = "unnamed"){
         if(sem_init(&m_sem,0,num)!=0){
             throw std::exception();
         }
+        init_site(name);
     }
     ~sem(){
         sem_destroy(&m_sem);
     }
     //等待信号量
     bool wait(){
+#ifdef LOCK_STATS
+        //信号量没有持有时间，只统计等待
+        uint64_t start = lock_stats::now_ns();
+        bool contended = sem_trywait(&m_sem)!=0;
+        if(contended && sem_wait(&m_sem)!=0){
+            return false;
+        }
+        lock_stats::acquired(m_site,contended ? lock_stats::now_ns() - start : 0,contended);
+        return true;
+#else
         return sem_wait(&m_sem)==0;
+#endif
+    }
+    //自旋最多spin_us微秒等待信号量，不进入内核睡眠，省掉唤醒的延迟；超时返回false
+    bool spin(int spin_us){
+        long long deadline = monotonic_us() + spin_us;
+#ifdef LOCK_STATS
+        uint64_t start = lock_stats::now_ns();
+        bool first = true;
+#endif
+        do{
+            for(int i = 0;i < 64;++i){
+                if(sem_trywait(&m_sem)==0){
+#ifdef LOCK_STATS
+                    lock_stats::acquired(m_site,first ? 0 : lock_stats::now_ns() - start,!first);
+#endif
+                    return true;
+                }
+#ifdef LOCK_STATS
+                first = false;
+#endif
+                cpu_relax();
+            }
+        }while(monotonic_us() < deadline);
+        return false;
     }
     //增加信号量
     bool post(){
         return sem_post(&m_sem)==0;
     }
+private:
+    void init_site(const char* name){
+#ifdef LOCK_STATS
+        m_site = lock_stats::site(name);
+#else
+        (void)name;
+#endif
+    }
+
 private:
     sem_t m_sem;
+#ifdef LOCK_STATS
+    int m_site;
+#endif
 };
 
 
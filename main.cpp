@@ -9,16 +9,40 @@
 #include <cerrno>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
+#include <cstddef>
 #include <csignal>
+#include <deque>
+#include <algorithm>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "proxy.h"
+#include "router.h"
+#include "path_filter.h"
+#include "prefork.h"
+#include "upgrade.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "capture.h"
+#include "huge_pages.h"
 
 #define MAX_FD 65535 //最大的文件描述符个数
 #define MAX_EVENT_NUMBER 10000 //同时最大监听事件数量
+#define DRAIN_TIMEOUT 30 //退出时等待现有连接处理完的最长时间（秒）
+#define POOL_THREADS 8 //线程池的线程数
 
 int http_conn::m_epollfd = -1; //所有的socket上的事件都被注册到同一个epoll对象上
 int http_conn::m_user_count = 0; //统计用户的数量
+int http_conn::m_write_quantum = 64 * 1024; //每个连接每轮最多发送64KB
+int http_conn::m_zerocopy_threshold = 0; //默认不使用MSG_ZEROCOPY
+std::atomic<unsigned long long> http_conn::m_zerocopy_sends(0);
+std::atomic<unsigned long long> http_conn::m_zerocopy_copied(0);
+std::atomic<bool> http_conn::m_draining(false);
+int http_conn::m_min_rate = 0;
+int http_conn::m_rate_window = 10;
+std::atomic<unsigned long long> http_conn::m_slow_evictions[4];
+slab<http_conn>* http_conn::m_slab = nullptr; //连接对象池
 //添加信号捕捉
 void addsig(int sig,void(handler)(int)){
     struct sigaction sa;
@@ -28,64 +52,304 @@ void addsig(int sig,void(handler)(int)){
     sigaction(sig,&sa,nullptr);
 }
 
-//添加文件描述符到epoll当中 http_conn.cpp里实现
-extern void addfd(int epollfd,int fd,bool one_shot);
-//从epoll中删除文件描述符
-extern void removefd(int epollfd,int fd);
-//修改文件描述符，重置socket EPOLLONESHOT和EPOLLRDHUP事件，确保下一次可读时EPOLLIN时间被触发
-extern void modfd(int epollfd,int fd,int ev);
+//健康检查
+static http_conn::HTTP_CODE handle_healthz(http_conn& conn){
+    return conn.reply(200,"OK","text/plain","ok\n");
+}
 
-int main(int argc,char* argv[]){
+//服务器状态
+static http_conn::HTTP_CODE handle_status(http_conn& conn){
+    file_flight& flight = file_flight::instance();
+    path_filter& filter = path_filter::instance();
+    rate_limiter& limiter = rate_limiter::instance();
+    //连接数是所有worker进程之和，其余计数只属于处理这个请求的进程
+    int workers,connections;
+    unsigned long long accepted,restarts;
+    prefork::totals(workers,connections,accepted,restarts);
+    return conn.reply(200,"OK","application/json",
+                      "{\"workers\":%d,\"worker_restarts\":%llu,\"accepted\":%llu,"
+                      "\"connections\":%d,\"file_opens\":%llu,\"file_opens_coalesced\":%llu,"
+                      "\"filter_rejects\":%llu,\"negative_hits\":%llu,\"filter_false_positives\":%llu,"
+                      "\"zerocopy_sends\":%llu,\"zerocopy_copied\":%llu,"
+                      "\"rate_limited_requests\":%llu,\"rate_limited_connections\":%llu,"
+                      "\"slow_header_evictions\":%llu,\"slow_body_evictions\":%llu,\"slow_write_evictions\":%llu,"
+                      "\"hugetlb_bytes\":%llu,\"thp_bytes\":%llu,\"huge_fallback_bytes\":%llu}\n",
+                      workers,restarts,accepted,connections,flight.leaders(),flight.followers(),
+                      filter.filter_rejects(),filter.negative_hits(),filter.false_positives(),
+                      http_conn::m_zerocopy_sends.load(),http_conn::m_zerocopy_copied.load(),
+                      limiter.limited_requests(),limiter.limited_connections(),
+                      http_conn::m_slow_evictions[http_conn::PHASE_HEADER].load(),
+                      http_conn::m_slow_evictions[http_conn::PHASE_BODY].load(),
+                      http_conn::m_slow_evictions[http_conn::PHASE_WRITE].load(),
+                      huge_pages::hugetlb_bytes(),huge_pages::thp_bytes(),huge_pages::fallback_bytes());
+}
 
-    if(argc <= 1){
-        printf("按照如下格式运行：%s port_num\n",basename(argv[0]));
-        exit(-1);
+//把一个已经生成好的字符串作为流式响应发送，用于比动态响应的缓冲区大的内容
+class string_producer : public stream_producer{
+public:
+    explicit string_producer(const std::string& text):m_text(text),m_offset(0){}
+    int produce(char* buf,int len){
+        int n = std::min(len,(int)(m_text.size() - m_offset));
+        memcpy(buf,m_text.data() + m_offset,n);
+        m_offset += n;
+        return n;
     }
+private:
+    std::string m_text;
+    size_t m_offset;
+};
 
-    //获取端口号
-    int port = atoi(argv[1]);
+//请求跟踪的二进制导出，只属于处理这个请求的进程，用tools/trace2json转换
+static http_conn::HTTP_CODE handle_trace(http_conn& conn){
+    return conn.stream(200,"OK","application/octet-stream",new string_producer(tracer::dump()));
+}
 
-    //对SIGPIE信号做处理,SIG_IGN忽略信号
-    addsig(SIGPIPE,SIG_IGN);
+#ifdef LOCK_STATS
+//锁的竞争统计，只属于处理这个请求的进程
+static http_conn::HTTP_CODE handle_lockstats(http_conn& conn){
+    return conn.stream(200,"OK","application/json",new string_producer(lock_stats::dump()));
+}
+#endif
 
-    //创建线程池，初始化线程池
-    threadpool<http_conn>* pool = nullptr;
-    try{
-        pool = new threadpool<http_conn>;
-    }catch(...){
-        exit(-1);
-    }
+//网站根目录 http_conn.cpp里定义
+extern const char* doc_root;
+//添加文件描述符到epoll当中 http_conn.cpp里实现
+extern void addfd(int epollfd,int fd,bool one_shot);
+//从epoll中删除文件描述符
+extern void removefd(int epollfd,int fd);
+//修改文件描述符，重置socket EPOLLONESHOT和EPOLLRDHUP事件，确保下一次可读时EPOLLIN时间被触发
+extern void modfd(int epollfd,int fd,int ev);
 
-    //创建一个数组用于保存所有的用户客户端信息
-    http_conn * users = new http_conn[ MAX_FD ];
-    
+//创建监听socket，reuseport为true时多个进程的socket可以绑定同一个端口，由内核分发连接
+static int create_listen(int port,bool reuseport){
     int listenfd = socket(PF_INET,SOCK_STREAM,0);
+    if(listenfd < 0){
+        return -1;
+    }
 
     //设置端口复用,绑定之前设置
     int reuse = 1;
     setsockopt(listenfd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse));
+    if(reuseport && setsockopt(listenfd,SOL_SOCKET,SO_REUSEPORT,&reuse,sizeof(reuse)) < 0){
+        close(listenfd);
+        return -1;
+    }
 
     //绑定
     struct sockaddr_in address;
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port);
-    bind(listenfd,(struct sockaddr*)&address,sizeof(address));
+    //监听，worker重启期间新连接排在这个socket的队列中，队列要足够长
+    if(bind(listenfd,(struct sockaddr*)&address,sizeof(address)) < 0 || listen(listenfd,SOMAXCONN) < 0){
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
 
-    //监听
-    listen(listenfd,5);
+//创建Unix stream监听socket，path以@开头时使用抽象命名空间，不在文件系统中留下文件
+static int create_unix_listen(const char* path){
+    struct sockaddr_un address;
+    memset(&address,0,sizeof(address));
+    address.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if(len == 0 || len >= sizeof(address.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(address.sun_path,path,len);
+    socklen_t addrlen = offsetof(struct sockaddr_un,sun_path) + len;
+    if(path[0] == '@'){
+        address.sun_path[0] = '\0';
+    }else{
+        //上次运行留下的socket文件
+        unlink(path);
+        addrlen += 1;
+    }
+    int listenfd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(listenfd < 0){
+        return -1;
+    }
+    if(bind(listenfd,(struct sockaddr*)&address,addrlen) < 0 || listen(listenfd,SOMAXCONN) < 0){
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+//Unix socket监听，单进程和prefork的所有worker共用
+static const int MAX_UNIX_LISTEN = 8;
+static int unix_fds[MAX_UNIX_LISTEN];
+static int unix_count = 0;
+
+//请求跟踪退出时保存的文件名前缀，0表示不保存
+static const char* trace_path = 0;
+
+//忙轮询模式：事件循环和工作线程在阻塞之前自旋的微秒数，0表示不自旋
+static int spin_us = 0;
+//设置在客户端连接上的SO_BUSY_POLL微秒数，0表示不设置
+static int busy_poll_us = 0;
+
+//忙轮询：先用0超时的epoll_wait自旋spin_us微秒，期间没有事件再按timeout阻塞
+static int wait_events(int epollfd,epoll_event* events,int max,int timeout){
+    if(spin_us > 0 && timeout != 0){
+        long long deadline = monotonic_us() + spin_us;
+        do{
+            int num = epoll_wait(epollfd,events,max,0);
+            if(num != 0){
+                return num;
+            }
+        }while(monotonic_us() < deadline);
+    }
+    return epoll_wait(epollfd,events,max,timeout);
+}
+
+//让网卡驱动在socket上忙轮询收包，SO_PREFER_BUSY_POLL需要内核5.11以上，不支持时忽略
+static void set_busy_poll(int fd){
+    if(busy_poll_us <= 0){
+        return;
+    }
+    setsockopt(fd,SOL_SOCKET,SO_BUSY_POLL,&busy_poll_us,sizeof(busy_poll_us));
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    setsockopt(fd,SOL_SOCKET,SO_PREFER_BUSY_POLL,&prefer,sizeof(prefer));
+#endif
+}
+
+//SIGUSR2：不停机升级；SIGQUIT：平滑停止，处理完现有连接后退出
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t quit_requested = 0;
+static void on_upgrade(int){
+    upgrade_requested = 1;
+}
+static void on_quit(int){
+    quit_requested = 1;
+}
+#ifdef LOCK_STATS
+//SIGUSR1：把锁的竞争统计打印到标准输出
+static volatile sig_atomic_t lockstats_requested = 0;
+static void on_lockstats(int){
+    lockstats_requested = 1;
+}
+#endif
+
+//fd是不是监听socket
+static bool is_listen(const int* listenfds,int n,int fd){
+    for(int i = 0;i < n;++i){
+        if(listenfds[i] == fd){
+            return true;
+        }
+    }
+    return false;
+}
+
+//一个进程的事件循环，线程池、连接对象池和epoll对象都属于这个进程。
+//can_upgrade为false时（prefork的worker）不处理SIGUSR2，升级由supervisor负责
+static int run_server(const int* listenfds,int listen_count,bool can_upgrade){
+    //信号只交给主线程处理，这样epoll_wait能被打断；之后创建的线程继承屏蔽字
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask,SIGUSR2);
+    sigaddset(&mask,SIGQUIT);
+#ifdef LOCK_STATS
+    sigaddset(&mask,SIGUSR1);
+    addsig(SIGUSR1,on_lockstats);
+#endif
+    pthread_sigmask(SIG_BLOCK,&mask,NULL);
+    addsig(SIGQUIT,on_quit);
+    addsig(SIGUSR2,can_upgrade ? on_upgrade : SIG_IGN);
+
+    //建立不存在路径的过滤器，失败时所有请求照常访问文件系统
+    if(!path_filter::instance().start(doc_root)){
+        printf("path filter disabled\n");
+    }
+
+    //创建线程池，初始化线程池
+    threadpool< slab_handle<http_conn> >* pool = nullptr;
+    try{
+        pool = new threadpool< slab_handle<http_conn> >(POOL_THREADS,10000,spin_us);
+    }catch(...){
+        exit(-1);
+    }
+
+    //连接对象在建立连接时从对象池中分配，users只保存文件描述符到连接对象的映射
+    http_conn::m_slab = new slab<http_conn>;
+    //连接表按文件描述符随机访问，和对象池一样可以放在大页中
+    size_t users_bytes;
+    http_conn ** users = (http_conn**)huge_pages::alloc(sizeof(http_conn*) * MAX_FD,users_bytes);
+    memset(users,0,sizeof(http_conn*) * MAX_FD);
 
     //创建epoll对象，事件数组
     epoll_event events[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(5);//参数会被忽略，>0即可
 
     //将监听的文件描述符到epoll对象中
-    addfd(epollfd,listenfd,false);
+    for(int i = 0;i < listen_count;++i){
+        addfd(epollfd,listenfds[i],false);
+    }
     http_conn::m_epollfd = epollfd;
+    pthread_sigmask(SIG_UNBLOCK,&mask,NULL);
+
+    //开始退出之后不再接受连接，现有连接处理完或者超时就结束
+    bool draining = false;
+    time_t drain_deadline = 0;
+    //正在升级时等待新进程就绪回复的socket
+    int upgrade_fd = -1;
+
+    //配额用完但还没发送完的连接，按轮转顺序每轮再发送一个配额
+    std::deque<int> write_queue;
+    //一轮epoll_wait中读完数据的连接，处理完所有事件后一次提交给线程池
+    std::vector< std::pair<slab_handle<http_conn>,int> > ready;
+    ready.reserve(MAX_EVENT_NUMBER);
+    //传输速率检查每秒扫描一次，只扫描到出现过的最大文件描述符
+    time_t last_sweep = time(NULL);
+    int max_connfd = 0;
 
+    worker_stats* stats = prefork::self();
     while(true){
+        stats->connections.store(http_conn::m_user_count,std::memory_order_relaxed);
+#ifdef LOCK_STATS
+        if(lockstats_requested){
+            lockstats_requested = 0;
+            std::string text = lock_stats::dump();
+            printf("lock stats (pid %d): %s",(int)getpid(),text.c_str());
+            fflush(stdout);
+        }
+#endif
+        if(upgrade_requested && !draining){
+            upgrade_requested = 0;
+            //新进程在后台启动和预热，它的就绪回复作为普通事件处理，在此之前照常服务
+            if(upgrade_fd < 0){
+                upgrade_fd = upgrade::start(listenfds,listen_count,upgrade::hot_paths());
+                if(upgrade_fd < 0){
+                    printf("upgrade failed\n");
+                }else{
+                    addfd(epollfd,upgrade_fd,false);
+                }
+            }
+        }
+        if(upgrade_fd >= 0 && upgrade::expired()){
+            epoll_ctl(epollfd,EPOLL_CTL_DEL,upgrade_fd,NULL);
+            upgrade::cancel(upgrade_fd);
+            upgrade_fd = -1;
+            printf("upgrade failed: new process not ready in %d seconds\n",upgrade::READY_TIMEOUT);
+        }
+        if(quit_requested && !draining){
+            draining = true;
+            drain_deadline = time(NULL) + DRAIN_TIMEOUT;
+            http_conn::m_draining = true;
+            //监听socket可能已经交给新进程，这里只关闭自己的副本
+            for(int i = 0;i < listen_count;++i){
+                removefd(epollfd,listenfds[i]);
+            }
+        }
+        if(draining && (http_conn::m_user_count == 0 || time(NULL) >= drain_deadline)){
+            break;
+        }
         //如果成功，返回请求的I/O准备就绪的文件描述符的数目
-        int num = epoll_wait(epollfd,events,MAX_EVENT_NUMBER,-1);
+        //还有连接等待发送时不阻塞，处理完新事件就继续发送；退出过程中每秒检查一次剩余的连接
+        int num = wait_events(epollfd,events,MAX_EVENT_NUMBER,!write_queue.empty() ? 0 : ((draining || upgrade_fd >= 0 || http_conn::m_min_rate > 0) ? 1000 : -1));
         if((num<0)&&(errno!=EINTR)){
             printf("epoll failure\n");
             break;
@@ -94,46 +358,371 @@ int main(int argc,char* argv[]){
         //循环遍历事件数组
         for(int i=0;i<num;i++){
             int sockfd = events[i].data.fd;//data类型为一个union
-            if(sockfd == listenfd){
-                //有客户端连接进来
+            if(sockfd == upgrade_fd){
+                //新进程回复就绪或者退出了
+                epoll_ctl(epollfd,EPOLL_CTL_DEL,upgrade_fd,NULL);
+                if(upgrade::finish(upgrade_fd)){
+                    printf("upgrade: new process ready, draining\n");
+                    quit_requested = 1;
+                }else{
+                    printf("upgrade failed\n");
+                }
+                upgrade_fd = -1;
+            }else if(!draining && is_listen(listenfds,listen_count,sockfd)){
+                //有客户端连接进来，Unix socket上的连接只记下地址族
+                struct sockaddr_storage peer;
+                socklen_t peer_len = sizeof(peer);
+                int connfd = accept(sockfd,(struct sockaddr*)&peer,&peer_len);
+                if(connfd < 0){
+                    continue;
+                }
                 struct sockaddr_in client_address;
-                socklen_t client_addrlen = sizeof(client_address);
-                int connfd = accept(listenfd,(struct sockaddr*)&client_address,&client_addrlen);
+                if(peer.ss_family == AF_INET){
+                    memcpy(&client_address,&peer,sizeof(client_address));
+                }else{
+                    memset(&client_address,0,sizeof(client_address));
+                    client_address.sin_family = peer.ss_family;
+                }
+                //新建连接太快的IP直接关闭，不分配连接对象
+                if(!rate_limiter::instance().allow_connection(client_address)){
+                    close(connfd);
+                    continue;
+                }
             
-                if(http_conn::m_user_count>=MAX_FD){
+                if(http_conn::m_user_count>=MAX_FD || connfd>=MAX_FD){
                     //目前的n接数满了
                     //这里可以告诉客户端服务器内部正忙
                     close(connfd);
                     continue;
                 }
-                // 将新的客户的数据初始化放到数组当中
-                users[connfd].init(connfd,client_address);
+                stats->accepted.fetch_add(1,std::memory_order_relaxed);
+                set_busy_poll(connfd);
+                // 从对象池中取出一个连接对象，初始化新的客户的数据
+                users[connfd] = http_conn::m_slab->alloc();
+                users[connfd]->init(connfd,client_address);
+                if(connfd > max_connfd){
+                    max_connfd = connfd;
+                }
+            }else if((events[i].events & (EPOLLRDHUP|EPOLLHUP|EPOLLERR)) == EPOLLERR && users[sockfd]->zerocopy_pending()){
+                //MSG_ZEROCOPY的完成通知通过错误队列送达，表现为EPOLLERR
+                if(!users[sockfd]->reap_zerocopy()){
+                    users[sockfd]->close_conn();
+                }
             }else if(events[i].events & (EPOLLRDHUP|EPOLLHUP|EPOLLERR)){
                 //对方异常断开，关闭链接
-                users[sockfd].close_conn();
+                users[sockfd]->close_conn();
             }else if(events[i].events & EPOLLIN){
                 //有读事件发生
-                if(users[sockfd].read()){
-                    //一次性把数据全部读完
-                    pool->append(users+sockfd);
+                if(users[sockfd]->read()){
+                    //一次性把数据全部读完，队列中保存带代数的句柄；这一轮的任务最后一起提交
+                    users[sockfd]->trace(tracer::EV_ENQUEUE);
+                    ready.push_back(std::make_pair(slab_handle<http_conn>(users[sockfd]),users[sockfd]->schedule_class()));
                 }else{
                     //没读到数据或者关闭了
-                    users[sockfd].close_conn();
+                    users[sockfd]->close_conn();
                 }
             }else if(events[i].events & EPOLLOUT){
                 //有写事件发生
-                if(!users[sockfd].write()){
+                if(!users[sockfd]->write()){
                     //写失败了
-                    users[sockfd].close_conn();
+                    users[sockfd]->close_conn();
+                }else if(users[sockfd]->write_yielded()){
+                    write_queue.push_back(sockfd);
+                }else if(users[sockfd]->needs_fill()){
+                    //HTTP/2连接的DATA帧在工作线程中生成，和大文件同一优先级
+                    ready.push_back(std::make_pair(slab_handle<http_conn>(users[sockfd]),(int)http_conn::SCHED_LARGE));
+                }else if(users[sockfd]->pipelined()){
+                    //流水线中的下一个请求已经在读缓冲区中，不会再有EPOLLIN
+                    ready.push_back(std::make_pair(slab_handle<http_conn>(users[sockfd]),users[sockfd]->schedule_class()));
+                }
+            }
+        }
+
+        //轮转：队列中的每个连接发送一个配额，没发送完的重新排到队尾
+        for(size_t n = write_queue.size();n > 0;--n){
+            int sockfd = write_queue.front();
+            write_queue.pop_front();
+            if(!users[sockfd]->write()){
+                users[sockfd]->close_conn();
+            }else if(users[sockfd]->write_yielded()){
+                write_queue.push_back(sockfd);
+            }else if(users[sockfd]->needs_fill()){
+                ready.push_back(std::make_pair(slab_handle<http_conn>(users[sockfd]),(int)http_conn::SCHED_LARGE));
+            }else if(users[sockfd]->pipelined()){
+                ready.push_back(std::make_pair(slab_handle<http_conn>(users[sockfd]),users[sockfd]->schedule_class()));
+            }
+        }
+
+        //交给线程池的连接由工作线程负责，直到它重新注册事件或者关闭连接
+        for(size_t k = 0;k < ready.size();++k){
+            if(ready[k].first.valid()){
+                ready[k].first.obj->hand_off();
+            }
+        }
+        //队列满了放不进去的连接已经被EPOLLONESHOT摘下，不会再有事件，直接关闭，否则会一直占着连接对象
+        size_t queued = pool->append_batch(ready);
+        for(size_t k = queued;k < ready.size();++k){
+            ready[k].first.obj->close_conn();
+        }
+        ready.clear();
+
+        //断开请求或响应进行中传输太慢的连接（slowloris和不读响应的客户端）
+        time_t now = time(NULL);
+        if(http_conn::m_min_rate > 0 && now != last_sweep){
+            last_sweep = now;
+            for(int fd = 0;fd <= max_connfd;++fd){
+                //关闭之后users中的指针不清空，对象可能已经属于别的连接。在线程池中的连接先跳过，
+                //其余的连接只有主线程会关闭和重新初始化，检查sockfd之后到check_progress结束都不会变
+                if(users[fd] && !users[fd]->in_worker() && users[fd]->sockfd() == fd){
+                    users[fd]->check_progress(now);
                 }
             }
         }
     }
 
-    close(epollfd);
-    close(listenfd);
-    delete [] users;
+    //退出时新进程还没有就绪，放弃升级
+    if(upgrade_fd >= 0){
+        upgrade::cancel(upgrade_fd);
+    }
+    //先停止并等待工作线程，它们可能还在process()中使用连接对象和epollfd
     delete pool;
+    close(epollfd);
+    if(!draining){
+        for(int i = 0;i < listen_count;++i){
+            close(listenfds[i]);
+        }
+    }
+    huge_pages::free(users,users_bytes);
+    delete http_conn::m_slab;
+
+    traffic_capture::instance().flush();
+
+    //退出时保存跟踪记录，多个worker进程各写一个文件
+    if(trace_path){
+        char path[4096];
+        snprintf(path,sizeof(path),"%s.%d",trace_path,(int)getpid());
+        if(!tracer::dump_file(path)){
+            perror("trace dump");
+        }
+    }
 
     return 0;
 }
+
+//prefork的worker进程
+static int run_worker(int listenfd){
+    int listenfds[1 + MAX_UNIX_LISTEN];
+    listenfds[0] = listenfd;
+    memcpy(listenfds + 1,unix_fds,sizeof(int) * unix_count);
+    return run_server(listenfds,1 + unix_count,false);
+}
+
+int main(int argc,char* argv[]){
+    upgrade::save_args(argv);
+
+    //解析选项
+    //-q 每个连接每轮最多发送的字节数，0表示不限制
+    //-w prefork模式的worker进程数，0表示单进程
+    //-b 忙轮询：事件循环和工作线程阻塞之前自旋的微秒数，0表示不自旋
+    //-B 客户端连接上的SO_BUSY_POLL微秒数，配合-b使用
+    //-r 每个客户端IP每秒的请求数，可以带突发量，例如 -r 100:200，超过时回复429
+    //-c 每个客户端IP每秒新建的连接数，格式同-r，超过时直接关闭连接
+    //-m 请求和响应进行中每秒至少传输的字节数，可以带窗口秒数，例如 -m 100:10，低于时断开连接
+    //-Z 内存中的响应体用MSG_ZEROCOPY发送的最小字节数，0表示不使用
+    //-U Unix socket监听路径，@开头为抽象命名空间，可以指定多次
+    //-t 每N个请求跟踪一个，可以带退出时保存的文件名前缀，例如 -t 100:/tmp/trace，运行中可以从/trace下载
+    //-C 把收到的请求数据记录到文件，文件名为 前缀.进程号，用tools/replay回放
+    //-H 连接对象池和连接表用大页：thp为透明大页，hugetlb为预留的大页（不够时退到透明大页）
+    //-P 反向代理路由 前缀=上游，例如 -P /api/=127.0.0.1:9000 或 -P /app/=unix:/run/app.sock，可以指定多次
+    //-R 同时转发给上游的请求数上限，默认4，超过时回复503
+    int workers = 0;
+    std::vector<const char*> unix_paths;
+    int opt;
+    while((opt = getopt(argc,argv,"b:B:c:C:H:m:q:r:R:t:P:U:Z:w:")) != -1){
+        switch(opt){
+            case 'b':
+                spin_us = atoi(optarg);
+                break;
+            case 'B':
+                busy_poll_us = atoi(optarg);
+                break;
+            case 'r':
+            case 'c':
+            {
+                //rate[:burst]
+                int rate = atoi(optarg);
+                const char* colon = strchr(optarg,':');
+                int burst = colon ? atoi(colon + 1) : rate;
+                if(opt == 'r'){
+                    rate_limiter::instance().set_request_limit(rate,burst);
+                }else{
+                    rate_limiter::instance().set_connection_limit(rate,burst);
+                }
+                break;
+            }
+            case 'm':
+            {
+                //min_rate[:window]
+                http_conn::m_min_rate = atoi(optarg);
+                const char* colon = strchr(optarg,':');
+                if(colon && atoi(colon + 1) > 0){
+                    http_conn::m_rate_window = atoi(colon + 1);
+                }
+                break;
+            }
+            case 't':
+            {
+                //every[:path]
+                tracer::set_sample(atoi(optarg));
+                const char* colon = strchr(optarg,':');
+                if(colon && colon[1]){
+                    trace_path = colon + 1;
+                }
+                break;
+            }
+            case 'C':
+                traffic_capture::instance().set_path(optarg);
+                break;
+            case 'H':
+                if(strcmp(optarg,"thp") == 0){
+                    huge_pages::set_mode(huge_pages::HUGE_THP);
+                }else if(strcmp(optarg,"hugetlb") == 0){
+                    huge_pages::set_mode(huge_pages::HUGE_TLB);
+                }else{
+                    printf("-H 只能是 thp 或 hugetlb\n");
+                    exit(-1);
+                }
+                break;
+            case 'q':
+                http_conn::m_write_quantum = atoi(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if(workers < 0 || workers > prefork::MAX_WORKERS){
+                    printf("worker进程数必须在0到%d之间\n",prefork::MAX_WORKERS);
+                    exit(-1);
+                }
+                break;
+            case 'Z':
+                http_conn::m_zerocopy_threshold = atoi(optarg);
+                break;
+            case 'U':
+                if((int)unix_paths.size() >= MAX_UNIX_LISTEN){
+                    printf("最多%d个Unix socket监听\n",MAX_UNIX_LISTEN);
+                    exit(-1);
+                }
+                unix_paths.push_back(optarg);
+                break;
+            case 'R':
+                proxy::m_max_relays = atoi(optarg);
+                if(proxy::m_max_relays < 1 || proxy::m_max_relays > POOL_THREADS){
+                    printf("同时转发的请求数必须在1到%d之间\n",POOL_THREADS);
+                    exit(-1);
+                }
+                break;
+            case 'P':
+                if(!proxy::add_route(optarg)){
+                    printf("无效的代理路由：%s\n",optarg);
+                    exit(-1);
+                }
+                break;
+            default:
+                printf("按照如下格式运行：%s [-b spin_us] [-B busy_poll_us] [-c conn_rate[:burst]] [-C capture_path] [-H thp|hugetlb] [-m min_rate[:window]] [-r req_rate[:burst]] [-t trace_every[:path]] [-q write_quantum] [-w workers] [-Z zerocopy_threshold] [-P prefix=upstream] [-R max_relays] [-U unix_path] port_num\n",basename(argv[0]));
+                exit(-1);
+        }
+    }
+
+    if(optind >= argc){
+        printf("按照如下格式运行：%s [-b spin_us] [-B busy_poll_us] [-c conn_rate[:burst]] [-C capture_path] [-H thp|hugetlb] [-m min_rate[:window]] [-r req_rate[:burst]] [-t trace_every[:path]] [-q write_quantum] [-w workers] [-Z zerocopy_threshold] [-P prefix=upstream] [-R max_relays] [-U unix_path] port_num\n",basename(argv[0]));
+        exit(-1);
+    }
+
+    //单核时自旋只会和干活的线程抢CPU
+    if(spin_us > 0 && sysconf(_SC_NPROCESSORS_ONLN) < 2){
+        printf("busy poll needs at least 2 CPUs, disabled\n");
+        spin_us = 0;
+    }
+
+    //获取端口号
+    int port = atoi(argv[optind]);
+
+    //注册动态路由，编译之后只读
+    router::add(http_conn::GET,"/healthz",handle_healthz);
+    router::add(http_conn::GET,"/status",handle_status);
+    if(tracer::enabled()){
+        router::add(http_conn::GET,"/trace",handle_trace);
+    }
+#ifdef LOCK_STATS
+    router::add(http_conn::GET,"/lockstats",handle_lockstats);
+#endif
+    router::compile();
+
+    //对SIGPIE信号做处理,SIG_IGN忽略信号
+    addsig(SIGPIPE,SIG_IGN);
+
+    //由旧进程升级而来时沿用它的监听socket，按清单预热页缓存之后通知旧进程停止接受连接
+    int listenfds[prefork::MAX_WORKERS + MAX_UNIX_LISTEN];
+    std::vector<std::string> manifest;
+    int fds[prefork::MAX_WORKERS + MAX_UNIX_LISTEN];
+    int inherited_fds = upgrade::inherit(fds,prefork::MAX_WORKERS + MAX_UNIX_LISTEN,manifest);
+    //按地址族分开TCP和Unix socket
+    int inherited = 0;
+    for(int i = 0;i < inherited_fds;++i){
+        struct sockaddr_storage local;
+        socklen_t local_len = sizeof(local);
+        getsockname(fds[i],(struct sockaddr*)&local,&local_len);
+        if(local.ss_family == AF_UNIX && unix_count < MAX_UNIX_LISTEN){
+            unix_fds[unix_count++] = fds[i];
+        }else if(local.ss_family != AF_UNIX && inherited < prefork::MAX_WORKERS){
+            listenfds[inherited++] = fds[i];
+        }else{
+            close(fds[i]);
+        }
+    }
+    if(inherited_fds > 0){
+        upgrade::warm(manifest);
+        printf("upgrade: inherited %d listening sockets, warmed %d files\n",inherited_fds,(int)manifest.size());
+        //SO_REUSEPORT要求所有socket都设置，不能再新建，worker数跟监听socket数一致
+        if(workers > 0 && workers != inherited){
+            printf("upgrade: using %d workers to match the inherited sockets\n",inherited);
+            workers = inherited;
+        }
+        upgrade::ready();
+    }else{
+        for(size_t i = 0;i < unix_paths.size();++i){
+            unix_fds[unix_count] = create_unix_listen(unix_paths[i]);
+            if(unix_fds[unix_count] < 0){
+                perror(unix_paths[i]);
+                exit(-1);
+            }
+            ++unix_count;
+        }
+    }
+
+    //prefork模式：每个worker进程一个SO_REUSEPORT监听socket，由supervisor持有，worker重启时不关闭
+    if(workers > 0){
+        for(int i = inherited;i < workers;++i){
+            listenfds[i] = create_listen(port,true);
+            if(listenfds[i] < 0){
+                perror("listen");
+                exit(-1);
+            }
+        }
+        //Unix socket放在后面，所有worker共用
+        int all[prefork::MAX_WORKERS + MAX_UNIX_LISTEN];
+        memcpy(all,listenfds,sizeof(int) * workers);
+        memcpy(all + workers,unix_fds,sizeof(int) * unix_count);
+        return prefork::supervise(all,workers,unix_count,run_worker);
+    }
+
+    if(inherited == 0){
+        listenfds[0] = create_listen(port,false);
+        if(listenfds[0] < 0){
+            perror("listen");
+            exit(-1);
+        }
+        inherited = 1;
+    }
+    memcpy(listenfds + inherited,unix_fds,sizeof(int) * unix_count);
+    return run_server(listenfds,inherited + unix_count,true);
+}
@@ -0,0 +1,235 @@
+//不存在路径的过滤
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "path_filter.h"
+
+path_filter::path_filter():m_enabled(false),m_bits(0),m_mask(0),m_negative_locker("path_filter.negative"),m_inotify_fd(-1),
+    m_filter_rejects(0),m_negative_hits(0),m_false_positives(0){
+    for(int i = 0;i < NEGATIVE_SLOTS;++i){
+        m_negative[i].expires = 0;
+    }
+}
+
+path_filter::~path_filter(){
+    //watcher线程一直阻塞在read上，进程退出时随之结束，这里不释放它还在使用的资源
+}
+
+//FNV-1a
+uint64_t path_filter::hash(const char* s,size_t len){
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0;i < len;++i){
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+//双重哈希的第二个哈希值，由第一个混合得到，必须是奇数
+static inline uint64_t second_hash(uint64_t h1){
+    return ((h1 >> 33) ^ (h1 * 0xff51afd7ed558ccdULL)) | 1;
+}
+
+//双重哈希：第i个位置是 h1 + i * h2
+void path_filter::insert(const std::string& path){
+    uint64_t h1 = hash(path.data(),path.size());
+    uint64_t h2 = second_hash(h1);
+    for(int i = 0;i < HASH_COUNT;++i){
+        uint64_t bit = (h1 + i * h2) & m_mask;
+        m_bits[bit >> 6].fetch_or(1ULL << (bit & 63),std::memory_order_relaxed);
+    }
+}
+
+//监视rel目录，再把它下面的所有路径收集到paths中。先加监视再读目录，两者之间新建的文件不会漏掉。
+//指向目录的符号链接也进入，ancestors是当前路径上各级目录的设备号和inode号，链接回祖先目录时不再进入，
+//避免循环。路径总数超过MAX_PATHS时返回false
+bool path_filter::walk(const std::string& rel,std::vector<std::string>& paths,std::vector< std::pair<dev_t,ino_t> >& ancestors){
+    std::string dir = m_root + rel;
+    struct stat st;
+    if(stat(dir.c_str(),&st) != 0){
+        return true;
+    }
+    for(size_t i = 0;i < ancestors.size();++i){
+        if(ancestors[i].first == st.st_dev && ancestors[i].second == st.st_ino){
+            return true;
+        }
+    }
+    //inotify_add_watch默认跟随符号链接，监视的是目标目录；同一个目录的多个名字得到同一个wd
+    int wd = inotify_add_watch(m_inotify_fd,dir.c_str(),IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+    if(wd >= 0){
+        m_watches[wd].insert(rel);
+    }
+    DIR* d = opendir(dir.c_str());
+    if(!d){
+        return true;
+    }
+    ancestors.push_back(std::make_pair(st.st_dev,st.st_ino));
+    bool ok = true;
+    struct dirent* ent;
+    while(ok && (ent = readdir(d)) != NULL){
+        if(strcmp(ent->d_name,".") == 0 || strcmp(ent->d_name,"..") == 0){
+            continue;
+        }
+        std::string child = rel + "/" + ent->d_name;
+        paths.push_back(child);
+        if(paths.size() > MAX_PATHS){
+            ok = false;
+        }else if(stat((m_root + child).c_str(),&st) == 0 && S_ISDIR(st.st_mode)){
+            ok = walk(child,paths,ancestors);
+        }
+    }
+    closedir(d);
+    ancestors.pop_back();
+    return ok;
+}
+
+bool path_filter::start(const char* root){
+    m_root = root;
+    m_inotify_fd = inotify_init1(IN_CLOEXEC);
+    if(m_inotify_fd < 0){
+        return false;
+    }
+    std::vector<std::string> paths;
+    std::vector< std::pair<dev_t,ino_t> > ancestors;
+    paths.push_back("/");
+    if(!walk("",paths,ancestors) || m_watches.empty()){
+        if(paths.size() > MAX_PATHS){
+            printf("path filter: more than %d paths, disabled\n",(int)MAX_PATHS);
+        }
+        close(m_inotify_fd);
+        m_inotify_fd = -1;
+        return false;
+    }
+
+    //每个路径大约16位，并留出新建文件的余量，4个哈希函数时误判率约0.2%
+    size_t n = paths.size() < 4096 ? 4096 : paths.size();
+    uint64_t bits = 64;
+    while(bits < n * 16){
+        bits <<= 1;
+    }
+    m_mask = bits - 1;
+    m_bits = new std::atomic<uint64_t>[bits / 64];
+    for(uint64_t i = 0;i < bits / 64;++i){
+        m_bits[i].store(0,std::memory_order_relaxed);
+    }
+    for(size_t i = 0;i < paths.size();++i){
+        insert(paths[i]);
+    }
+
+    if(pthread_create(&m_thread,NULL,watcher,this) != 0){
+        return false;
+    }
+    pthread_detach(m_thread);
+    m_enabled = true;
+    printf("path filter: %d paths, %llu bits\n",(int)paths.size(),(unsigned long long)bits);
+    return true;
+}
+
+bool path_filter::may_exist(const char* url){
+    if(!m_enabled){
+        return true;
+    }
+    size_t len = strlen(url);
+    uint64_t h1 = hash(url,len);
+    uint64_t h2 = second_hash(h1);
+    for(int i = 0;i < HASH_COUNT;++i){
+        uint64_t bit = (h1 + i * h2) & m_mask;
+        if(!(m_bits[bit >> 6].load(std::memory_order_relaxed) & (1ULL << (bit & 63)))){
+            m_filter_rejects.fetch_add(1,std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    negative_entry& e = m_negative[h1 % NEGATIVE_SLOTS];
+    bool hit = false;
+    m_negative_locker.lock();
+    if(e.expires > time(NULL) && e.path.size() == len && memcmp(e.path.data(),url,len) == 0){
+        hit = true;
+    }
+    m_negative_locker.unlock();
+    if(hit){
+        m_negative_hits.fetch_add(1,std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void path_filter::add_negative(const char* url){
+    if(!m_enabled){
+        return;
+    }
+    m_false_positives.fetch_add(1,std::memory_order_relaxed);
+    negative_entry& e = m_negative[hash(url,strlen(url)) % NEGATIVE_SLOTS];
+    m_negative_locker.lock();
+    e.path = url;
+    e.expires = time(NULL) + NEGATIVE_TTL;
+    m_negative_locker.unlock();
+}
+
+//新建的路径可能还在不存在路径缓存中，立即删除
+void path_filter::forget_negative(const std::string& path){
+    negative_entry& e = m_negative[hash(path.data(),path.size()) % NEGATIVE_SLOTS];
+    m_negative_locker.lock();
+    if(e.path == path){
+        e.expires = 0;
+    }
+    m_negative_locker.unlock();
+}
+
+void* path_filter::watcher(void* arg){
+    ((path_filter*)arg)->watch_loop();
+    return NULL;
+}
+
+void path_filter::watch_loop(){
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(true){
+        ssize_t n = read(m_inotify_fd,buf,sizeof(buf));
+        if(n <= 0){
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            //inotify出错，关闭过滤器，之后所有路径都走stat
+            m_enabled = false;
+            return;
+        }
+        for(char* p = buf;p < buf + n;){
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            std::vector<std::string> paths;
+            std::vector< std::pair<dev_t,ino_t> > ancestors;
+            bool ok = true;
+            if(ev->mask & IN_Q_OVERFLOW){
+                //丢失了事件，重新遍历整个目录树，过滤器只增不减，重复加入没有影响
+                ok = walk("",paths,ancestors);
+            }else if(ev->mask & IN_IGNORED){
+                m_watches.erase(ev->wd);
+            }else if(ev->len > 0 && m_watches.count(ev->wd)){
+                //目录有多个名字时每个名字下都加入；新建的符号链接没有IN_ISDIR，用stat判断是否指向目录
+                std::set<std::string> names = m_watches[ev->wd];
+                for(std::set<std::string>::iterator it = names.begin();ok && it != names.end();++it){
+                    std::string path = *it + "/" + ev->name;
+                    paths.push_back(path);
+                    struct stat st;
+                    if(stat((m_root + path).c_str(),&st) == 0 && S_ISDIR(st.st_mode)){
+                        ok = walk(path,paths,ancestors);
+                    }
+                }
+            }
+            if(!ok){
+                //目录树太大，关闭过滤器
+                m_enabled = false;
+                return;
+            }
+            for(size_t i = 0;i < paths.size();++i){
+                insert(paths[i]);
+                forget_negative(paths[i]);
+            }
+        }
+    }
+}
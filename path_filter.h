@@ -0,0 +1,82 @@
+#ifndef PATH_FILTER_H
+#define PATH_FILTER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "locker.h"
+
+//判断请求的路径是否可能存在，挡住扫描器对不存在路径的大量请求。
+//启动时遍历doc_root把所有路径放进布隆过滤器，之后由inotify线程把新建的路径加进来；
+//过滤器只增不减，查找时只读原子变量，不加锁。布隆过滤器说“可能存在”但stat失败的路径
+//（误判或者已经删除的文件）放进一个带过期时间的小缓存，在过期之前直接判为不存在。
+//指向目录的符号链接和普通目录一样遍历和监视（打开文件时会跟随符号链接），同一个目录
+//可能有多个名字；链接回祖先目录形成循环时不再进入，经过这种链接的路径判为不存在。
+//目录树太大（例如链接到了根目录）时过滤器关闭，所有路径都当作可能存在。
+class path_filter{
+public:
+    static const int NEGATIVE_SLOTS = 1024;     //不存在路径缓存的槽数，按哈希直接映射
+    static const int NEGATIVE_TTL = 5;          //不存在路径缓存的有效时间（秒）
+    static const int HASH_COUNT = 4;            //布隆过滤器的哈希函数个数
+    static const size_t MAX_PATHS = 1 << 20;    //遍历到的路径超过这个数时关闭过滤器
+
+    static path_filter& instance(){
+        static path_filter filter;
+        return filter;
+    }
+
+    //遍历root建立过滤器并启动inotify线程，失败时过滤器保持关闭，所有路径都当作可能存在
+    bool start(const char* root);
+
+    //url（doc_root下的路径）是否可能存在，返回false时一定不存在
+    bool may_exist(const char* url);
+    //may_exist返回true但文件不存在时调用，记入不存在路径缓存
+    void add_negative(const char* url);
+
+    //布隆过滤器直接判为不存在、不存在路径缓存命中、布隆过滤器误判的次数
+    unsigned long long filter_rejects() const {return m_filter_rejects.load(std::memory_order_relaxed);}
+    unsigned long long negative_hits() const {return m_negative_hits.load(std::memory_order_relaxed);}
+    unsigned long long false_positives() const {return m_false_positives.load(std::memory_order_relaxed);}
+
+private:
+    path_filter();
+    ~path_filter();
+
+    struct negative_entry{
+        std::string path;
+        time_t expires;
+    };
+
+    static uint64_t hash(const char* s,size_t len);
+    void insert(const std::string& path);
+    bool walk(const std::string& rel,std::vector<std::string>& paths,std::vector< std::pair<dev_t,ino_t> >& ancestors);
+    void forget_negative(const std::string& path);
+    static void* watcher(void* arg);
+    void watch_loop();
+
+private:
+    std::atomic<bool> m_enabled;        //inotify出错时由watcher线程关闭
+    std::string m_root;
+    std::atomic<uint64_t>* m_bits;      //布隆过滤器的位数组
+    uint64_t m_mask;                    //位数减一，位数是2的幂
+
+    negative_entry m_negative[NEGATIVE_SLOTS];
+    locker m_negative_locker;
+
+    int m_inotify_fd;
+    std::map<int,std::set<std::string> > m_watches;    //inotify监视描述符到目录的所有相对路径，只有watcher线程在启动后访问
+    pthread_t m_thread;
+
+    std::atomic<unsigned long long> m_filter_rejects;
+    std::atomic<unsigned long long> m_negative_hits;
+    std::atomic<unsigned long long> m_false_positives;
+};
+
+#endif
@@ -0,0 +1,206 @@
+//prefork多进程模式
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include "prefork.h"
+#include "upgrade.h"
+
+worker_stats* prefork::m_slots = NULL;
+int prefork::m_workers = 0;
+worker_stats prefork::m_local;
+worker_stats* prefork::m_self = &prefork::m_local;
+
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t quitting = 0;
+static volatile sig_atomic_t upgrading = 0;
+
+static void on_stop(int){
+    stopping = 1;
+}
+
+static void on_quit(int){
+    quitting = 1;
+}
+
+static void on_upgrade(int){
+    upgrading = 1;
+}
+
+#ifdef LOCK_STATS
+//锁统计按进程计数，supervisor把SIGUSR1转给所有worker，各自打印
+static volatile sig_atomic_t lockstats_requested = 0;
+static void on_lockstats(int){
+    lockstats_requested = 1;
+}
+#endif
+
+//不设置SA_RESTART，让waitpid被信号打断
+static void set_handler(int sig,void (*handler)(int)){
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = handler;
+    sigfillset(&sa.sa_mask);
+    sigaction(sig,&sa,NULL);
+}
+
+pid_t prefork::spawn(int slot,const int* listenfds,int workers,int (*run)(int listenfd)){
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid != 0){
+        return pid;
+    }
+    //worker：supervisor退出时跟着退出，只保留自己的监听socket
+    prctl(PR_SET_PDEATHSIG,SIGTERM);
+    set_handler(SIGTERM,SIG_DFL);
+    set_handler(SIGINT,SIG_DFL);
+    //升级由supervisor负责，worker只响应SIGQUIT平滑退出
+    set_handler(SIGUSR2,SIG_IGN);
+    for(int i = 0;i < workers;++i){
+        if(i != slot){
+            close(listenfds[i]);
+        }
+    }
+    m_self = &m_slots[slot];
+    m_self->pid = getpid();
+    m_self->connections = 0;
+    _exit(run(listenfds[slot]));
+}
+
+void prefork::restart(int slot,const int* listenfds,int workers,int (*run)(int listenfd)){
+    pid_t pid = spawn(slot,listenfds,workers,run);
+    if(pid < 0){
+        perror("fork");
+        pid = 0;
+    }
+    m_slots[slot].pid = pid;
+}
+
+int prefork::supervise(const int* listenfds,int workers,int shared,int (*run)(int listenfd)){
+    if(workers <= 0 || workers > MAX_WORKERS){
+        return -1;
+    }
+    void* shm = mmap(NULL,sizeof(worker_stats) * workers,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0);
+    if(shm == MAP_FAILED){
+        return -1;
+    }
+    m_slots = (worker_stats*)shm;
+    m_workers = workers;
+    for(int i = 0;i < workers;++i){
+        new (&m_slots[i]) worker_stats();
+        m_slots[i].pid = 0;
+        m_slots[i].connections = 0;
+        m_slots[i].accepted = 0;
+        m_slots[i].restarts = 0;
+    }
+
+    set_handler(SIGTERM,on_stop);
+    set_handler(SIGINT,on_stop);
+    set_handler(SIGQUIT,on_quit);
+    set_handler(SIGUSR2,on_upgrade);
+#ifdef LOCK_STATS
+    set_handler(SIGUSR1,on_lockstats);
+#endif
+
+    time_t started[MAX_WORKERS];
+    for(int i = 0;i < workers;++i){
+        started[i] = time(NULL);
+        restart(i,listenfds,workers,run);
+    }
+
+    while(!stopping && !quitting){
+#ifdef LOCK_STATS
+        if(lockstats_requested){
+            lockstats_requested = 0;
+            for(int i = 0;i < workers;++i){
+                if(m_slots[i].pid > 0){
+                    kill(m_slots[i].pid,SIGUSR1);
+                }
+            }
+        }
+#endif
+        if(upgrading){
+            upgrading = 0;
+            //新程序接手同一组监听socket，就绪后现有的worker处理完连接退出。
+            //多进程模式下没有统一的热点统计，预热清单为空
+            if(upgrade::handoff(listenfds,workers + shared,std::vector<std::string>())){
+                printf("upgrade: new supervisor ready, draining workers\n");
+                quitting = 1;
+                break;
+            }
+            printf("upgrade failed\n");
+        }
+        int status;
+        pid_t pid = waitpid(-1,&status,0);
+        if(pid < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            //没有子进程了（fork一直失败），稍后重试
+            sleep(1);
+        }
+        for(int i = 0;i < workers;++i){
+            //pid < 0时重试之前fork失败的槽位
+            if(pid > 0 ? m_slots[i].pid != pid : m_slots[i].pid != 0){
+                continue;
+            }
+            if(pid > 0){
+                if(WIFSIGNALED(status)){
+                    printf("worker %d (pid %d) killed by signal %d, restarting\n",i,pid,WTERMSIG(status));
+                }else{
+                    printf("worker %d (pid %d) exited with %d, restarting\n",i,pid,WEXITSTATUS(status));
+                }
+            }
+            m_slots[i].pid = 0;
+            m_slots[i].connections = 0;
+            if(stopping || quitting){
+                break;
+            }
+            //启动后马上又退出的worker等一秒再重启，避免不停地fork
+            if(time(NULL) - started[i] < 1){
+                sleep(1);
+            }
+            started[i] = time(NULL);
+            m_slots[i].restarts.fetch_add(1);
+            restart(i,listenfds,workers,run);
+        }
+    }
+
+    //结束所有worker，SIGQUIT时worker处理完现有连接再退出。
+    //升级之后新程序也是这个进程的子进程，只等待worker
+    for(int i = 0;i < workers;++i){
+        if(m_slots[i].pid > 0){
+            kill(m_slots[i].pid,quitting ? SIGQUIT : SIGTERM);
+        }
+    }
+    for(int i = 0;i < workers;++i){
+        while(m_slots[i].pid > 0 && waitpid(m_slots[i].pid,NULL,0) < 0 && errno == EINTR){
+        }
+    }
+    return 0;
+}
+
+void prefork::totals(int& workers,int& connections,unsigned long long& accepted,unsigned long long& restarts){
+    if(!m_slots){
+        workers = 1;
+        connections = m_local.connections;
+        accepted = m_local.accepted;
+        restarts = 0;
+        return;
+    }
+    workers = m_workers;
+    connections = 0;
+    accepted = 0;
+    restarts = 0;
+    for(int i = 0;i < m_workers;++i){
+        connections += m_slots[i].connections;
+        accepted += m_slots[i].accepted;
+        restarts += m_slots[i].restarts;
+    }
+}
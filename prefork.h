@@ -0,0 +1,43 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <sys/types.h>
+#include <atomic>
+
+//多进程模式下每个worker进程的统计，放在共享内存中，supervisor和各个worker都能读到
+struct worker_stats{
+    std::atomic<int> pid;                       //当前的worker进程，0表示没有运行
+    std::atomic<int> connections;               //当前的连接数
+    std::atomic<unsigned long long> accepted;   //累计接受的连接数
+    std::atomic<unsigned long long> restarts;   //这个槽位的worker被重新启动的次数
+};
+
+//prefork多进程模式：supervisor进程为每个worker持有一个SO_REUSEPORT监听socket，
+//worker崩溃后用同一个socket重新fork，内核排在这个socket上的连接等新worker来accept，不会被拒绝。
+//每个worker有自己的事件循环、线程池和连接对象池，一个进程出错不影响其他进程。
+class prefork{
+public:
+    static const int MAX_WORKERS = 64;
+
+    //在supervisor中运行，listenfds[i]给第i个worker，worker进程调用run(listenfd)；
+    //之后的shared个监听socket所有worker共用（例如Unix socket），worker中保持打开，升级时一起交出；
+    //收到SIGTERM或SIGINT时结束所有worker后返回；SIGQUIT时等worker处理完现有连接后返回；
+    //SIGUSR2时把监听socket交给新程序（见upgrade.h），新程序就绪后同SIGQUIT
+    static int supervise(const int* listenfds,int workers,int shared,int (*run)(int listenfd));
+
+    //当前进程的统计槽，单进程模式下是进程内的一个对象
+    static worker_stats* self(){return m_self;}
+    //所有worker的统计之和，单进程模式下只有自己
+    static void totals(int& workers,int& connections,unsigned long long& accepted,unsigned long long& restarts);
+
+private:
+    static pid_t spawn(int slot,const int* listenfds,int workers,int (*run)(int listenfd));
+    static void restart(int slot,const int* listenfds,int workers,int (*run)(int listenfd));
+
+    static worker_stats* m_slots;       //共享内存中的统计数组，单进程模式下为空
+    static int m_workers;
+    static worker_stats m_local;
+    static worker_stats* m_self;
+};
+
+#endif
@@ -0,0 +1,430 @@
+//反向代理
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctype.h>
+#include <strings.h>
+#include "proxy.h"
+
+std::vector<proxy::route> proxy::m_routes;
+std::atomic<int> proxy::m_relays(0);
+int proxy::m_max_relays = 4;
+
+//每个工作线程一个管道，splice通过它在两个socket之间搬运数据
+static __thread int relay_pipe[2] = {-1,-1};
+
+static bool get_relay_pipe(){
+    if(relay_pipe[0] != -1){
+        return true;
+    }
+    return pipe2(relay_pipe,O_CLOEXEC) == 0;
+}
+
+//管道中残留了数据（转发中途出错），重新创建
+static void reset_relay_pipe(){
+    if(relay_pipe[0] != -1){
+        close(relay_pipe[0]);
+        close(relay_pipe[1]);
+        relay_pipe[0] = relay_pipe[1] = -1;
+    }
+}
+
+//等待非阻塞的客户端socket可写
+static bool wait_writable(int fd){
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    return poll(&pfd,1,upstream::IO_TIMEOUT * 1000) == 1 && !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+//向非阻塞的客户端socket写完len字节
+static bool send_client(int fd,const char* data,size_t len){
+    while(len > 0){
+        ssize_t n = send(fd,data,len,MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EAGAIN && wait_writable(fd)){
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//向阻塞的上游socket写完len字节
+static bool send_upstream(int fd,const char* data,size_t len){
+    while(len > 0){
+        ssize_t n = send(fd,data,len,MSG_NOSIGNAL);
+        if(n <= 0){
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//从上游splice最多remaining字节到客户端，remaining为-1表示直到上游关闭连接
+static bool splice_body(int from,int to,long long remaining){
+    while(remaining != 0){
+        size_t chunk = remaining > 0 && remaining < 65536 ? remaining : 65536;
+        ssize_t n = splice(from,NULL,relay_pipe[1],NULL,chunk,SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(n == 0 && remaining < 0){
+            return true;
+        }
+        if(n <= 0){
+            return false;
+        }
+        if(remaining > 0){
+            remaining -= n;
+        }
+        //SPLICE_F_MORE会让TCP留着不满一个MSS的数据等后续的写，最后一块（或者长度未知时）不能带，
+        //否则响应的结尾要等200ms的定时器才发出去
+        unsigned int more = remaining > 0 ? SPLICE_F_MORE : 0;
+        while(n > 0){
+            ssize_t m = splice(relay_pipe[0],NULL,to,NULL,n,SPLICE_F_MOVE | more | SPLICE_F_NONBLOCK);
+            if(m < 0){
+                if(errno == EAGAIN && wait_writable(to)){
+                    continue;
+                }
+                return false;
+            }
+            n -= m;
+        }
+    }
+    return true;
+}
+
+//扫描chunked编码的响应体，找到结束位置，数据本身原样转发
+struct chunk_scanner{
+    enum STATE{SIZE,DATA,DATA_END,TRAILER,DONE};
+    STATE state;
+    long long left;         //当前块还没扫描的字节数
+    bool in_digits;         //还在读块大小的十六进制数字
+    bool line_empty;        //trailer中当前行是否为空
+
+    chunk_scanner():state(SIZE),left(0),in_digits(true),line_empty(true){}
+
+    //返回消费的字节数，扫描到结束时state为DONE，格式错误返回-1
+    long long feed(const char* p,size_t n){
+        size_t i = 0;
+        while(i < n && state != DONE){
+            char c = p[i];
+            switch(state){
+                case SIZE:
+                    if(c == '\n'){
+                        state = left == 0 ? TRAILER : DATA;
+                        in_digits = true;
+                        line_empty = true;
+                    }else if(in_digits && isxdigit((unsigned char)c)){
+                        if(left > (1LL << 40)){
+                            return -1;
+                        }
+                        left = left * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+                    }else{
+                        //块扩展和\r
+                        in_digits = false;
+                    }
+                    ++i;
+                    break;
+                case DATA:{
+                    size_t skip = n - i < (size_t)left ? n - i : (size_t)left;
+                    i += skip;
+                    left -= skip;
+                    if(left == 0){
+                        state = DATA_END;
+                    }
+                    break;
+                }
+                case DATA_END:
+                    //块数据之后的\r\n
+                    if(c == '\n'){
+                        state = SIZE;
+                    }
+                    ++i;
+                    break;
+                case TRAILER:
+                    if(c == '\n'){
+                        if(line_empty){
+                            state = DONE;
+                        }
+                        line_empty = true;
+                    }else if(c != '\r'){
+                        line_empty = false;
+                    }
+                    ++i;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return i;
+    }
+};
+
+upstream::upstream():m_addr_len(0),m_locker("upstream.idle"){
+    memset(&m_addr,0,sizeof(m_addr));
+}
+
+upstream::~upstream(){
+    for(size_t i = 0;i < m_idle.size();++i){
+        close(m_idle[i]);
+    }
+}
+
+bool upstream::parse(const char* spec){
+    if(strncmp(spec,"unix:",5) == 0){
+        struct sockaddr_un* addr = (struct sockaddr_un*)&m_addr;
+        const char* path = spec + 5;
+        if(strlen(path) >= sizeof(addr->sun_path)){
+            return false;
+        }
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path,path);
+        m_addr_len = sizeof(struct sockaddr_un);
+        return true;
+    }
+    const char* colon = strrchr(spec,':');
+    if(!colon){
+        return false;
+    }
+    std::string host(spec,colon - spec);
+    struct sockaddr_in* addr = (struct sockaddr_in*)&m_addr;
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(colon + 1));
+    if(inet_pton(AF_INET,host.c_str(),&addr->sin_addr) != 1){
+        return false;
+    }
+    m_addr_len = sizeof(struct sockaddr_in);
+    return true;
+}
+
+int upstream::connect_new(){
+    int fd = socket(m_addr.ss_family,SOCK_STREAM | SOCK_CLOEXEC,0);
+    if(fd < 0){
+        return -1;
+    }
+    struct timeval tv;
+    tv.tv_sec = IO_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+    if(connect(fd,(struct sockaddr*)&m_addr,m_addr_len) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int upstream::acquire(bool& reused){
+    m_locker.lock();
+    if(!m_idle.empty()){
+        int fd = m_idle.back();
+        m_idle.pop_back();
+        m_locker.unlock();
+        reused = true;
+        return fd;
+    }
+    m_locker.unlock();
+    reused = false;
+    return connect_new();
+}
+
+void upstream::release(int fd,bool reusable){
+    if(reusable){
+        m_locker.lock();
+        if((int)m_idle.size() < MAX_IDLE){
+            m_idle.push_back(fd);
+            m_locker.unlock();
+            return;
+        }
+        m_locker.unlock();
+    }
+    close(fd);
+}
+
+bool proxy::add_route(const char* spec){
+    const char* eq = strchr(spec,'=');
+    if(!eq || spec[0] != '/'){
+        return false;
+    }
+    upstream* up = new upstream;
+    if(!up->parse(eq + 1)){
+        delete up;
+        return false;
+    }
+    route r;
+    r.prefix.assign(spec,eq - spec);
+    r.up = up;
+    m_routes.push_back(r);
+    return true;
+}
+
+upstream* proxy::match(const char* url){
+    for(size_t i = 0;i < m_routes.size();++i){
+        if(strncmp(url,m_routes[i].prefix.c_str(),m_routes[i].prefix.size()) == 0){
+            return m_routes[i].up;
+        }
+    }
+    return NULL;
+}
+
+bool proxy::hop_by_hop(const char* line){
+    static const char* const names[] = {"Connection:","Keep-Alive:","Proxy-Connection:","TE:","Trailer:","Upgrade:"};
+    for(size_t i = 0;i < sizeof(names) / sizeof(names[0]);++i){
+        if(strncasecmp(line,names[i],strlen(names[i])) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool proxy::enter(){
+    if(m_relays.fetch_add(1,std::memory_order_relaxed) >= m_max_relays){
+        m_relays.fetch_sub(1,std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void proxy::leave(){
+    m_relays.fetch_sub(1,std::memory_order_relaxed);
+}
+
+proxy::RESULT proxy::relay(upstream* up,int client_fd,const std::string& request,bool head_request,bool& keep_alive){
+    if(!get_relay_pipe()){
+        return PROXY_UPSTREAM_ERROR;
+    }
+
+    //发送请求并读取响应头。复用的空闲连接可能已经被上游关闭，此时换一个新连接重试一次
+    char buf[8192];
+    int n = 0;
+    int fd = -1;
+    char* header_end = NULL;
+    for(int attempt = 0;attempt < 2 && !header_end;++attempt){
+        bool reused = false;
+        fd = up->acquire(reused);
+        if(fd < 0){
+            return PROXY_UPSTREAM_ERROR;
+        }
+        n = 0;
+        bool ok = send_upstream(fd,request.data(),request.size());
+        while(ok && !header_end && n < (int)sizeof(buf) - 1){
+            ssize_t r = recv(fd,buf + n,sizeof(buf) - 1 - n,0);
+            if(r <= 0){
+                ok = false;
+                break;
+            }
+            n += r;
+            buf[n] = '\0';
+            header_end = strstr(buf,"\r\n\r\n");
+        }
+        if(!header_end){
+            close(fd);
+            if(!(reused && n == 0)){
+                return PROXY_UPSTREAM_ERROR;
+            }
+        }
+    }
+    if(!header_end){
+        return PROXY_UPSTREAM_ERROR;
+    }
+
+    //解析状态行和需要的头部，改写逐跳头部
+    *header_end = '\0';
+    char* body = header_end + 4;
+    int status = 0;
+    int minor = 1;
+    if(sscanf(buf,"HTTP/1.%d %d",&minor,&status) != 2){
+        close(fd);
+        return PROXY_UPSTREAM_ERROR;
+    }
+    long long content_length = -1;
+    bool chunked = false;
+    bool upstream_close = minor == 0;
+    std::string head;
+    char* line = buf;
+    bool first = true;
+    while(line){
+        char* next = strstr(line,"\r\n");
+        if(next){
+            *next = '\0';
+            next += 2;
+        }
+        if(first){
+            head.append(line).append("\r\n");
+            first = false;
+        }else if(strncasecmp(line,"Connection:",11) == 0){
+            if(strcasestr(line + 11,"close")){
+                upstream_close = true;
+            }
+        }else if(!hop_by_hop(line)){
+            if(strncasecmp(line,"Content-Length:",15) == 0){
+                content_length = atoll(line + 15);
+            }else if(strncasecmp(line,"Transfer-Encoding:",18) == 0 && strcasestr(line + 18,"chunked")){
+                chunked = true;
+            }
+            head.append(line).append("\r\n");
+        }
+        line = next;
+    }
+    //HEAD请求的响应以及1xx、204、304没有响应体
+    if(head_request || status < 200 || status == 204 || status == 304){
+        content_length = 0;
+        chunked = false;
+    }
+    //既没有长度也不是chunked，响应体以上游关闭连接结束，客户端连接也只能关闭
+    bool until_close = content_length < 0 && !chunked;
+    if(until_close){
+        keep_alive = false;
+    }
+    head.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+
+    if(!send_client(client_fd,head.data(),head.size())){
+        close(fd);
+        return PROXY_ABORTED;
+    }
+
+    //先发送和响应头一起读到的那部分响应体
+    bool ok = true;
+    long long buffered = buf + n - body;
+    if(chunked){
+        chunk_scanner scanner;
+        long long used = scanner.feed(body,buffered);
+        ok = used >= 0 && send_client(client_fd,body,used);
+        while(ok && scanner.state != chunk_scanner::DONE){
+            ssize_t r = recv(fd,buf,sizeof(buf),0);
+            if(r <= 0){
+                ok = false;
+                break;
+            }
+            used = scanner.feed(buf,r);
+            ok = used >= 0 && send_client(client_fd,buf,used);
+        }
+    }else{
+        if(content_length >= 0 && buffered > content_length){
+            buffered = content_length;
+        }
+        ok = send_client(client_fd,body,buffered);
+        if(ok){
+            ok = splice_body(fd,client_fd,until_close ? -1 : content_length - buffered);
+        }
+    }
+
+    if(!ok){
+        reset_relay_pipe();
+        close(fd);
+        return PROXY_ABORTED;
+    }
+    up->release(fd,!until_close && !upstream_close);
+    return PROXY_OK;
+}
@@ -0,0 +1,76 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "locker.h"
+
+//反向代理：url前缀匹配的请求（任何方法，连同请求体）转发给配置的上游服务器（TCP或者Unix域socket）。
+//转发在工作线程中同步完成，响应体用splice在两个socket之间搬运，不经过用户态缓冲区。
+//同时转发的请求数不超过m_max_relays（-R），上游慢的时候线程池中的其余线程仍然处理别的请求。
+
+//一个上游服务器以及它的空闲长连接池
+class upstream{
+public:
+    static const int MAX_IDLE = 32;         //每个上游最多保留的空闲连接数
+    static const int IO_TIMEOUT = 10;       //上游读写超时（秒）
+
+    upstream();
+    ~upstream();
+
+    //host:port 或者 unix:/path/to/socket
+    bool parse(const char* spec);
+
+    //取出一个连接，优先复用空闲连接，reused表示是否是复用的
+    int acquire(bool& reused);
+    //归还连接，不能复用的直接关闭
+    void release(int fd,bool reusable);
+
+private:
+    int connect_new();
+
+    struct sockaddr_storage m_addr;
+    socklen_t m_addr_len;
+    std::vector<int> m_idle;
+    locker m_locker;
+};
+
+class proxy{
+public:
+    enum RESULT{
+        PROXY_OK = 0,           //响应已经完整转发
+        PROXY_UPSTREAM_ERROR,   //还没有向客户端发送任何数据时上游失败，可以回复502
+        PROXY_ABORTED           //已经向客户端发送了一部分响应，只能关闭连接
+    };
+
+    //同时阻塞在上游的工作线程数，-R设置，不超过线程池的线程数。默认4是线程池8个线程的一半：
+    //上游全部卡住（最长IO_TIMEOUT）时仍有一半线程处理静态文件和动态路由
+    static int m_max_relays;
+
+    //添加一条路由：prefix=upstream，例如 /api/=127.0.0.1:9000
+    static bool add_route(const char* spec);
+    //找到与url匹配的上游，没有则返回空指针
+    static upstream* match(const char* url);
+    //逐跳头部（Connection、Keep-Alive等）只对一跳连接有效，不转发
+    static bool hop_by_hop(const char* line);
+
+    //占用一个转发名额，已经有m_max_relays个请求在转发时返回false；转发结束后调用leave
+    static bool enter();
+    static void leave();
+
+    //把request发给上游，再把响应转发给客户端client_fd（非阻塞socket），head_request表示是HEAD请求，响应没有响应体
+    //keep_alive传入客户端是否要求保持连接，响应没有明确长度时会被改为false
+    static RESULT relay(upstream* up,int client_fd,const std::string& request,bool head_request,bool& keep_alive);
+
+private:
+    struct route{
+        std::string prefix;
+        upstream* up;
+    };
+    static std::vector<route> m_routes;
+    static std::atomic<int> m_relays;       //正在转发的请求数
+};
+
+#endif
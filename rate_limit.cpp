@@ -0,0 +1,130 @@
+//按客户端IP的速率限制
+#include <sys/mman.h>
+#include <time.h>
+#include "rate_limit.h"
+
+//每个令牌是1000个单位，补充时按毫秒计算：每毫秒补充rate个单位
+static const uint32_t TOKEN = 1000;
+
+rate_limiter::rate_limiter():m_limited_requests(0),m_limited_connections(0),m_table_full(0){
+    m_requests.rate = 0;
+    m_connections.rate = 0;
+}
+
+void rate_limiter::set_request_limit(int rate,int burst){
+    init(m_requests,rate,burst);
+}
+
+void rate_limiter::set_connection_limit(int rate,int burst){
+    init(m_connections,rate,burst);
+}
+
+void rate_limiter::init(table& t,int rate,int burst){
+    if(rate <= 0){
+        t.rate = 0;
+        return;
+    }
+    if(burst < 1){
+        burst = rate;
+    }
+    //容量放在32位中
+    if(burst > 1000000){
+        burst = 1000000;
+    }
+    t.capacity = (uint32_t)burst * TOKEN;
+    //表放在共享内存中，启动时（fork之前）分配，prefork模式下所有worker共用同一组令牌桶。
+    //匿名映射初始全为0，即所有槽为空
+    for(int i = 0;i < SHARDS;++i){
+        void* p = mmap(NULL,sizeof(slot) * SHARD_SLOTS,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0);
+        if(p == MAP_FAILED){
+            t.rate = 0;
+            return;
+        }
+        t.shards[i] = (slot*)p;
+    }
+    t.rate = rate;
+}
+
+//粗粒度的单调时钟，vDSO中读取，不进入内核
+uint32_t rate_limiter::now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+bool rate_limiter::allow_request(const sockaddr_in& addr){
+    if(m_requests.rate == 0 || addr.sin_family != AF_INET){
+        return true;
+    }
+    if(take(m_requests,addr.sin_addr.s_addr)){
+        return true;
+    }
+    m_limited_requests.fetch_add(1,std::memory_order_relaxed);
+    return false;
+}
+
+bool rate_limiter::allow_connection(const sockaddr_in& addr){
+    if(m_connections.rate == 0 || addr.sin_family != AF_INET){
+        return true;
+    }
+    if(take(m_connections,addr.sin_addr.s_addr)){
+        return true;
+    }
+    m_limited_connections.fetch_add(1,std::memory_order_relaxed);
+    return false;
+}
+
+bool rate_limiter::take(table& t,uint32_t ip){
+    uint64_t key = (uint64_t)ip + 1;
+    //乘法哈希，最高8位选分片，中间的位选槽
+    uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+    slot* shard = t.shards[(h >> 56) % SHARDS];
+    uint32_t index = (uint32_t)(h >> 24);
+    uint32_t now = now_ms();
+    //桶从空到满需要的毫秒数，超过这么久没有更新的槽等同于满桶，可以让给别的IP
+    uint32_t refill_ms = t.capacity / t.rate + 1;
+
+    slot* s = 0;
+    for(int i = 0;i < PROBE_LIMIT && !s;++i){
+        slot& candidate = shard[(index + i) & (SHARD_SLOTS - 1)];
+        uint64_t k = candidate.key.load(std::memory_order_acquire);
+        if(k == key){
+            s = &candidate;
+        }else if(k == 0 || now - (uint32_t)(candidate.state.load(std::memory_order_relaxed) >> 32) > refill_ms){
+            //空槽或者闲置的槽，抢到之后从满桶开始
+            if(candidate.key.compare_exchange_strong(k,key,std::memory_order_acq_rel)){
+                candidate.state.store(((uint64_t)now << 32) | t.capacity,std::memory_order_release);
+                s = &candidate;
+            }else if(k == key){
+                s = &candidate;
+            }
+        }
+    }
+    if(!s){
+        m_table_full.fetch_add(1,std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t old = s->state.load(std::memory_order_acquire);
+    while(true){
+        uint32_t last = (uint32_t)(old >> 32);
+        uint64_t tokens = (uint32_t)old;
+        uint32_t elapsed = now - last;
+        //时钟在其他线程看来可能稍有倒退，不补充
+        if(elapsed < 0x80000000u){
+            tokens += (uint64_t)elapsed * t.rate;
+        }else{
+            now = last;
+        }
+        if(tokens > t.capacity){
+            tokens = t.capacity;
+        }
+        if(tokens < TOKEN){
+            return false;
+        }
+        uint64_t desired = ((uint64_t)now << 32) | (tokens - TOKEN);
+        if(s->state.compare_exchange_weak(old,desired,std::memory_order_acq_rel)){
+            return true;
+        }
+    }
+}
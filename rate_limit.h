@@ -0,0 +1,68 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <atomic>
+
+//按客户端IP限制请求速率和建立连接的速率，每个IP一个令牌桶。
+//令牌桶放在固定大小的开放寻址哈希表中，表分成若干分片，每个槽的键和状态都是原子变量，
+//检查一次只是几次原子读和一次CAS，不加锁。表满时找不到槽的客户端不限制。
+//表在共享内存中，prefork模式下的限制是所有worker合计的。
+//Unix socket上的连接（同一台机器上的sidecar）不限制。
+class rate_limiter{
+public:
+    static const int SHARDS = 16;               //分片数
+    static const int SHARD_SLOTS = 4096;        //每个分片的槽数，2的幂
+    static const int PROBE_LIMIT = 8;           //线性探测的最大次数
+
+    static rate_limiter& instance(){
+        static rate_limiter limiter;
+        return limiter;
+    }
+
+    //设置每个IP每秒的请求数和允许的突发量，rate为0表示不限制；启动时在fork之前调用
+    void set_request_limit(int rate,int burst);
+    //设置每个IP每秒新建的连接数和允许的突发量
+    void set_connection_limit(int rate,int burst);
+
+    //取一个请求令牌，返回false时应当回复429
+    bool allow_request(const sockaddr_in& addr);
+    //取一个连接令牌，返回false时应当直接关闭新连接
+    bool allow_connection(const sockaddr_in& addr);
+
+    unsigned long long limited_requests() const {return m_limited_requests.load(std::memory_order_relaxed);}
+    unsigned long long limited_connections() const {return m_limited_connections.load(std::memory_order_relaxed);}
+    //表满没有找到槽而放行的次数
+    unsigned long long table_full() const {return m_table_full.load(std::memory_order_relaxed);}
+
+private:
+    rate_limiter();
+
+    //一个槽：键是IP加一（0表示空槽），状态的高32位是上次补充令牌的毫秒时间，低32位是千分之一令牌数
+    struct slot{
+        std::atomic<uint64_t> key;
+        std::atomic<uint64_t> state;
+    };
+
+    //一种限制对应一张表
+    struct table{
+        int rate;           //每秒补充的令牌数，0表示不限制
+        uint32_t capacity;  //桶的容量，千分之一令牌
+        slot* shards[SHARDS];
+    };
+
+    void init(table& t,int rate,int burst);
+    bool take(table& t,uint32_t ip);
+    static uint32_t now_ms();
+
+private:
+    table m_requests;
+    table m_connections;
+
+    std::atomic<unsigned long long> m_limited_requests;
+    std::atomic<unsigned long long> m_limited_connections;
+    std::atomic<unsigned long long> m_table_full;
+};
+
+#endif
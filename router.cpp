@@ -0,0 +1,116 @@
+//动态路由
+#include <cstring>
+#include "router.h"
+
+std::vector<router::route> router::m_routes;
+std::vector<router::node> router::m_nodes;
+
+bool router::add(http_conn::METHOD method,const char* pattern,route_handler handler){
+    size_t len = strlen(pattern);
+    if(len == 0 || pattern[0] != '/' || !handler){
+        return false;
+    }
+    route r;
+    r.method = method;
+    r.is_prefix = pattern[len - 1] == '*';
+    r.path.assign(pattern,r.is_prefix ? len - 1 : len);
+    r.handler = handler;
+    m_routes.push_back(r);
+    return true;
+}
+
+//插入路径，必要时拆分已有的边，返回路径结束处的节点
+int router::insert(const std::string& path){
+    int cur = 0;
+    size_t pos = 0;
+    while(pos < path.size()){
+        int next = -1;
+        for(size_t i = 0;i < m_nodes[cur].children.size();++i){
+            int c = m_nodes[cur].children[i];
+            if(m_nodes[c].label[0] == path[pos]){
+                next = c;
+                break;
+            }
+        }
+        if(next < 0){
+            //没有首字节相同的边，剩下的部分作为一条新边
+            node n;
+            n.label = path.substr(pos);
+            m_nodes.push_back(n);
+            m_nodes[cur].children.push_back(m_nodes.size() - 1);
+            return m_nodes.size() - 1;
+        }
+        //与边标签的公共前缀
+        const std::string& label = m_nodes[next].label;
+        size_t common = 0;
+        while(common < label.size() && pos + common < path.size() && label[common] == path[pos + common]){
+            ++common;
+        }
+        if(common < label.size()){
+            //拆分：原节点保留后半段标签，中间插入一个持有前半段的节点
+            node mid;
+            mid.label = label.substr(0,common);
+            mid.children.push_back(next);
+            m_nodes[next].label.erase(0,common);
+            m_nodes.push_back(mid);
+            int m = m_nodes.size() - 1;
+            for(size_t i = 0;i < m_nodes[cur].children.size();++i){
+                if(m_nodes[cur].children[i] == next){
+                    m_nodes[cur].children[i] = m;
+                }
+            }
+            next = m;
+        }
+        cur = next;
+        pos += common;
+    }
+    return cur;
+}
+
+void router::compile(){
+    m_nodes.clear();
+    m_nodes.push_back(node());
+    for(size_t i = 0;i < m_routes.size();++i){
+        const route& r = m_routes[i];
+        int n = insert(r.path);
+        if(r.is_prefix){
+            m_nodes[n].prefix[r.method] = r.handler;
+        }else{
+            m_nodes[n].exact[r.method] = r.handler;
+        }
+    }
+    m_routes.clear();
+}
+
+route_handler router::match(http_conn::METHOD method,const char* url){
+    if(m_nodes.empty()){
+        return 0;
+    }
+    size_t len = strcspn(url,"?");
+    route_handler best = m_nodes[0].prefix[method];
+    int cur = 0;
+    size_t pos = 0;
+    while(pos < len){
+        int next = -1;
+        const std::vector<int>& children = m_nodes[cur].children;
+        for(size_t i = 0;i < children.size();++i){
+            if(m_nodes[children[i]].label[0] == url[pos]){
+                next = children[i];
+                break;
+            }
+        }
+        if(next < 0){
+            return best;
+        }
+        const std::string& label = m_nodes[next].label;
+        if(label.size() > len - pos || memcmp(label.data(),url + pos,label.size()) != 0){
+            return best;
+        }
+        pos += label.size();
+        cur = next;
+        if(m_nodes[cur].prefix[method]){
+            best = m_nodes[cur].prefix[method];
+        }
+    }
+    return m_nodes[cur].exact[method] ? m_nodes[cur].exact[method] : best;
+}
@@ -0,0 +1,52 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <vector>
+#include "http_conn.h"
+
+//动态处理函数，直接调用conn.reply()把响应写进连接的缓冲区，返回reply()的结果；
+//也可以返回NO_RESOURCE、BAD_REQUEST等，使用服务器的错误页面
+typedef http_conn::HTTP_CODE (*route_handler)(http_conn& conn);
+
+//动态路由：按请求方法和路径找到处理函数，没有匹配的请求照常交给静态文件和反向代理。
+//启动时用add()注册、compile()编译成按字节比较的基数树，之后只读，工作线程查找时不需要加锁。
+class router{
+public:
+    //路径模式：精确路径如 /healthz，或者以*结尾的前缀如 /api/*；精确匹配优先，其次是最长前缀
+    static bool add(http_conn::METHOD method,const char* pattern,route_handler handler);
+    //把注册的路由编译成基数树，必须在工作线程启动之前调用
+    static void compile();
+    //url中?之后的查询字符串不参与匹配，没有匹配返回空指针
+    static route_handler match(http_conn::METHOD method,const char* url);
+
+private:
+    static const int METHOD_COUNT = http_conn::CONNECT + 1;
+
+    //基数树的一个节点，边上的标签是一段字节串
+    struct node{
+        std::string label;                          //从父节点到这里的字节串
+        std::vector<int> children;                  //子节点下标，各子节点标签的首字节互不相同
+        route_handler exact[METHOD_COUNT];          //路径恰好在这里结束时的处理函数
+        route_handler prefix[METHOD_COUNT];         //以这里为前缀的路径的处理函数
+
+        node(){
+            for(int i = 0;i < METHOD_COUNT;++i){
+                exact[i] = prefix[i] = 0;
+            }
+        }
+    };
+    struct route{
+        http_conn::METHOD method;
+        std::string path;
+        bool is_prefix;
+        route_handler handler;
+    };
+
+    static int insert(const std::string& path);
+
+    static std::vector<route> m_routes;     //注册但还没编译的路由
+    static std::vector<node> m_nodes;       //编译好的基数树，m_nodes[0]是根
+};
+
+#endif
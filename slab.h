@@ -0,0 +1,98 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <new>
+#include <vector>
+#include <exception>
+#include "locker.h"
+#include "huge_pages.h"
+
+//对象池：按块批量分配对象，关闭连接时把对象放回空闲链表，下次建立连接时复用。
+//对象的地址在池的生命周期内不变，所以任务队列里可以直接保存指针，再用代数判断是否过期。
+//主线程分配，工作线程也可能在出错时关闭连接并归还对象，所以用互斥锁保护空闲链表。
+//块的内存来自huge_pages，开启大页时一块占整数个大页，块中的对象数按实际长度算，不浪费取整多出来的部分。
+template<typename T>
+class slab{
+public:
+    explicit slab(int chunk_size = 256):m_chunk_size(chunk_size),m_used(0),m_locker("slab"){
+        if(chunk_size <= 0){
+            throw std::exception();
+        }
+    }
+    ~slab(){
+        for(size_t i = 0;i < m_chunks.size();++i){
+            for(int j = 0;j < m_chunks[i].count;++j){
+                m_chunks[i].objs[j].~T();
+            }
+            huge_pages::free(m_chunks[i].objs,m_chunks[i].bytes);
+        }
+    }
+
+    //取出一个空闲对象，没有则再分配一块
+    T* alloc(){
+        m_locker.lock();
+        if(m_free.empty()){
+            chunk c;
+            c.objs = (T*)huge_pages::alloc(sizeof(T) * m_chunk_size,c.bytes);
+            c.count = c.bytes / sizeof(T);
+            for(int i = 0;i < c.count;++i){
+                new (c.objs + i) T;
+            }
+            m_chunks.push_back(c);
+            //倒序放入，先分配低地址的对象
+            for(int i = c.count - 1;i >= 0;--i){
+                m_free.push_back(c.objs + i);
+            }
+        }
+        T* obj = m_free.back();
+        m_free.pop_back();
+        ++m_used;
+        m_locker.unlock();
+        return obj;
+    }
+
+    //归还对象
+    void free(T* obj){
+        m_locker.lock();
+        m_free.push_back(obj);
+        --m_used;
+        m_locker.unlock();
+    }
+
+    int used() const {return m_used;}
+
+private:
+    struct chunk{
+        T* objs;
+        int count;
+        size_t bytes;
+    };
+
+    int m_chunk_size;           //每块至少的对象个数
+    int m_used;                 //正在使用的对象个数
+    std::vector<chunk> m_chunks;
+    std::vector<T*> m_free;     //空闲对象，后进先出，刚释放的对象更可能还在缓存里
+    locker m_locker;
+};
+
+//带代数的句柄。对象被回收后代数会变化，任务队列中过期的句柄在处理前就能被识别出来
+template<typename T>
+struct slab_handle{
+    T* obj;
+    unsigned generation;
+
+    slab_handle():obj(NULL),generation(0){}
+    explicit slab_handle(T* o):obj(o),generation(o->generation()){}
+
+    bool valid() const {
+        return obj && obj->generation() == generation;
+    }
+    //线程池调用，过期的句柄直接丢弃
+    void process(){
+        if(valid()){
+            obj->process();
+        }
+    }
+};
+
+#endif
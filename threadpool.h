@@ -4,21 +4,51 @@
 
 #include <pthread.h>
 #include <list>
+#include <vector>
+#include <utility>
+#include <atomic>
 #include <exception>
 #include <cstdio>
 #include "locker.h"
 
 //线程池类，定义成模板类是为了代码的复用,模板参数T就是任务类
+//任务按值保存在队列中，T需要提供process()，例如带代数的连接句柄slab_handle。
+//信号量不再按任务计数，而是唤醒令牌：提交任务时只唤醒需要的那么多个睡眠中的线程，
+//醒着的线程一次取走一批任务，处理完继续取，队列空了才睡眠。
+//任务分为CLASSES个优先级（0最高），预计开销小的放在前面的类中先处理；
+//每低一级相当于晚到AGING_US，按这样算出的到达时间挑最早的队首，低优先级的任务最多多等 类 * AGING_US，不会饿死，
+//持续过载、所有任务都等了很久时高优先级的任务仍然排在前面
 template<typename T>
 class threadpool{
 public:
-    threadpool(int thread_number = 8,int max_requests = 10000);
+    //spin_us大于0时空闲的线程先自旋这么多微秒再睡眠，用CPU换取更低的延迟。
+    //同一时间只有一个线程自旋，下一个任务由它接手，其余线程照常睡眠
+    threadpool(int thread_number = 8,int max_requests = 10000,int spin_us = 0);
     ~threadpool();
-    bool append(T* request);
+    static const int CLASSES = 4;           //优先级类的个数
+    static const int AGING_US = 20000;      //每低一个优先级类，任务按晚到这么久排队
+    static const int MAX_BATCH = 16;        //工作线程一次最多取走的任务数
+
+    //cls为优先级类，0最高
+    bool append(const T& request,int cls = 0);
+    //一次加锁提交一批任务（例如一轮epoll_wait中所有可读的连接）和各自的优先级类，返回放进队列的个数。
+    //队列满时放进去的是前面的部分，调用者要处理末尾没有放进去的任务
+    int append_batch(const std::vector< std::pair<T,int> >& requests);
 
 private:
     static void* worker(void* arg);
     void run();
+    //持有队列锁时调用：为新加入的n个任务认领睡眠中的线程，返回需要post的次数
+    int claim_sleepers(int n);
+    //持有队列锁时调用：放入一个任务
+    void push(const T& request,int cls,long long now);
+    //持有队列锁时调用：取出下一个该处理的任务，队列不能为空，cls返回它的优先级类
+    T pop(int& cls);
+
+    struct entry{
+        T request;
+        long long enqueued;     //进入队列的时间（微秒）
+    };
 
 private:
     //线程的数量
@@ -27,20 +57,28 @@ private:
     pthread_t *m_threads;
     //请求队列中最多允许的，等待处理的请求数
     int m_max_requests;
-    //请求队列
-    std::list<T*> m_workqueue;
+    //请求队列，每个优先级类一个，m_queued为总数
+    std::list<entry> m_workqueue[CLASSES];
+    size_t m_queued;
     //互斥锁
     locker m_queuelocker;
     //信号量用来判断是否有任务需要处理
     sem m_queuestat;
     //是否结束线程
     bool m_stop;
+    //等待任务时自旋的微秒数
+    int m_spin_us;
+    //正在自旋的线程数
+    std::atomic<int> m_spinners;
+    //队列空了准备睡眠（或者正在睡眠、自旋）而且还没有被认领唤醒的线程数，受m_queuelocker保护
+    int m_sleepers;
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_number,int max_requests):
-    m_thread_number(thread_number),m_max_requests(max_requests),
-    m_stop(false),m_threads(NULL){
+threadpool<T>::threadpool(int thread_number,int max_requests,int spin_us):
+    m_thread_number(thread_number),m_threads(NULL),m_max_requests(max_requests),m_queued(0),
+    m_queuelocker("threadpool.queue"),m_queuestat("threadpool.wakeup"),
+    m_stop(false),m_spin_us(spin_us),m_spinners(0),m_sleepers(0){
     
     if((thread_number<=0)||(max_requests<=0)){
         throw std::exception();
@@ -50,7 +88,7 @@ threadpool<T>::threadpool(int thread_number,int max_requests):
         throw std::exception();
     }
 
-    //创建thread_number个线程，并将他们设置为线程脱离
+    //创建thread_number个线程，析构时等待它们退出
     for(int i=0;i<thread_number;++i){
         printf("create %dth thread\n",i);
         //C++ worker必须是static函数无法直接获取成员所以使用传入参数this
@@ -58,32 +96,101 @@ threadpool<T>::threadpool(int thread_number,int max_requests):
             delete[] m_threads;
             throw std::exception();
         }
-        if(pthread_detach(m_threads[i])){
-            delete[] m_threads;
-            throw std::exception();
-        }      
     }
 }
 
 template<typename T>
 threadpool<T>::~threadpool(){
-    delete[] m_threads;
+    //在锁内设置m_stop，之后不会再有线程登记睡眠；唤醒所有睡眠中的线程，等正在处理的任务结束。
+    //队列中剩下的任务不再处理
+    m_queuelocker.lock();
     m_stop = true;
+    m_sleepers = 0;
+    m_queuelocker.unlock();
+    for(int i = 0;i < m_thread_number;++i){
+        m_queuestat.post();
+    }
+    for(int i = 0;i < m_thread_number;++i){
+        pthread_join(m_threads[i],NULL);
+    }
+    delete[] m_threads;
 }
 
 template<typename T>
-bool threadpool<T>::append(T * request){
+void threadpool<T>::push(const T& request,int cls,long long now){
+    if(cls < 0 || cls >= CLASSES){
+        cls = CLASSES - 1;
+    }
+    entry e = {request,now};
+    m_workqueue[cls].push_back(e);
+    ++m_queued;
+}
+
+template<typename T>
+T threadpool<T>::pop(int& cls){
+    //各类的队首按 进入队列的时间 + 类 * AGING_US 比较，取最早的
+    cls = -1;
+    long long earliest = 0;
+    for(int c = 0;c < CLASSES;++c){
+        if(m_workqueue[c].empty()){
+            continue;
+        }
+        long long key = m_workqueue[c].front().enqueued + (long long)c * AGING_US;
+        if(cls < 0 || key < earliest){
+            cls = c;
+            earliest = key;
+        }
+    }
+    T request = m_workqueue[cls].front().request;
+    m_workqueue[cls].pop_front();
+    --m_queued;
+    return request;
+}
+
+template<typename T>
+bool threadpool<T>::append(const T& request,int cls){
     m_queuelocker.lock();
-    if(m_workqueue.size()>m_max_requests){
+    if(m_queued>(size_t)m_max_requests){
         m_queuelocker.unlock();
         return false;
     }
 
-    m_workqueue.push_back(request);
+    push(request,cls,monotonic_us());
+    int wake = claim_sleepers(1);
     m_queuelocker.unlock();
-    m_queuestat.post();//信号量增加
+    if(wake > 0){
+        m_queuestat.post();//唤醒一个睡眠中的线程
+    }
     return true;
 }
+
+template<typename T>
+int threadpool<T>::append_batch(const std::vector< std::pair<T,int> >& requests){
+    if(requests.empty()){
+        return 0;
+    }
+    long long now = monotonic_us();
+    m_queuelocker.lock();
+    int added = 0;
+    for(size_t i = 0;i < requests.size() && m_queued <= (size_t)m_max_requests;++i){
+        push(requests[i].first,requests[i].second,now);
+        ++added;
+    }
+    int wake = claim_sleepers(added);
+    m_queuelocker.unlock();
+    //醒着的线程处理完手上的任务会继续取，只唤醒不够的部分
+    for(int i = 0;i < wake;++i){
+        m_queuestat.post();
+    }
+    return added;
+}
+
+template<typename T>
+int threadpool<T>::claim_sleepers(int n){
+    int wake = n < m_sleepers ? n : m_sleepers;
+    m_sleepers -= wake;
+    return wake;
+}
 template<typename T>
 void* threadpool<T>::worker(void* arg){
     threadpool * pool =(threadpool*)arg;
@@ -92,23 +199,52 @@ void* threadpool<T>::worker(void* arg){
 }
 template<typename T>
 void threadpool<T>::run(){
-    while(!m_stop){
-        m_queuestat.wait();
+    std::vector<T> batch;
+    batch.reserve(MAX_BATCH);
+    while(true){
         m_queuelocker.lock();
-        if(m_workqueue.empty()){
+        if(m_stop){
+            m_queuelocker.unlock();
+            break;
+        }
+        if(m_queued == 0){
+            //登记为睡眠线程，提交任务时被认领的线程会收到一次post。
+            //登记和检查队列在同一次加锁中，不会错过唤醒
+            ++m_sleepers;
             m_queuelocker.unlock();
+            bool got = false;
+            if(m_spin_us > 0){
+                if(m_spinners.fetch_add(1) == 0){
+                    got = m_queuestat.spin(m_spin_us);
+                }
+                m_spinners.fetch_sub(1);
+            }
+            if(!got){
+                m_queuestat.wait();
+            }
             continue;
         }
 
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
+        //按线程数平分队列中的任务，一次最多取MAX_BATCH个，每个都按优先级和等待时间挑选。
+        //最低的类（反向代理）可能阻塞很久，取到一个就停下，其余任务留在队列里按优先级给别的线程，
+        //否则后来的小请求要排在这个线程手上所有的任务后面
+        size_t n = (m_queued + m_thread_number - 1) / m_thread_number;
+        if(n > (size_t)MAX_BATCH){
+            n = MAX_BATCH;
+        }
+        for(;n > 0;--n){
+            int cls;
+            batch.push_back(pop(cls));
+            if(cls == CLASSES - 1){
+                break;
+            }
+        }
         m_queuelocker.unlock();
 
-        if(!request){
-            continue;
+        for(size_t i = 0;i < batch.size();++i){
+            batch[i].process();
         }
-
-        request->process();
+        batch.clear();
     }
 }
 
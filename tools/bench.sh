@@ -0,0 +1,136 @@
+#!/bin/sh
+#压测场景，用tools/load产生负载，结果打印到标准输出。需要的大文件用tools/mkfile.sh现场生成。
+#用法：tools/bench.sh build_dir scenario
+#  build_dir 是cmake的构建目录（里面有HttpServer、load等），端口用环境变量PORT指定，默认9100
+set -e
+B=${1:?usage: $0 build_dir scenario}
+TOOLS=$(dirname "$0")
+PORT=${PORT:-9100}
+
+start_server(){
+    "$B/HttpServer" "$@" $PORT >/dev/null 2>&1 &
+    SERVER=$!
+    sleep 1
+}
+
+stop_server(){
+    kill -QUIT $SERVER
+    wait $SERVER 2>/dev/null || true
+}
+
+case "$2" in
+range)
+    #2GB文件上随机的单段和多段Range请求
+    "$TOOLS/mkfile.sh" 2048 "$TOOLS/../resources/huge.bin" >/dev/null
+    start_server
+    for spec in 65536 4096 16384:4 1024:16; do
+        echo "== -R $spec"
+        "$B/load" -c 16 -d 5 -R $((2048 * 1024 * 1024)):$spec -p $SERVER 127.0.0.1:$PORT /huge.bin
+    done
+    stop_server
+    ;;
+proxy)
+    #tools/stub_upstream作为上游，比较直连上游和经过反向代理（TCP和Unix socket上游）的延迟和吞吐量
+    for size in 1024 1048576; do
+        "$B/stub_upstream" -s $size $((PORT + 1)) &
+        TCP_UPSTREAM=$!
+        "$B/stub_upstream" -s $size unix:/tmp/bench.$$.sock &
+        UNIX_UPSTREAM=$!
+        sleep 0.3
+        start_server -P /api/=127.0.0.1:$((PORT + 1)) -P /uds/=unix:/tmp/bench.$$.sock
+        echo "== body $size direct"
+        "$B/load" -c 4 -d 4 127.0.0.1:$((PORT + 1)) /api/x
+        echo "== body $size proxy tcp"
+        "$B/load" -c 4 -d 4 -p $SERVER 127.0.0.1:$PORT /api/x
+        echo "== body $size proxy uds"
+        "$B/load" -c 4 -d 4 -p $SERVER 127.0.0.1:$PORT /uds/x
+        stop_server
+        kill $TCP_UPSTREAM $UNIX_UPSTREAM
+        wait $TCP_UPSTREAM $UNIX_UPSTREAM 2>/dev/null || true
+    done
+    rm -f /tmp/bench.$$.sock
+    ;;
+quantum)
+    #4个连接循环下载64MB的文件，同时8个连接请求小文件，比较不同写配额下小请求的延迟
+    "$TOOLS/mkfile.sh" 64 >/dev/null
+    for q in 0 65536 16384; do
+        start_server -q $q
+        "$B/load" -c 4 -d 7 127.0.0.1:$PORT /big.bin > /tmp/bench_bulk.$$ &
+        BULK=$!
+        sleep 1
+        echo "== -q $q small"
+        "$B/load" -c 8 -d 5 127.0.0.1:$PORT /index.html
+        wait $BULK
+        echo "== -q $q bulk"
+        cat /tmp/bench_bulk.$$
+        stop_server
+    done
+    rm -f /tmp/bench_bulk.$$
+    ;;
+busypoll)
+    #少量连接的小请求，比较忙轮询的延迟收益和CPU开销（-p统计服务器的CPU），忙轮询至少需要2个CPU
+    for opts in "-b 0" "-b 50" "-b 50 -B 50"; do
+        start_server $opts
+        echo "== $opts"
+        "$B/load" -c 2 -d 5 -p $SERVER 127.0.0.1:$PORT /index.html
+        stop_server
+    done
+    ;;
+uds)
+    #同一个服务器上比较回环TCP和Unix socket的小响应，长连接和每个请求新建连接各一轮
+    start_server -U /tmp/bench.$$.sock
+    for k in "" "-k"; do
+        echo "== tcp $k"
+        "$B/load" -c 8 -d 5 $k -p $SERVER 127.0.0.1:$PORT /healthz
+        echo "== uds $k"
+        "$B/load" -c 8 -d 5 $k -p $SERVER unix:/tmp/bench.$$.sock /healthz
+    done
+    stop_server
+    rm -f /tmp/bench.$$.sock
+    ;;
+batch)
+    #很多连接同时就绪，一次epoll_wait返回大量事件，统计每个请求的上下文切换次数（线程池的唤醒和睡眠）
+    #没有perf和strace时用它近似futex调用，和别的构建目录对比
+    start_server
+    for c in 16 256; do
+        echo "== $c connections"
+        "$B/load" -c $c -d 5 -p $SERVER 127.0.0.1:$PORT /index.html
+    done
+    stop_server
+    ;;
+priority)
+    #32个连接请求每次延迟20ms的上游（占住工作线程），同时8个连接请求小文件，看小请求的延迟
+    "$B/stub_upstream" -d 20 $((PORT + 1)) &
+    UPSTREAM=$!
+    sleep 0.3
+    start_server -R 8 -P /api/=127.0.0.1:$((PORT + 1))
+    "$B/load" -c 32 -d 7 127.0.0.1:$PORT /api/x > /tmp/bench_proxy.$$ &
+    PROXIED=$!
+    sleep 1
+    echo "== small"
+    "$B/load" -c 8 -d 5 127.0.0.1:$PORT /index.html
+    wait $PROXIED
+    echo "== proxied"
+    cat /tmp/bench_proxy.$$
+    stop_server
+    kill $UPSTREAM
+    rm -f /tmp/bench_proxy.$$
+    ;;
+hugepages)
+    #1000个连接分散在连接表和对象池中，比较普通页、透明大页和预留大页的吞吐量。
+    #hugetlb需要预留大页，例如 echo 512 > /proc/sys/vm/nr_hugepages，不够时退到透明大页。
+    #dTLB缺失率用 perf stat -e dTLB-load-misses -p 服务器进程 另外统计
+    for mode in "" "-H thp" "-H hugetlb"; do
+        start_server $mode
+        echo "== ${mode:-4K pages}"
+        "$B/load" -c 1000 -d 5 -p $SERVER 127.0.0.1:$PORT /healthz
+        grep -E "AnonHugePages|Private_Hugetlb" /proc/$SERVER/smaps_rollup | tr -s ' ' | tr '\n' ' '
+        echo
+        stop_server
+    done
+    ;;
+*)
+    echo "scenarios: range proxy quantum busypoll uds batch priority hugepages" >&2
+    exit 1
+    ;;
+esac
@@ -0,0 +1,348 @@
+//HTTP/1.1长连接压测：c个连接各自循环发送请求（闭环，上一个响应收完再发下一个），结束时报告吞吐量和延迟分布。
+//目标是 host:port 或者 unix:/path（@开头为抽象命名空间），多个路径按顺序轮流请求。
+//  -R size[:len[:parts]]  每个请求带随机的Range，文件大小size，每段len字节，parts段（大于1时是multipart/byteranges）
+//  -H header              额外的请求头部，可以指定多次
+//  -k                     每个请求新建连接（Connection: close）
+//  -p pid                 同时统计服务器进程的CPU时间和上下文切换次数（所有线程）
+//用法：load [-c conns] [-d seconds] [-H header] [-R size[:len[:parts]]] [-k] [-p pid] target path...
+//  例如 load -c 32 -d 10 127.0.0.1:9100 /index.html
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct conn{
+    int fd;
+    std::string out;        //还没发出去的请求
+    size_t out_off;
+    std::string in;         //还没凑成完整响应的数据
+    uint64_t start_ns;      //当前请求的发送时间
+    size_t next_path;
+};
+
+static struct sockaddr_storage target;
+static socklen_t target_len;
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//host:port 或者 unix:/path
+static bool parse_target(const char* spec){
+    memset(&target,0,sizeof(target));
+    if(strncmp(spec,"unix:",5) == 0){
+        struct sockaddr_un* un = (struct sockaddr_un*)&target;
+        const char* path = spec + 5;
+        size_t len = strlen(path);
+        if(len == 0 || len >= sizeof(un->sun_path)){
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path,path,len);
+        if(path[0] == '@'){
+            un->sun_path[0] = '\0';
+        }
+        target_len = offsetof(struct sockaddr_un,sun_path) + len + (path[0] == '@' ? 0 : 1);
+        return true;
+    }
+    const char* colon = strrchr(spec,':');
+    if(!colon){
+        return false;
+    }
+    std::string host(spec,colon - spec);
+    struct sockaddr_in* in = (struct sockaddr_in*)&target;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(atoi(colon + 1));
+    target_len = sizeof(*in);
+    return inet_pton(AF_INET,host.c_str(),&in->sin_addr) == 1;
+}
+
+static int connect_target(){
+    int fd = socket(target.ss_family,SOCK_STREAM,0);
+    if(fd < 0){
+        return -1;
+    }
+    if(target.ss_family == AF_INET){
+        int one = 1;
+        setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    }
+    if(connect(fd,(struct sockaddr*)&target,target_len) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//收到完整响应时返回响应的总长度，还不完整返回0，没有Content-Length（不支持chunked）返回-1
+static long long response_length(const std::string& in,int& status,bool& close_after){
+    size_t head_end = in.find("\r\n\r\n");
+    if(head_end == std::string::npos){
+        return 0;
+    }
+    status = atoi(in.c_str() + 9);
+    std::string head = in.substr(0,head_end + 2);
+    close_after = strcasestr(head.c_str(),"\r\nConnection: close\r\n") != NULL;
+    if(status == 204 || status == 304){
+        return head_end + 4;
+    }
+    const char* p = strcasestr(head.c_str(),"\r\nContent-Length:");
+    if(!p){
+        return -1;
+    }
+    long long total = head_end + 4 + strtoll(p + 17,NULL,10);
+    return (long long)in.size() >= total ? total : 0;
+}
+
+//服务器进程所有线程的CPU时间（秒）和上下文切换次数
+static bool server_usage(int pid,double& cpu,unsigned long long& switches){
+    char path[64];
+    snprintf(path,sizeof(path),"/proc/%d/stat",pid);
+    FILE* f = fopen(path,"r");
+    if(!f){
+        return false;
+    }
+    char buf[1024];
+    size_t n = fread(buf,1,sizeof(buf) - 1,f);
+    fclose(f);
+    buf[n] = '\0';
+    //进程名可能带空格，从最后一个')'之后开始数，utime和stime是第14、15个字段
+    const char* p = strrchr(buf,')');
+    if(!p){
+        return false;
+    }
+    unsigned long utime = 0,stime = 0;
+    if(sscanf(p + 2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",&utime,&stime) != 2){
+        return false;
+    }
+    cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    switches = 0;
+    snprintf(path,sizeof(path),"/proc/%d/task",pid);
+    DIR* dir = opendir(path);
+    if(!dir){
+        return false;
+    }
+    struct dirent* ent;
+    while((ent = readdir(dir)) != NULL){
+        if(ent->d_name[0] == '.'){
+            continue;
+        }
+        char status_path[320];
+        snprintf(status_path,sizeof(status_path),"/proc/%d/task/%s/status",pid,ent->d_name);
+        FILE* s = fopen(status_path,"r");
+        if(!s){
+            continue;
+        }
+        char line[256];
+        while(fgets(line,sizeof(line),s)){
+            unsigned long long v;
+            if(sscanf(line,"voluntary_ctxt_switches: %llu",&v) == 1 || sscanf(line,"nonvoluntary_ctxt_switches: %llu",&v) == 1){
+                switches += v;
+            }
+        }
+        fclose(s);
+    }
+    closedir(dir);
+    return true;
+}
+
+int main(int argc,char* argv[]){
+    int count = 16;
+    int duration = 10;
+    int pid = 0;
+    bool keep_alive = true;
+    long long range_size = 0,range_len = 1,range_parts = 1;
+    std::string extra;
+    int opt;
+    while((opt = getopt(argc,argv,"c:d:H:R:kp:")) != -1){
+        switch(opt){
+            case 'c':
+                count = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'H':
+                extra.append(optarg).append("\r\n");
+                break;
+            case 'R':
+            {
+                //size[:len[:parts]]
+                range_size = strtoll(optarg,NULL,10);
+                const char* colon = strchr(optarg,':');
+                if(colon){
+                    range_len = strtoll(colon + 1,NULL,10);
+                    colon = strchr(colon + 1,':');
+                    if(colon){
+                        range_parts = strtoll(colon + 1,NULL,10);
+                    }
+                }
+                break;
+            }
+            case 'k':
+                keep_alive = false;
+                break;
+            case 'p':
+                pid = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if(argc - optind < 2 || count <= 0 || duration <= 0 || range_len <= 0 || range_parts <= 0 ||
+       (range_size > 0 && range_len * range_parts > range_size) || !parse_target(argv[optind])){
+        fprintf(stderr,"usage: %s [-c conns] [-d seconds] [-H header] [-R size[:len[:parts]]] [-k] [-p pid] target path...\n",argv[0]);
+        return 1;
+    }
+    std::vector<const char*> paths(argv + optind + 1,argv + argc);
+    srand(1);
+
+    std::vector<conn> conns(count);
+    for(int i = 0;i < count;++i){
+        conns[i].fd = -1;
+        conns[i].next_path = i % paths.size();
+    }
+
+    double cpu_before = 0,cpu_after = 0;
+    unsigned long long switches_before = 0,switches_after = 0;
+    if(pid > 0 && !server_usage(pid,cpu_before,switches_before)){
+        fprintf(stderr,"cannot read /proc/%d\n",pid);
+        pid = 0;
+    }
+
+    std::vector<uint32_t> latencies;     //微秒
+    unsigned long long bytes = 0,errors = 0,non_2xx = 0;
+    uint64_t begin = now_ns();
+    uint64_t deadline = begin + duration * 1000000000ULL;
+    std::vector<struct pollfd> pfds(count);
+    while(now_ns() < deadline){
+        for(int i = 0;i < count;++i){
+            conn& c = conns[i];
+            if(c.fd < 0){
+                c.fd = connect_target();
+                if(c.fd < 0){
+                    ++errors;
+                    continue;
+                }
+                c.in.clear();
+                c.out.clear();
+            }
+            if(c.out.empty()){
+                //发下一个请求
+                c.out.append("GET ").append(paths[c.next_path]).append(" HTTP/1.1\r\nHost: load\r\n");
+                c.next_path = (c.next_path + 1) % paths.size();
+                if(range_size > 0){
+                    c.out.append("Range: bytes=");
+                    for(long long k = 0;k < range_parts;++k){
+                        //每段落在文件的一个分区内，各段不重叠
+                        long long slice = range_size / range_parts;
+                        long long off = slice * k + (slice > range_len ? (long long)(((unsigned long long)rand() << 16 ^ rand()) % (slice - range_len)) : 0);
+                        char spec[64];
+                        snprintf(spec,sizeof(spec),"%s%lld-%lld",k ? "," : "",off,off + range_len - 1);
+                        c.out.append(spec);
+                    }
+                    c.out.append("\r\n");
+                }
+                c.out.append(extra);
+                c.out.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+                c.out_off = 0;
+                c.start_ns = now_ns();
+            }
+            pfds[i].fd = c.fd;
+            pfds[i].events = c.out_off < c.out.size() ? POLLOUT : POLLIN;
+            pfds[i].revents = 0;
+        }
+        if(poll(&pfds[0],count,100) < 0 && errno != EINTR){
+            perror("poll");
+            return 1;
+        }
+        for(int i = 0;i < count;++i){
+            conn& c = conns[i];
+            if(c.fd < 0 || !pfds[i].revents){
+                continue;
+            }
+            bool failed = false;
+            if(pfds[i].revents & POLLOUT){
+                ssize_t n = send(c.fd,c.out.data() + c.out_off,c.out.size() - c.out_off,MSG_NOSIGNAL);
+                if(n < 0){
+                    failed = errno != EAGAIN && errno != EINTR;
+                }else{
+                    c.out_off += n;
+                }
+            }else{
+                char buf[65536];
+                ssize_t n = recv(c.fd,buf,sizeof(buf),MSG_DONTWAIT);
+                if(n > 0){
+                    c.in.append(buf,n);
+                }else if(n == 0 || (errno != EAGAIN && errno != EINTR)){
+                    failed = true;
+                }
+                int status = 0;
+                bool close_after = false;
+                long long total = failed ? 0 : response_length(c.in,status,close_after);
+                if(total < 0){
+                    fprintf(stderr,"response without Content-Length\n");
+                    return 1;
+                }
+                if(total > 0){
+                    latencies.push_back((now_ns() - c.start_ns) / 1000);
+                    bytes += total;
+                    if(status < 200 || status >= 300){
+                        ++non_2xx;
+                    }
+                    c.in.erase(0,total);
+                    c.out.clear();
+                    if(close_after || !keep_alive){
+                        close(c.fd);
+                        c.fd = -1;
+                    }
+                }
+            }
+            if(failed){
+                ++errors;
+                close(c.fd);
+                c.fd = -1;
+            }
+        }
+    }
+    double elapsed = (now_ns() - begin) / 1e9;
+    if(pid > 0){
+        server_usage(pid,cpu_after,switches_after);
+    }
+    for(int i = 0;i < count;++i){
+        if(conns[i].fd >= 0){
+            close(conns[i].fd);
+        }
+    }
+
+    std::sort(latencies.begin(),latencies.end());
+    size_t done = latencies.size();
+    printf("%zu requests in %.1fs, %.0f req/s, %.1f MB/s, %llu errors, %llu non-2xx\n",done,elapsed,done / elapsed,
+           bytes / elapsed / 1e6,errors,non_2xx);
+    if(done > 0){
+        printf("latency us: p50 %u p90 %u p99 %u p99.9 %u max %u\n",latencies[done / 2],latencies[done * 9 / 10],
+               latencies[done * 99 / 100],latencies[done * 999 / 1000],latencies.back());
+    }
+    if(pid > 0 && done > 0){
+        printf("server: %.0f%% CPU, %.0f us CPU/request, %.2f context switches/request\n",(cpu_after - cpu_before) / elapsed * 100,
+               (cpu_after - cpu_before) / done * 1e6,(double)(switches_after - switches_before) / done);
+    }
+    return 0;
+}
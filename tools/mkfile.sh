@@ -0,0 +1,20 @@
+#!/bin/sh
+#生成压测用的大文件，这些文件不放进仓库，需要时现场生成。
+#内容是随机数据，不会被gzip缓存压小，也不是读出来全是零页的稀疏文件。
+#用法：tools/mkfile.sh size_mb [path]，默认写到 resources/big.bin
+#  例如 tools/mkfile.sh 2048 resources/huge.bin 生成2GB的文件用于Range压测
+set -e
+if [ $# -lt 1 ]; then
+    echo "usage: $0 size_mb [path]" >&2
+    exit 1
+fi
+size=$1
+path=${2:-$(dirname "$0")/../resources/big.bin}
+#已经是这个大小就不重新生成
+if [ -f "$path" ] && [ "$(stat -c %s "$path")" -eq $((size * 1024 * 1024)) ]; then
+    echo "$path already exists"
+    exit 0
+fi
+head -c $((size * 1024 * 1024)) /dev/urandom > "$path.tmp"
+mv "$path.tmp" "$path"
+echo "$path: $size MB"
@@ -0,0 +1,561 @@
+//回放服务器用-C记录下的请求流量，报告吞吐量和延迟分布。
+//每个记录下来的连接对应一个新连接，数据按原来的分段、顺序和时间间隔发送（可以加速），
+//记录时在上一个响应发送完之后才到达的数据，回放时也等收到对应的响应之后再发送（并且不早于计划时间），
+//记录中在响应之前就到达的数据（流水线）照样提前发送。延迟是请求的最后一个字节写进socket到收到完整响应的时间。
+//用法：replay [-h host] [-s speed] port capture.pid [more ...]
+//  -s 回放速度的倍数，默认1按原来的节奏；2表示间隔缩短一半；0表示不等待，所有数据尽快发出
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "../capture.h"
+
+static const int DRAIN_TIMEOUT_MS = 10000;  //所有数据发出之后等待剩余响应的最长时间
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//回放的一个动作：建立连接、发送数据或者关闭连接
+struct action{
+    uint64_t at;        //相对于第一条记录的纳秒
+    int conn;
+    int type;
+    int after;          //记录这段数据时这个连接已经发送完的响应数，回放时收到这么多响应之后才发送
+    std::string data;
+};
+
+static bool earlier(const action& a,const action& b){
+    return a.at < b.at;
+}
+
+//在发送的数据中找出每个请求的结尾，在收到的数据中找出每个响应的结尾
+struct conn_state{
+    int fd;
+    bool connected;
+    bool closing;           //记录中这个连接已经关闭，收完响应就关闭
+    bool dead;              //连接已经关闭或者出错
+    bool untracked;         //发送的数据无法按HTTP/1.1请求解析（例如HTTP/2），不统计延迟
+
+    std::string out;        //还没写进socket的数据
+    uint64_t queued;        //加入out的总字节数
+    uint64_t sent;          //写进socket的总字节数
+    std::string req_buf;    //还没有凑成完整请求的发送数据
+    struct request_end{
+        uint64_t offset;    //请求最后一个字节之后在发送数据中的位置
+        bool head;
+    };
+    std::deque<request_end> ends;
+    struct inflight{
+        uint64_t sent_ns;
+        bool head;
+    };
+    std::deque<inflight> waiting;   //已经发出、还没有收到响应的请求
+    std::string in;         //还没有凑成完整响应的接收数据
+    int responses;          //收到的完整响应数
+    std::deque<const action*> held;     //到了计划时间但还在等响应的数据
+
+    conn_state():fd(-1),connected(false),closing(false),dead(true),untracked(false),queued(0),sent(0),responses(0){}
+};
+
+struct totals{
+    std::vector<uint64_t> latencies;
+    unsigned long long status[6];   //按状态码的百位计数
+    unsigned long long connect_errors;
+    unsigned long long reset;       //服务器关闭连接时还有没收到响应的请求
+    unsigned long long unanswered;  //回放结束时仍没有响应的请求
+    unsigned long long dropped;     //连接已经关闭、发不出去的字节
+    uint64_t max_lag;               //动作比计划晚执行的最大时间
+    uint64_t first_send;
+    uint64_t last_response;
+};
+
+static bool load(const char* path,int file_index,std::vector<action>& actions){
+    FILE* f = fopen(path,"rb");
+    if(!f){
+        perror(path);
+        return false;
+    }
+    traffic_capture::file_header header;
+    if(fread(&header,sizeof(header),1,f) != 1 || memcmp(header.magic,"HTCAPT01",8) != 0){
+        fprintf(stderr,"%s: not a capture file\n",path);
+        fclose(f);
+        return false;
+    }
+    std::map<uint32_t,int> responses;
+    traffic_capture::record rec;
+    while(fread(&rec,sizeof(rec),1,f) == 1){
+        if(rec.type == traffic_capture::REC_RESPONSE){
+            ++responses[rec.conn];
+            continue;
+        }
+        action a;
+        a.at = rec.ns;
+        //不同进程的连接编号各自独立，文件序号放在高位
+        a.conn = (file_index << 24) | (int)rec.conn;
+        a.type = rec.type;
+        a.after = responses[rec.conn];
+        if(rec.len){
+            a.data.resize(rec.len);
+            if(fread(&a.data[0],1,rec.len,f) != rec.len){
+                break;
+            }
+        }
+        actions.push_back(a);
+    }
+    fclose(f);
+    return true;
+}
+
+//请求头中的一个字段的值，没有则返回false
+static bool header_value(const std::string& head,const char* name,std::string& value){
+    size_t name_len = strlen(name);
+    size_t pos = head.find("\r\n");
+    while(pos != std::string::npos && pos + 2 < head.size()){
+        size_t line = pos + 2;
+        size_t end = head.find("\r\n",line);
+        if(end == std::string::npos){
+            end = head.size();
+        }
+        if(end - line > name_len && head[line + name_len] == ':' && strncasecmp(head.c_str() + line,name,name_len) == 0){
+            size_t v = line + name_len + 1;
+            while(v < end && (head[v] == ' ' || head[v] == '\t')){
+                ++v;
+            }
+            value = head.substr(v,end - v);
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+//新加入发送队列的数据中完整请求的结尾
+static void scan_requests(conn_state& c,const std::string& data){
+    if(c.untracked){
+        return;
+    }
+    c.req_buf.append(data);
+    uint64_t base = c.queued - c.req_buf.size();
+    size_t start = 0;
+    while(true){
+        size_t head_end = c.req_buf.find("\r\n\r\n",start);
+        if(head_end == std::string::npos){
+            break;
+        }
+        std::string head = c.req_buf.substr(start,head_end - start);
+        if(head.compare(0,3,"PRI") == 0){
+            c.untracked = true;
+            c.req_buf.clear();
+            return;
+        }
+        std::string value;
+        if(header_value(head,"Transfer-Encoding",value)){
+            //分块的请求体不统计
+            c.untracked = true;
+            c.req_buf.clear();
+            return;
+        }
+        size_t body = header_value(head,"Content-Length",value) ? strtoul(value.c_str(),NULL,10) : 0;
+        size_t end = head_end + 4 + body;
+        if(end > c.req_buf.size()){
+            break;
+        }
+        conn_state::request_end r;
+        r.offset = base + end;
+        r.head = head.compare(0,5,"HEAD ") == 0;
+        c.ends.push_back(r);
+        start = end;
+    }
+    c.req_buf.erase(0,start);
+}
+
+//分块编码的响应体从start开始，完整时返回true并给出结尾
+static bool chunked_end(const std::string& s,size_t start,size_t& end){
+    size_t pos = start;
+    while(true){
+        size_t line_end = s.find("\r\n",pos);
+        if(line_end == std::string::npos){
+            return false;
+        }
+        unsigned long size = strtoul(s.c_str() + pos,NULL,16);
+        pos = line_end + 2;
+        if(size == 0){
+            //跳过尾部字段，直到空行
+            while(true){
+                line_end = s.find("\r\n",pos);
+                if(line_end == std::string::npos){
+                    return false;
+                }
+                bool empty = line_end == pos;
+                pos = line_end + 2;
+                if(empty){
+                    end = pos;
+                    return true;
+                }
+            }
+        }
+        pos += size + 2;
+        if(pos > s.size()){
+            return false;
+        }
+    }
+}
+
+//从接收的数据中取出完整的响应。eof为true时服务器已经关闭连接，没有长度的响应到此结束
+static void scan_responses(conn_state& c,totals& t,bool eof){
+    uint64_t now = now_ns();
+    size_t start = 0;
+    while(!c.waiting.empty()){
+        size_t head_end = c.in.find("\r\n\r\n",start);
+        if(head_end == std::string::npos){
+            break;
+        }
+        std::string head = c.in.substr(start,head_end - start);
+        int status = head.size() > 12 ? atoi(head.c_str() + 9) : 0;
+        size_t body_start = head_end + 4;
+        if(status >= 100 && status < 200){
+            start = body_start;
+            continue;
+        }
+        size_t end;
+        std::string value;
+        if(c.waiting.front().head || status == 204 || status == 304){
+            end = body_start;
+        }else if(header_value(head,"Transfer-Encoding",value) && strcasecmp(value.c_str(),"chunked") == 0){
+            if(!chunked_end(c.in,body_start,end)){
+                break;
+            }
+        }else if(header_value(head,"Content-Length",value)){
+            end = body_start + strtoull(value.c_str(),NULL,10);
+            if(end > c.in.size()){
+                break;
+            }
+        }else if(eof){
+            end = c.in.size();
+        }else{
+            break;
+        }
+        t.latencies.push_back(now - c.waiting.front().sent_ns);
+        ++t.status[status >= 100 && status < 600 ? status / 100 : 0];
+        t.last_response = now;
+        c.waiting.pop_front();
+        ++c.responses;
+        start = end;
+    }
+    c.in.erase(0,start);
+}
+
+static void close_conn(int epollfd,conn_state& c,totals& t){
+    if(c.fd >= 0){
+        epoll_ctl(epollfd,EPOLL_CTL_DEL,c.fd,NULL);
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.dead = true;
+    t.reset += c.waiting.size();
+    c.waiting.clear();
+    t.dropped += c.out.size();
+    c.out.clear();
+    for(size_t i = 0;i < c.held.size();++i){
+        t.dropped += c.held[i]->data.size();
+    }
+    c.held.clear();
+}
+
+//发送的数据和等待中的请求都已经处理完
+static bool finished(const conn_state& c){
+    return c.out.empty() && c.waiting.empty() && c.ends.empty() && c.held.empty();
+}
+
+//尽量多地发送，写进socket的请求开始计时
+static void flush_out(int epollfd,conn_state& c,totals& t){
+    while(!c.out.empty()){
+        ssize_t n = send(c.fd,c.out.data(),c.out.size(),MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            close_conn(epollfd,c,t);
+            return;
+        }
+        c.out.erase(0,n);
+        c.sent += n;
+        uint64_t now = now_ns();
+        if(t.first_send == 0){
+            t.first_send = now;
+        }
+        while(!c.ends.empty() && c.ends.front().offset <= c.sent){
+            conn_state::inflight w;
+            w.sent_ns = now;
+            w.head = c.ends.front().head;
+            c.waiting.push_back(w);
+            c.ends.pop_front();
+        }
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if(!c.out.empty()){
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.u64 = 0;
+    ev.data.fd = c.fd;
+    epoll_ctl(epollfd,EPOLL_CTL_MOD,c.fd,&ev);
+}
+
+//把数据加入发送队列
+static void queue_data(int epollfd,conn_state& c,totals& t,const std::string& data){
+    c.out.append(data);
+    c.queued += data.size();
+    scan_requests(c,data);
+    if(c.connected){
+        flush_out(epollfd,c,t);
+    }
+}
+
+//收到了足够的响应，发送等待中的数据
+static void release_held(int epollfd,conn_state& c,totals& t){
+    while(!c.dead && !c.held.empty() && c.held.front()->after <= c.responses){
+        const action* a = c.held.front();
+        c.held.pop_front();
+        queue_data(epollfd,c,t,a->data);
+    }
+}
+
+static void print_report(totals& t,size_t connections){
+    std::vector<uint64_t>& l = t.latencies;
+    std::sort(l.begin(),l.end());
+    double seconds = t.last_response > t.first_send ? (t.last_response - t.first_send) / 1e9 : 0;
+    printf("connections   %zu\n",connections);
+    printf("responses     %zu in %.3fs, %.0f req/s\n",l.size(),seconds,seconds > 0 ? l.size() / seconds : 0.0);
+    printf("status        1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+           t.status[1],t.status[2],t.status[3],t.status[4],t.status[5],t.status[0]);
+    printf("errors        connect %llu, closed with requests pending %llu, unanswered %llu, bytes not sent %llu\n",
+           t.connect_errors,t.reset,t.unanswered,t.dropped);
+    printf("max lag       %.3fms behind schedule\n",t.max_lag / 1e6);
+    if(l.empty()){
+        return;
+    }
+    const double points[] = {0.5,0.9,0.99,0.999};
+    printf("latency (us)  min %.1f",l.front() / 1e3);
+    for(size_t i = 0;i < sizeof(points) / sizeof(points[0]);++i){
+        size_t idx = std::min(l.size() - 1,(size_t)(l.size() * points[i]));
+        printf(", p%g %.1f",points[i] * 100,l[idx] / 1e3);
+    }
+    printf(", max %.1f\n",l.back() / 1e3);
+}
+
+int main(int argc,char* argv[]){
+    const char* host = "127.0.0.1";
+    double speed = 1;
+    int opt;
+    while((opt = getopt(argc,argv,"h:s:")) != -1){
+        switch(opt){
+            case 'h':
+                host = optarg;
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if(argc - optind < 2 || speed < 0){
+        fprintf(stderr,"usage: %s [-h host] [-s speed] port capture [more ...]\n",argv[0]);
+        return 1;
+    }
+    struct sockaddr_in address;
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(argv[optind]));
+    if(inet_pton(AF_INET,host,&address.sin_addr) != 1){
+        fprintf(stderr,"invalid host %s\n",host);
+        return 1;
+    }
+
+    std::vector<action> actions;
+    for(int i = optind + 1;i < argc;++i){
+        if(!load(argv[i],i - optind - 1,actions)){
+            return 1;
+        }
+    }
+    if(actions.empty()){
+        fprintf(stderr,"no records\n");
+        return 1;
+    }
+    //多个文件的时间都是同一台机器上的CLOCK_MONOTONIC，合并后按时间排序，同一连接的顺序不变
+    std::stable_sort(actions.begin(),actions.end(),earlier);
+    uint64_t origin = actions.front().at;
+    for(size_t i = 0;i < actions.size();++i){
+        actions[i].at = speed > 0 ? (uint64_t)((actions[i].at - origin) / speed) : 0;
+    }
+
+    int epollfd = epoll_create1(0);
+    std::map<int,conn_state> conns;         //按记录中的连接编号
+    std::map<int,int> by_fd;                //socket到连接编号
+    totals t;
+    memset(t.status,0,sizeof(t.status));
+    t.connect_errors = t.reset = t.unanswered = t.dropped = 0;
+    t.max_lag = t.first_send = t.last_response = 0;
+
+    uint64_t start = now_ns();
+    size_t next = 0;
+    uint64_t drain_deadline = 0;
+    epoll_event events[256];
+    while(true){
+        uint64_t now = now_ns();
+        //执行所有到期的动作
+        while(next < actions.size() && start + actions[next].at <= now){
+            action& a = actions[next++];
+            t.max_lag = std::max(t.max_lag,now - start - a.at);
+            conn_state& c = conns[a.conn];
+            if(a.type == traffic_capture::REC_OPEN){
+                //编号重复（不应该出现）时忽略
+                if(!c.dead || c.fd >= 0){
+                    continue;
+                }
+                c.fd = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK,0);
+                c.dead = false;
+                int one = 1;
+                setsockopt(c.fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+                if(connect(c.fd,(struct sockaddr*)&address,sizeof(address)) < 0 && errno != EINPROGRESS){
+                    ++t.connect_errors;
+                    close(c.fd);
+                    c.fd = -1;
+                    c.dead = true;
+                    continue;
+                }
+                struct epoll_event ev;
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.u64 = 0;
+                ev.data.fd = c.fd;
+                epoll_ctl(epollfd,EPOLL_CTL_ADD,c.fd,&ev);
+                by_fd[c.fd] = a.conn;
+            }else if(a.type == traffic_capture::REC_DATA){
+                if(c.dead || c.fd < 0){
+                    t.dropped += a.data.size();
+                    continue;
+                }
+                if(!c.held.empty() || a.after > c.responses){
+                    c.held.push_back(&a);
+                }else{
+                    queue_data(epollfd,c,t,a.data);
+                }
+            }else if(a.type == traffic_capture::REC_CLOSE){
+                c.closing = true;
+                if(!c.dead && finished(c)){
+                    by_fd.erase(c.fd);
+                    close_conn(epollfd,c,t);
+                }
+            }
+        }
+
+        if(next == actions.size()){
+            if(drain_deadline == 0){
+                drain_deadline = now + DRAIN_TIMEOUT_MS * 1000000ULL;
+            }
+            //所有动作已经执行完，等待剩余的响应；记录里没有关闭的连接也算完成
+            bool pending = false;
+            for(std::map<int,int>::iterator it = by_fd.begin();it != by_fd.end() && !pending;++it){
+                conn_state& c = conns[it->second];
+                pending = !finished(c);
+            }
+            if(!pending || now >= drain_deadline){
+                break;
+            }
+        }
+
+        int timeout = -1;
+        if(next < actions.size()){
+            uint64_t due = start + actions[next].at;
+            timeout = due > now ? (int)((due - now) / 1000000) : 0;
+        }else{
+            timeout = (int)((drain_deadline - now) / 1000000);
+        }
+        int num = epoll_wait(epollfd,events,256,timeout);
+        for(int i = 0;i < num;++i){
+            std::map<int,int>::iterator found = by_fd.find(events[i].data.fd);
+            if(found == by_fd.end()){
+                continue;
+            }
+            conn_state& c = conns[found->second];
+            if(!c.connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))){
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd,SOL_SOCKET,SO_ERROR,&err,&len);
+                if(err){
+                    ++t.connect_errors;
+                    by_fd.erase(found);
+                    close_conn(epollfd,c,t);
+                    continue;
+                }
+                c.connected = true;
+            }
+            if(events[i].events & EPOLLOUT){
+                flush_out(epollfd,c,t);
+                if(c.dead){
+                    by_fd.erase(found);
+                    continue;
+                }
+            }
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                char buf[65536];
+                bool eof = false;
+                while(true){
+                    ssize_t n = recv(c.fd,buf,sizeof(buf),0);
+                    if(n > 0){
+                        c.in.append(buf,n);
+                        continue;
+                    }
+                    if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+                        eof = true;
+                    }
+                    break;
+                }
+                scan_responses(c,t,eof);
+                if(!eof){
+                    release_held(epollfd,c,t);
+                }
+                if(c.dead){
+                    by_fd.erase(found);
+                }else if(eof){
+                    by_fd.erase(found);
+                    close_conn(epollfd,c,t);
+                }else if(c.closing && finished(c)){
+                    by_fd.erase(found);
+                    close_conn(epollfd,c,t);
+                }
+            }
+        }
+    }
+
+    for(std::map<int,int>::iterator it = by_fd.begin();it != by_fd.end();++it){
+        conn_state& c = conns[it->second];
+        t.unanswered += c.waiting.size() + c.ends.size();
+        c.waiting.clear();
+        c.ends.clear();
+        close_conn(epollfd,c,t);
+    }
+    close(epollfd);
+    print_report(t,conns.size());
+    return 0;
+}
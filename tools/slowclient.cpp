@@ -0,0 +1,300 @@
+//模拟慢客户端，检查服务器的最低传输速率（-m）是否按预期断开它们，同时不误伤正常的客户端。
+//每种慢客户端各建立n个连接：
+//  header  slowloris，请求头每隔interval只发一个字节，永远不发结尾的空行
+//  body    请求头完整，Content-Length: 1000（放得进服务器的读缓冲区），请求体每隔interval只发一个字节
+//  read    请求一个大文件（-f），接收缓冲区设得很小并且从不读，服务器的发送缓冲区一直是满的
+//另外有一个正常的长连接每隔100ms请求一次/healthz，它应该一直不被断开。
+//结束时按种类报告被断开的连接数和从建立连接到被断开的时间，最后打印服务器/status中的计数。
+//用法：slowclient [-h host] [-n conns] [-i interval_ms] [-d seconds] [-f path] port
+//  服务器例如用 -m 100:5 启动，被断开的时间应该在一两个窗口（5到10秒）左右
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const int CONTROL_INTERVAL_MS = 100;
+
+enum KIND{
+    SLOW_HEADER = 0,
+    SLOW_BODY,
+    SLOW_READ,
+    CONTROL,
+    KIND_COUNT
+};
+static const char* kind_names[KIND_COUNT] = {"header","body","read","control"};
+
+struct client{
+    int kind;
+    int fd;
+    uint64_t start_ns;
+    uint64_t closed_ns;     //被服务器断开的时间，0表示还连着
+    uint64_t next_ns;       //下一次发送的时间
+    std::string in;         //正常客户端还没凑成完整响应的数据
+    bool waiting;           //正常客户端已经发出请求，在等响应
+};
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_to(const struct sockaddr_in& address,int rcvbuf){
+    int fd = socket(AF_INET,SOCK_STREAM,0);
+    if(fd < 0){
+        return -1;
+    }
+    //接收缓冲区要在connect之前设置才会影响通告的窗口
+    if(rcvbuf > 0){
+        setsockopt(fd,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+    }
+    int one = 1;
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    if(connect(fd,(struct sockaddr*)&address,sizeof(address)) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd,const std::string& s){
+    return send(fd,s.data(),s.size(),MSG_NOSIGNAL) == (ssize_t)s.size();
+}
+
+//正常客户端收到完整响应（只有Content-Length的响应）时返回true
+static bool response_complete(client& c){
+    size_t head_end = c.in.find("\r\n\r\n");
+    if(head_end == std::string::npos){
+        return false;
+    }
+    size_t body = 0;
+    const char* p = strcasestr(c.in.c_str(),"Content-Length:");
+    if(p && p < c.in.c_str() + head_end){
+        body = strtoul(p + 15,NULL,10);
+    }
+    if(c.in.size() < head_end + 4 + body){
+        return false;
+    }
+    c.in.erase(0,head_end + 4 + body);
+    return true;
+}
+
+//用一个新连接请求/status，打印响应体
+static void print_status(const struct sockaddr_in& address){
+    int fd = connect_to(address,0);
+    if(fd < 0 || !send_all(fd,"GET /status HTTP/1.1\r\nConnection: close\r\n\r\n")){
+        printf("status: request failed\n");
+        if(fd >= 0){
+            close(fd);
+        }
+        return;
+    }
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while((n = recv(fd,buf,sizeof(buf),0)) > 0){
+        out.append(buf,n);
+    }
+    close(fd);
+    size_t body = out.find("\r\n\r\n");
+    printf("status: %s",body == std::string::npos ? "no response\n" : out.c_str() + body + 4);
+}
+
+int main(int argc,char* argv[]){
+    const char* host = "127.0.0.1";
+    const char* path = "/";
+    int count = 4;
+    int interval_ms = 1000;
+    int duration = 30;
+    int opt;
+    while((opt = getopt(argc,argv,"h:n:i:d:f:")) != -1){
+        switch(opt){
+            case 'h':
+                host = optarg;
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'i':
+                interval_ms = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if(argc - optind != 1 || count <= 0 || interval_ms <= 0 || duration <= 0){
+        fprintf(stderr,"usage: %s [-h host] [-n conns] [-i interval_ms] [-d seconds] [-f path] port\n",argv[0]);
+        return 1;
+    }
+    struct sockaddr_in address;
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(argv[optind]));
+    if(inet_pton(AF_INET,host,&address.sin_addr) != 1){
+        fprintf(stderr,"invalid host %s\n",host);
+        return 1;
+    }
+
+    std::vector<client> clients;
+    for(int kind = 0;kind < KIND_COUNT;++kind){
+        for(int i = 0;i < (kind == CONTROL ? 1 : count);++i){
+            client c;
+            c.kind = kind;
+            c.fd = connect_to(address,kind == SLOW_READ ? 4096 : 0);
+            if(c.fd < 0){
+                perror("connect");
+                return 1;
+            }
+            c.start_ns = c.next_ns = now_ns();
+            c.closed_ns = 0;
+            c.waiting = false;
+            bool ok = true;
+            if(kind == SLOW_HEADER){
+                ok = send_all(c.fd,"GET / HTTP/1.1\r\n");
+            }else if(kind == SLOW_BODY){
+                ok = send_all(c.fd,"POST / HTTP/1.1\r\nContent-Length: 1000\r\n\r\n");
+            }else if(kind == SLOW_READ){
+                ok = send_all(c.fd,std::string("GET ") + path + " HTTP/1.1\r\nConnection: keep-alive\r\n\r\n");
+            }
+            if(!ok){
+                perror("send");
+                return 1;
+            }
+            clients.push_back(c);
+        }
+    }
+
+    unsigned long long control_ok = 0,control_failed = 0;
+    uint64_t deadline = now_ns() + duration * 1000000000ULL;
+    std::vector<struct pollfd> pfds(clients.size());
+    while(now_ns() < deadline){
+        uint64_t now = now_ns();
+        uint64_t wake = now + 100000000ULL;     //最早的下一次发送时间
+        bool slow_left = false;
+        for(size_t i = 0;i < clients.size();++i){
+            client& c = clients[i];
+            pfds[i].fd = c.closed_ns ? -1 : c.fd;
+            pfds[i].events = POLLRDHUP | (c.kind == SLOW_READ ? 0 : POLLIN);
+            pfds[i].revents = 0;
+            if(c.closed_ns || now < c.next_ns){
+                slow_left |= !c.closed_ns && c.kind != CONTROL;
+                continue;
+            }
+            slow_left |= c.kind != CONTROL;
+            bool ok = true;
+            if(c.kind == SLOW_HEADER){
+                ok = send_all(c.fd,"X");
+                c.next_ns = now + interval_ms * 1000000ULL;
+            }else if(c.kind == SLOW_BODY){
+                ok = send_all(c.fd,"x");
+                c.next_ns = now + interval_ms * 1000000ULL;
+            }else if(c.kind == CONTROL && !c.waiting){
+                ok = send_all(c.fd,"GET /healthz HTTP/1.1\r\nConnection: keep-alive\r\n\r\n");
+                c.waiting = true;
+                c.next_ns = now + CONTROL_INTERVAL_MS * 1000000ULL;
+            }
+            if(!ok){
+                c.closed_ns = now;
+            }
+        }
+        for(size_t i = 0;i < clients.size();++i){
+            if(!clients[i].closed_ns && (clients[i].kind != SLOW_READ)){
+                wake = std::min(wake,clients[i].next_ns);
+            }
+        }
+        if(!slow_left){
+            break;
+        }
+        int timeout = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        if(poll(&pfds[0],pfds.size(),timeout) < 0 && errno != EINTR){
+            perror("poll");
+            return 1;
+        }
+        now = now_ns();
+        for(size_t i = 0;i < clients.size();++i){
+            client& c = clients[i];
+            if(c.closed_ns || !pfds[i].revents){
+                continue;
+            }
+            bool closed = (pfds[i].revents & (POLLERR | POLLHUP | POLLRDHUP)) != 0;
+            if(!closed && (pfds[i].revents & POLLIN)){
+                char buf[4096];
+                ssize_t n = recv(c.fd,buf,sizeof(buf),MSG_DONTWAIT);
+                if(n > 0){
+                    c.in.append(buf,n);
+                }else if(n == 0 || (errno != EAGAIN && errno != EINTR)){
+                    closed = true;
+                }
+            }
+            if(c.kind == CONTROL){
+                if(!closed && c.waiting && response_complete(c)){
+                    ++control_ok;
+                    c.waiting = false;
+                }
+                if(closed){
+                    //正常客户端被断开，重新连接继续
+                    ++control_failed;
+                    close(c.fd);
+                    c.fd = connect_to(address,0);
+                    c.in.clear();
+                    c.waiting = false;
+                    if(c.fd < 0){
+                        perror("connect");
+                        return 1;
+                    }
+                }
+                continue;
+            }
+            if(closed){
+                c.closed_ns = now;
+            }
+        }
+    }
+
+    for(int kind = 0;kind < CONTROL;++kind){
+        std::vector<double> seconds;
+        int total = 0;
+        for(size_t i = 0;i < clients.size();++i){
+            if(clients[i].kind != kind){
+                continue;
+            }
+            ++total;
+            if(clients[i].closed_ns){
+                seconds.push_back((clients[i].closed_ns - clients[i].start_ns) / 1e9);
+            }
+        }
+        std::sort(seconds.begin(),seconds.end());
+        if(seconds.empty()){
+            printf("%-7s evicted 0/%d\n",kind_names[kind],total);
+        }else{
+            printf("%-7s evicted %d/%d after min %.1fs median %.1fs max %.1fs\n",kind_names[kind],(int)seconds.size(),total,
+                   seconds.front(),seconds[seconds.size() / 2],seconds.back());
+        }
+    }
+    printf("%-7s %llu responses, %llu disconnects\n",kind_names[CONTROL],control_ok,control_failed);
+    for(size_t i = 0;i < clients.size();++i){
+        if(clients[i].fd >= 0){
+            close(clients[i].fd);
+        }
+    }
+    print_status(address);
+    return 0;
+}
@@ -0,0 +1,154 @@
+//测试反向代理用的上游服务器：HTTP/1.1长连接，每个连接一个线程。
+//没有请求体的请求回复size字节的响应体；带请求体（Content-Length）的请求把请求体原样回复，用来检查方法和请求体的转发。
+//-d让每个响应延迟若干毫秒，模拟慢上游，检查-R的转发名额。
+//用法：stub_upstream [-s size] [-d delay_ms] port|unix:/path
+//  例如 stub_upstream -s 1024 9000，服务器用 -P /api/=127.0.0.1:9000 转发，
+//  再用tools/load分别压测 127.0.0.1:9000/api/x（直连）和服务器的 /api/x（经过代理）
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <strings.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static std::string body;
+static int delay_ms = 0;
+
+static bool send_all(int fd,const char* data,size_t len){
+    while(len > 0){
+        ssize_t n = send(fd,data,len,MSG_NOSIGNAL);
+        if(n <= 0){
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void* serve(void* arg){
+    int fd = (int)(long)arg;
+    std::string in;
+    char buf[65536];
+    bool open = true;
+    while(open){
+        size_t head_end;
+        while((head_end = in.find("\r\n\r\n")) == std::string::npos){
+            ssize_t n = recv(fd,buf,sizeof(buf),0);
+            if(n <= 0){
+                close(fd);
+                return NULL;
+            }
+            in.append(buf,n);
+        }
+        std::string head = in.substr(0,head_end + 2);
+        size_t content_length = 0;
+        const char* p = strcasestr(head.c_str(),"\r\nContent-Length:");
+        if(p){
+            content_length = strtoul(p + 17,NULL,10);
+        }
+        while(in.size() < head_end + 4 + content_length){
+            ssize_t n = recv(fd,buf,sizeof(buf),0);
+            if(n <= 0){
+                close(fd);
+                return NULL;
+            }
+            in.append(buf,n);
+        }
+        open = strcasestr(head.c_str(),"\r\nConnection: close\r\n") == NULL;
+        if(delay_ms > 0){
+            usleep(delay_ms * 1000);
+        }
+        const char* data = content_length ? in.data() + head_end + 4 : body.data();
+        size_t len = content_length ? content_length : body.size();
+        char header[256];
+        int n = snprintf(header,sizeof(header),"HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                         "Content-Length: %zu\r\n%s\r\n",len,open ? "" : "Connection: close\r\n");
+        std::string out(header,n);
+        out.append(data,len);
+        if(!send_all(fd,out.data(),out.size())){
+            break;
+        }
+        in.erase(0,head_end + 4 + content_length);
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc,char* argv[]){
+    size_t size = 1024;
+    int opt;
+    while((opt = getopt(argc,argv,"s:d:")) != -1){
+        switch(opt){
+            case 's':
+                size = strtoul(optarg,NULL,10);
+                break;
+            case 'd':
+                delay_ms = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if(argc - optind != 1){
+        fprintf(stderr,"usage: %s [-s size] [-d delay_ms] port|unix:/path\n",argv[0]);
+        return 1;
+    }
+    body.assign(size,'x');
+    signal(SIGPIPE,SIG_IGN);
+
+    const char* spec = argv[optind];
+    int listenfd;
+    if(strncmp(spec,"unix:",5) == 0){
+        struct sockaddr_un address;
+        memset(&address,0,sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path,spec + 5,sizeof(address.sun_path) - 1);
+        unlink(address.sun_path);
+        listenfd = socket(AF_UNIX,SOCK_STREAM,0);
+        if(listenfd < 0 || bind(listenfd,(struct sockaddr*)&address,sizeof(address)) < 0){
+            perror("bind");
+            return 1;
+        }
+    }else{
+        struct sockaddr_in address;
+        memset(&address,0,sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(atoi(spec));
+        listenfd = socket(AF_INET,SOCK_STREAM,0);
+        int reuse = 1;
+        setsockopt(listenfd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse));
+        if(listenfd < 0 || bind(listenfd,(struct sockaddr*)&address,sizeof(address)) < 0){
+            perror("bind");
+            return 1;
+        }
+    }
+    if(listen(listenfd,128) < 0){
+        perror("listen");
+        return 1;
+    }
+    while(true){
+        int fd = accept(listenfd,NULL,NULL);
+        if(fd < 0){
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+        pthread_t tid;
+        if(pthread_create(&tid,NULL,serve,(void*)(long)fd) != 0){
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
@@ -0,0 +1,102 @@
+//把服务器导出的请求跟踪（-t选项，/trace或退出时保存的文件）转换成Chrome trace-event JSON，
+//用chrome://tracing或者Perfetto打开。每个请求一行，相邻两个时间点之间是一段：
+//  connect  建立连接到读到第一个字节（只有连接的第一个请求有）
+//  read     读请求
+//  queue    在线程池队列中等待
+//  parse    解析请求
+//  handle   路由、文件查找和打开
+//  respond  等待主线程开始发送
+//  send     发送响应
+//用法：trace2json trace.bin [more.bin ...] > trace.json
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+#include "../trace.h"
+
+static const char* span_names[tracer::EV_COUNT] = {
+    "connect","read","queue","parse","handle","respond","send",0
+};
+
+//一个请求各个时间点的时间和线程，没有记录的为0
+struct request_events{
+    uint64_t ns[tracer::EV_COUNT];
+    int thread[tracer::EV_COUNT];
+};
+
+static bool load(const char* path,std::map<std::pair<uint32_t,uint32_t>,request_events>& requests,uint64_t& origin){
+    FILE* f = fopen(path,"rb");
+    if(!f){
+        perror(path);
+        return false;
+    }
+    tracer::file_header header;
+    if(fread(&header,sizeof(header),1,f) != 1 || memcmp(header.magic,"HTTRACE1",8) != 0){
+        fprintf(stderr,"%s: not a trace file\n",path);
+        fclose(f);
+        return false;
+    }
+    tracer::record rec;
+    for(uint32_t i = 0;i < header.count && fread(&rec,sizeof(rec),1,f) == 1;++i){
+        if(rec.event >= tracer::EV_COUNT){
+            continue;
+        }
+        //不同的worker进程的请求编号各自独立
+        std::pair<uint32_t,uint32_t> key(header.pid,rec.id);
+        std::map<std::pair<uint32_t,uint32_t>,request_events>::iterator it = requests.find(key);
+        if(it == requests.end()){
+            request_events empty;
+            memset(&empty,0,sizeof(empty));
+            it = requests.insert(std::make_pair(key,empty)).first;
+        }
+        //同一个时间点记录了多次（例如请求分几次才读完）时保留第一次
+        if(it->second.ns[rec.event] == 0){
+            it->second.ns[rec.event] = rec.ns;
+            it->second.thread[rec.event] = rec.thread;
+        }
+        if(origin == 0 || rec.ns < origin){
+            origin = rec.ns;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc,char* argv[]){
+    if(argc < 2){
+        fprintf(stderr,"usage: %s trace.bin [more.bin ...] > trace.json\n",argv[0]);
+        return 1;
+    }
+    std::map<std::pair<uint32_t,uint32_t>,request_events> requests;
+    uint64_t origin = 0;
+    for(int i = 1;i < argc;++i){
+        if(!load(argv[i],requests,origin)){
+            return 1;
+        }
+    }
+
+    //时间以微秒为单位，从最早的事件开始计
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for(std::map<std::pair<uint32_t,uint32_t>,request_events>::iterator it = requests.begin();it != requests.end();++it){
+        const request_events& r = it->second;
+        int prev = -1;
+        for(int e = 0;e < tracer::EV_COUNT;++e){
+            if(r.ns[e] == 0){
+                continue;
+            }
+            //缓冲区被覆盖或者中途关闭的请求会缺少一些时间点，缺少的段合并到前一段中
+            if(prev >= 0 && r.ns[e] >= r.ns[prev]){
+                printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"args\":{\"thread\":%d}}",
+                       first ? "" : ",\n",span_names[prev],it->first.first,it->first.second,
+                       (r.ns[prev] - origin) / 1000.0,(r.ns[e] - r.ns[prev]) / 1000.0,r.thread[prev]);
+                first = false;
+            }
+            prev = e;
+        }
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,91 @@
+//请求的采样跟踪
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "trace.h"
+
+int tracer::m_every = 0;
+std::atomic<uint32_t> tracer::m_next_id(0);
+std::atomic<tracer::ring*> tracer::m_rings(0);
+std::atomic<int> tracer::m_thread_count(0);
+
+uint32_t tracer::sample(){
+    static __thread unsigned counter = 0;
+    if(m_every == 0 || ++counter % m_every != 0){
+        return 0;
+    }
+    uint32_t id = m_next_id.fetch_add(1,std::memory_order_relaxed) + 1;
+    //编号回绕时跳过0
+    return id ? id : m_next_id.fetch_add(1,std::memory_order_relaxed) + 1;
+}
+
+//本线程的缓冲区，第一次记录事件时分配并挂到全局链表上，线程退出后不释放
+tracer::ring* tracer::local(){
+    static __thread ring* r = 0;
+    if(!r){
+        r = new ring();
+        r->head = 0;
+        r->thread = (uint16_t)m_thread_count.fetch_add(1);
+        r->next = m_rings.load();
+        while(!m_rings.compare_exchange_weak(r->next,r)){
+        }
+    }
+    return r;
+}
+
+void tracer::record_event(uint32_t id,int event,uint64_t ns){
+    ring* r = local();
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    size_t slot = h & (RING_SIZE - 1);
+    r->ns[slot].store(ns,std::memory_order_relaxed);
+    r->tag[slot].store(((uint64_t)id << 32) | ((uint64_t)event << 16) | r->thread,std::memory_order_relaxed);
+    r->head.store(h + 1,std::memory_order_release);
+}
+
+std::string tracer::dump(){
+    std::vector<record> records;
+    for(ring* r = m_rings.load();r;r = r->next){
+        uint64_t end = r->head.load(std::memory_order_acquire);
+        uint64_t begin = end > (uint64_t)RING_SIZE ? end - RING_SIZE : 0;
+        size_t base = records.size();
+        for(uint64_t i = begin;i < end;++i){
+            size_t slot = i & (RING_SIZE - 1);
+            record rec;
+            rec.ns = r->ns[slot].load(std::memory_order_relaxed);
+            uint64_t tag = r->tag[slot].load(std::memory_order_relaxed);
+            rec.id = (uint32_t)(tag >> 32);
+            rec.event = (uint16_t)(tag >> 16);
+            rec.thread = (uint16_t)tag;
+            records.push_back(rec);
+        }
+        //读的过程中写线程又写了after个事件，最旧的那些槽可能已经被覆盖（最后一个可能写了一半）
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = r->head.load(std::memory_order_relaxed);
+        if(after + 1 > begin + RING_SIZE){
+            uint64_t stale = std::min<uint64_t>(after + 1 - RING_SIZE - begin,end - begin);
+            records.erase(records.begin() + base,records.begin() + base + stale);
+        }
+    }
+
+    file_header header;
+    memcpy(header.magic,"HTTRACE1",8);
+    header.pid = (uint32_t)getpid();
+    header.count = (uint32_t)records.size();
+    std::string out((const char*)&header,sizeof(header));
+    if(!records.empty()){
+        out.append((const char*)&records[0],sizeof(record) * records.size());
+    }
+    return out;
+}
+
+bool tracer::dump_file(const char* path){
+    std::string data = dump();
+    FILE* f = fopen(path,"wb");
+    if(!f){
+        return false;
+    }
+    bool ok = fwrite(data.data(),1,data.size(),f) == data.size();
+    return fclose(f) == 0 && ok;
+}
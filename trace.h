@@ -0,0 +1,80 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+//按采样记录单个请求经过的各个时间点，用来分析平均值看不出来的长尾延迟。
+//每个线程把事件写进自己的环形缓冲区，只有本线程写，不加锁；缓冲区满了覆盖最旧的事件。
+//导出为紧凑的二进制格式，用tools/trace2json转换成Chrome trace-event JSON（chrome://tracing或Perfetto打开）。
+//采样关闭时每个请求只多一次整数比较。
+class tracer{
+public:
+    //请求经过的时间点，按发生的先后排列
+    enum EVENT{
+        EV_ACCEPT = 0,      //建立连接（只记在连接的第一个请求上）
+        EV_FIRST_READ,      //读到请求的第一部分
+        EV_ENQUEUE,         //请求完整，提交给线程池
+        EV_DEQUEUE,         //工作线程开始处理
+        EV_PARSED,          //请求解析完
+        EV_LOOKUP,          //路由、文件查找和打开完成，响应已经确定
+        EV_FIRST_WRITE,     //发送出响应的第一个字节
+        EV_LAST_WRITE,      //响应发送完
+        EV_COUNT
+    };
+
+    //二进制文件的格式：文件头之后是count个record，按各线程分组，组内按时间排序。字节序为本机字节序
+    struct file_header{
+        char magic[8];      //"HTTRACE1"
+        uint32_t pid;
+        uint32_t count;
+    };
+    struct record{
+        uint64_t ns;        //CLOCK_MONOTONIC纳秒
+        uint32_t id;        //请求编号，从1开始
+        uint16_t event;
+        uint16_t thread;    //记录事件的线程编号
+    };
+
+    static const int RING_SIZE = 16384;     //每个线程保留的事件数，2的幂
+
+    //每every个请求采样一个，0表示关闭；启动时在创建线程之前设置
+    static void set_sample(int every){m_every = every > 0 ? every : 0;}
+    static bool enabled(){return m_every > 0;}
+
+    //新请求是否采样，采样时返回请求编号，否则返回0
+    static uint32_t sample();
+    static void record_event(uint32_t id,int event,uint64_t ns);
+    static void record_event(uint32_t id,int event){record_event(id,event,now_ns());}
+
+    static uint64_t now_ns(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    //所有线程缓冲区中现有的事件，二进制格式。可以在其他线程写入的同时调用，正在被覆盖的事件会被丢掉
+    static std::string dump();
+    //把dump()的内容写到文件
+    static bool dump_file(const char* path);
+
+private:
+    //一个事件占两个字：时间，以及编号、事件和线程。用原子变量让导出线程可以同时读
+    struct ring{
+        std::atomic<uint64_t> head;         //写入的事件总数
+        std::atomic<uint64_t> ns[RING_SIZE];
+        std::atomic<uint64_t> tag[RING_SIZE];
+        uint16_t thread;
+        ring* next;
+    };
+    static ring* local();
+
+    static int m_every;
+    static std::atomic<uint32_t> m_next_id;
+    static std::atomic<ring*> m_rings;
+    static std::atomic<int> m_thread_count;
+};
+
+#endif
@@ -0,0 +1,323 @@
+//不停机升级
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include "locker.h"
+#include "upgrade.h"
+
+//新进程从这个环境变量得到和旧进程通信的socket
+static const char* UPGRADE_FD_ENV = "HTTPSERVER_UPGRADE_FD";
+static const int MAX_LISTEN_FDS = 128;
+
+static char** saved_argv = NULL;
+//启动时的程序路径，升级时执行这个路径上的新文件。/proc/self/exe在文件被替换后仍然指向旧的程序
+static char exe_path[4096];
+static int ready_fd = -1;
+//旧进程：正在启动的新进程和等待它就绪的期限
+static pid_t child_pid = -1;
+static time_t ready_deadline = 0;
+
+//热点文件的请求次数，表满了之后只给已有的文件计数
+static std::unordered_map<std::string,unsigned> hot_counts;
+static locker hot_locker("upgrade.hot");
+
+void upgrade::save_args(char** argv){
+    ssize_t len = readlink("/proc/self/exe",exe_path,sizeof(exe_path) - 1);
+    if(len <= 0){
+        return;
+    }
+    exe_path[len] = '\0';
+    saved_argv = argv;
+}
+
+//关闭low及以上的所有文件描述符。fork之后调用，只用系统调用
+static void close_from(int low){
+#ifdef SYS_close_range
+    if(syscall(SYS_close_range,low,~0U,0) == 0){
+        return;
+    }
+#endif
+    //内核不支持close_range（5.9之前）时按/proc/self/fd列出的逐个关闭。边遍历边关闭会打乱目录的位置，
+    //每读一批就从头再读，直到没有可关的
+    int dir = open("/proc/self/fd",O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir < 0){
+        for(int fd = low;fd < 65536;++fd){
+            close(fd);
+        }
+        return;
+    }
+    bool closed = true;
+    while(closed){
+        closed = false;
+        char buf[4096];
+        long n;
+        lseek(dir,0,SEEK_SET);
+        while((n = syscall(SYS_getdents64,dir,buf,sizeof(buf))) > 0){
+            for(long off = 0;off < n;){
+                struct dirent64* d = (struct dirent64*)(buf + off);
+                off += d->d_reclen;
+                int fd = 0;
+                const char* p = d->d_name;
+                if(*p < '0' || *p > '9'){
+                    continue;
+                }
+                for(;*p >= '0' && *p <= '9';++p){
+                    fd = fd * 10 + (*p - '0');
+                }
+                if(fd >= low && fd != dir){
+                    close(fd);
+                    closed = true;
+                }
+            }
+        }
+    }
+    close(dir);
+}
+
+int upgrade::start(const int* listenfds,int n,const std::vector<std::string>& manifest){
+    if(!saved_argv || n <= 0 || n > MAX_LISTEN_FDS || child_pid > 0){
+        return -1;
+    }
+    int sv[2];
+    if(socketpair(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0,sv) < 0){
+        return -1;
+    }
+    //fork之后只做async-signal-safe的事情，环境变量在fork之前设置好。和旧进程通信的socket在新进程中是3号
+    setenv(UPGRADE_FD_ENV,"3",1);
+    pid_t pid = fork();
+    if(pid == 0){
+        //新进程只继承和旧进程通信的socket，监听socket通过它传递，客户端连接、上游连接和打开的文件一个都不继承
+        if(sv[1] == 3){
+            fcntl(3,F_SETFD,0);
+        }else if(dup2(sv[1],3) < 0){
+            _exit(127);
+        }
+        close_from(4);
+        execv(exe_path,saved_argv);
+        _exit(127);
+    }
+    unsetenv(UPGRADE_FD_ENV);
+    close(sv[1]);
+    if(pid < 0){
+        close(sv[0]);
+        return -1;
+    }
+
+    //一个字节的数据，监听socket放在控制消息中
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTEN_FDS)];
+    memset(control,0,sizeof(control));
+    char tag = 'L';
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cm),listenfds,sizeof(int) * n);
+    bool ok = sendmsg(sv[0],&msg,MSG_NOSIGNAL) == 1;
+
+    //预热清单每行一个路径，发送完关闭写端。清单最多MAX_MANIFEST行，新进程启动后先读完清单再预热，
+    //socket缓冲区放不下时也只等新进程启动的时间
+    std::string text;
+    for(size_t i = 0;i < manifest.size();++i){
+        text.append(manifest[i]).append("\n");
+    }
+    for(size_t off = 0;ok && off < text.size();){
+        ssize_t w = send(sv[0],text.data() + off,text.size() - off,MSG_NOSIGNAL);
+        if(w <= 0){
+            ok = false;
+            break;
+        }
+        off += w;
+    }
+    shutdown(sv[0],SHUT_WR);
+
+    child_pid = pid;
+    ready_deadline = time(NULL) + READY_TIMEOUT;
+    if(!ok){
+        cancel(sv[0]);
+        return -1;
+    }
+    return sv[0];
+}
+
+bool upgrade::finish(int fd){
+    char reply = 0;
+    bool ok = read(fd,&reply,1) == 1 && reply == 'R';
+    if(!ok){
+        cancel(fd);
+        return false;
+    }
+    close(fd);
+    //新进程继续运行，旧进程退出后由init接管
+    child_pid = -1;
+    return true;
+}
+
+bool upgrade::expired(){
+    return child_pid > 0 && time(NULL) >= ready_deadline;
+}
+
+void upgrade::cancel(int fd){
+    close(fd);
+    if(child_pid > 0){
+        kill(child_pid,SIGKILL);
+        waitpid(child_pid,NULL,0);
+        child_pid = -1;
+    }
+}
+
+bool upgrade::handoff(const int* listenfds,int n,const std::vector<std::string>& manifest){
+    int fd = start(listenfds,n,manifest);
+    if(fd < 0){
+        return false;
+    }
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd,1,READY_TIMEOUT * 1000) != 1){
+        cancel(fd);
+        return false;
+    }
+    return finish(fd);
+}
+
+int upgrade::inherit(int* listenfds,int max,std::vector<std::string>& manifest){
+    const char* value = getenv(UPGRADE_FD_ENV);
+    if(!value){
+        return 0;
+    }
+    int fd = atoi(value);
+    unsetenv(UPGRADE_FD_ENV);
+    fcntl(fd,F_SETFD,FD_CLOEXEC);
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTEN_FDS)];
+    char tag;
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(recvmsg(fd,&msg,MSG_CMSG_CLOEXEC) != 1 || tag != 'L'){
+        close(fd);
+        return 0;
+    }
+    int n = 0;
+    for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);cm;cm = CMSG_NXTHDR(&msg,cm)){
+        if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS){
+            continue;
+        }
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* fds = (int*)CMSG_DATA(cm);
+        for(int i = 0;i < count;++i){
+            if(n < max){
+                listenfds[n++] = fds[i];
+            }else{
+                close(fds[i]);
+            }
+        }
+    }
+
+    //读到旧进程关闭写端为止
+    std::string text;
+    char buf[4096];
+    ssize_t r;
+    while((r = read(fd,buf,sizeof(buf))) > 0){
+        text.append(buf,r);
+    }
+    size_t start = 0;
+    while(start < text.size()){
+        size_t end = text.find('\n',start);
+        if(end == std::string::npos){
+            break;
+        }
+        if(end > start){
+            manifest.push_back(text.substr(start,end - start));
+        }
+        start = end + 1;
+    }
+    ready_fd = fd;
+    return n;
+}
+
+//只把文件内容读进页缓存，不建立映射，新的worker第一次mmap时不用再等磁盘
+void upgrade::warm(const std::vector<std::string>& manifest){
+    for(size_t i = 0;i < manifest.size();++i){
+        int fd = open(manifest[i].c_str(),O_RDONLY | O_CLOEXEC);
+        if(fd < 0){
+            continue;
+        }
+        struct stat st;
+        if(fstat(fd,&st) == 0 && S_ISREG(st.st_mode)){
+            readahead(fd,0,st.st_size);
+        }
+        close(fd);
+    }
+}
+
+void upgrade::ready(){
+    if(ready_fd < 0){
+        return;
+    }
+    char reply = 'R';
+    if(write(ready_fd,&reply,1) != 1){
+        perror("upgrade ready");
+    }
+    close(ready_fd);
+    ready_fd = -1;
+}
+
+void upgrade::record(const char* path){
+    static __thread unsigned counter = 0;
+    if(++counter % SAMPLE_RATE != 0){
+        return;
+    }
+    std::string key(path);
+    hot_locker.lock();
+    std::unordered_map<std::string,unsigned>::iterator it = hot_counts.find(key);
+    if(it != hot_counts.end()){
+        ++it->second;
+    }else if((int)hot_counts.size() < MAX_MANIFEST * 4){
+        hot_counts[key] = 1;
+    }
+    hot_locker.unlock();
+}
+
+static bool hotter(const std::pair<std::string,unsigned>& a,const std::pair<std::string,unsigned>& b){
+    return a.second > b.second;
+}
+
+std::vector<std::string> upgrade::hot_paths(){
+    hot_locker.lock();
+    std::vector< std::pair<std::string,unsigned> > entries(hot_counts.begin(),hot_counts.end());
+    hot_locker.unlock();
+    std::sort(entries.begin(),entries.end(),hotter);
+    std::vector<std::string> paths;
+    for(size_t i = 0;i < entries.size() && (int)paths.size() < MAX_MANIFEST;++i){
+        paths.push_back(entries[i].first);
+    }
+    return paths;
+}
@@ -0,0 +1,46 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <string>
+#include <vector>
+
+//不停机升级：运行中的进程收到SIGUSR2后exec新的程序，通过Unix socket用SCM_RIGHTS把监听socket交给它，
+//同时发送最近的热点文件清单。新进程把这些文件读进页缓存后回复就绪，旧进程在此期间照常服务，
+//收到回复才停止接受连接，把现有连接处理完（响应改为Connection: close）后退出。
+//监听socket始终有进程持有，不会拒绝连接。
+class upgrade{
+public:
+    static const int READY_TIMEOUT = 30;        //等待新进程就绪的时间（秒）
+    static const int MAX_MANIFEST = 256;        //预热清单最多的文件数
+    static const int SAMPLE_RATE = 16;          //每个工作线程每这么多个请求记录一次热点
+
+    //保存启动参数，exec新程序时原样传给它
+    static void save_args(char** argv);
+
+    //旧进程：exec新程序并交出监听socket和预热清单，不等待新进程预热。
+    //返回接收就绪回复的socket，由调用者放进epoll，失败返回-1
+    static int start(const int* listenfds,int n,const std::vector<std::string>& manifest);
+    //旧进程：start返回的socket可读时调用并关闭它。新进程就绪返回true；
+    //新进程退出或者回复不对时结束新进程，返回false，旧进程继续服务
+    static bool finish(int fd);
+    //旧进程：新进程启动超过READY_TIMEOUT还没有就绪
+    static bool expired();
+    //旧进程：放弃升级，结束新进程并关闭socket
+    static void cancel(int fd);
+    //start之后阻塞等待就绪，用于不处理连接的prefork supervisor
+    static bool handoff(const int* listenfds,int n,const std::vector<std::string>& manifest);
+
+    //新进程：如果是由旧进程exec的，收下监听socket和预热清单，返回socket个数，否则返回0
+    static int inherit(int* listenfds,int max,std::vector<std::string>& manifest);
+    //新进程：按清单预热页缓存
+    static void warm(const std::vector<std::string>& manifest);
+    //新进程：通知旧进程已经就绪
+    static void ready();
+
+    //记录一次对文件的请求（抽样），工作线程调用
+    static void record(const char* path);
+    //请求最多的文件，作为预热清单
+    static std::vector<std::string> hot_paths();
+};
+
+#endif